@@ -20,12 +20,16 @@ class VNSOpen(LTMessage):
     def get_type():
         return 1
 
-    def __init__(self, topo_id, virtualHostID, UID, pw):
+    # flags: the client takes VNSBatch messages
+    BATCH = 1
+
+    def __init__(self, topo_id, virtualHostID, UID, pw, flags=0):
         LTMessage.__init__(self)
         self.topo_id = int(topo_id)
         self.vhost = str(virtualHostID)
         self.user = str(UID)
         self.pw = str(pw)
+        self.flags = int(flags)
 
     def length(self):
         return VNSOpen.SIZE
@@ -34,18 +38,18 @@ class VNSOpen(LTMessage):
     SIZE = struct.calcsize(FORMAT)
 
     def pack(self):
-        return struct.pack(VNSOpen.FORMAT, self.topo_id, 0, self.vhost, self.user, self.pw)
+        return struct.pack(VNSOpen.FORMAT, self.topo_id, self.flags, self.vhost, self.user, self.pw)
 
     @staticmethod
     def unpack(body):
-        t = struct.unpack(VNSOpen.FORMAT, body) # t[1] is pad => ignored
+        t = struct.unpack(VNSOpen.FORMAT, body) # t[1] is the flags (0 from old clients)
         vhost = strip_null_chars(t[2])
         user = strip_null_chars(t[3])
         pw = strip_null_chars(t[4])
-        return VNSOpen(t[0], vhost, user, pw)
+        return VNSOpen(t[0], vhost, user, pw, t[1])
 
     def __str__(self):
-        return 'OPEN: topo_id=%u host=%s user=%s' % (self.topo_id, self.vhost, self.user)
+        return 'OPEN: topo_id=%u host=%s user=%s flags=%u' % (self.topo_id, self.vhost, self.user, self.flags)
 VNS_MESSAGES.append(VNSOpen)
 
 class VNSClose(LTMessage):
@@ -381,6 +385,69 @@ class VNSAuthStatus(LTMessage):
         return 'AUTH_STATUS: ' + ' auth_ok=%s msg=%s' % (str(self.auth_ok), self.msg)
 VNS_MESSAGES.append(VNSAuthStatus)
 
+class VNSBatch(LTMessage):
+    """Many VNSPackets in one message, each with its own length and type.
+    Only sent to a peer that asked for it with VNSOpen.BATCH; an empty one
+    answers that request."""
+    @staticmethod
+    def get_type():
+        return 1024
+
+    # longest batch either side sends, header included
+    MAX_SIZE = 16384
+
+    @staticmethod
+    def get_batches(packets):
+        """Split packets up into the minimum number of VNSBatch messages they
+        will fit in, in order; a packet too long for any batch stays a VNSPacket."""
+        msgs = []
+        batch = VNSBatch([])
+        for pkt in packets:
+            if 8 + batch.length() + 8 + pkt.length() > VNSBatch.MAX_SIZE:
+                if batch.packets:
+                    msgs.append(batch)
+                    batch = VNSBatch([])
+                if 16 + pkt.length() > VNSBatch.MAX_SIZE:
+                    msgs.append(pkt)
+                    continue
+            batch.packets.append(pkt)
+        if batch.packets:
+            msgs.append(batch)
+        return msgs
+
+    def __init__(self, packets):
+        LTMessage.__init__(self)
+        self.packets = packets
+
+    def length(self):
+        return sum(8 + pkt.length() for pkt in self.packets)
+
+    PART_HEADER_FORMAT = '> II'
+    PART_HEADER_SIZE = struct.calcsize(PART_HEADER_FORMAT)
+
+    def pack(self):
+        return ''.join(struct.pack(VNSBatch.PART_HEADER_FORMAT, VNSBatch.PART_HEADER_SIZE + pkt.length(),
+                                   VNSPacket.get_type()) + pkt.pack() for pkt in self.packets)
+
+    @staticmethod
+    def unpack(body):
+        packets = []
+        off = 0
+        while off < len(body):
+            if len(body) - off < VNSBatch.PART_HEADER_SIZE:
+                raise VNSProtocolException('truncated batch')
+            plen, ptype = struct.unpack(VNSBatch.PART_HEADER_FORMAT, body[off:off+VNSBatch.PART_HEADER_SIZE])
+            if ptype != VNSPacket.get_type() or plen < VNSBatch.PART_HEADER_SIZE + VNSPacket.HEADER_SIZE \
+                    or off + plen > len(body):
+                raise VNSProtocolException('malformed batch')
+            packets.append(VNSPacket.unpack(body[off+VNSBatch.PART_HEADER_SIZE:off+plen]))
+            off += plen
+        return VNSBatch(packets)
+
+    def __str__(self):
+        return 'BATCH: %u packets, %uB' % (len(self.packets), self.length())
+VNS_MESSAGES.append(VNSBatch)
+
 VNS_PROTOCOL = LTProtocol(VNS_MESSAGES, 'I', 'I')
 
 def create_vns_server(port, recv_callback, new_conn_callback, lost_conn_callback, verbose=True):
@@ -23,6 +23,7 @@ from twisted.internet import reactor
 from VNSProtocol import VNS_DEFAULT_PORT, create_vns_server
 from VNSProtocol import VNSOpen, VNSClose, VNSPacket, VNSOpenTemplate, VNSBanner
 from VNSProtocol import VNSRtable, VNSAuthRequest, VNSAuthReply, VNSAuthStatus, VNSInterface, VNSHardwareInfo
+from VNSProtocol import VNSBatch
 
 log = core.getLogger()
 
@@ -49,6 +50,9 @@ class SRServerListener(EventMixin):
     self.listen_port = port
     self.intfname_to_port = {}
     self.port_to_intfname = {}
+    # clients that take VNSBatch -> packets waiting for the reactor thread
+    self.batch_clients = {}
+    self.batch_lock = threading.Lock()
     self.server = create_vns_server(port,
                                     self._handle_recv_msg,
                                     self._handle_new_client,
@@ -59,8 +63,33 @@ class SRServerListener(EventMixin):
   def broadcast(self, message):
     log.debug('Broadcasting message: %s', message)
     for client in self.srclients:
+      if isinstance(message, VNSPacket) and self._queue_packet(client, message):
+        continue
       client.send(message)
 
+  def _queue_packet(self, client, message):
+    '''Queues a packet for a client that takes batches; returns False for
+    one that does not.  Whatever queues up until the reactor gets to it
+    goes out together.'''
+    with self.batch_lock:
+      pending = self.batch_clients.get(client)
+      if pending is None:
+        return False
+      pending.append(message)
+      if len(pending) > 1:
+        return True # already on its way
+    reactor.callFromThread(self._flush_packets, client)
+    return True
+
+  def _flush_packets(self, client):
+    with self.batch_lock:
+      packets = self.batch_clients.get(client)
+      if not packets:
+        return
+      self.batch_clients[client] = []
+    for msg in VNSBatch.get_batches(packets):
+      client.send(msg)
+
   def _handle_SRPacketIn(self, event):
     log.debug("SRServerListener catch SRPacketIn event, port=%d, pkt=%r" % (event.port, event.pkt))
     try:
@@ -102,6 +131,9 @@ class SRServerListener(EventMixin):
       self._handle_close_msg(conn)
     elif vns_msg.get_type() == VNSPacket.get_type():
       self._handle_packet_msg(conn, vns_msg)
+    elif vns_msg.get_type() == VNSBatch.get_type():
+      for pkt in vns_msg.packets:
+        self._handle_packet_msg(conn, pkt)
     elif vns_msg.get_type() == VNSOpenTemplate.get_type():
       # TODO: see if this is needed...
       self._handle_open_template_msg(conn, vns_msg)
@@ -123,12 +155,19 @@ class SRServerListener(EventMixin):
 
   def _handle_client_disconnected(self, conn):
     log.info("disconnected")
+    with self.batch_lock:
+      self.batch_clients.pop(conn, None)
     conn.transport.loseConnection()
     return
 
   def _handle_open_msg(self, conn, vns_msg):
     # client wants to connect to some topology.
     log.debug("open-msg: %s, %s" % (vns_msg.topo_id, vns_msg.vhost))
+    if vns_msg.flags & VNSOpen.BATCH:
+      # an empty batch says yes; packets then go out in batches
+      conn.send(VNSBatch([]))
+      with self.batch_lock:
+        self.batch_clients[conn] = []
     try:
       conn.send(VNSHardwareInfo(self.interfaces))
     except:
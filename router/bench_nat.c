@@ -0,0 +1,555 @@
+/*-----------------------------------------------------------------------------
+ * File: bench_nat.c
+ *
+ * Description:
+ *
+ * Flow churn benchmark for the NAT.  Drives sr_natHandle in-process with
+ * synthetic traffic (no VNS server, Mininet or POX needed) and reports
+ * packets/s, new mappings/s, per packet latency percentiles, peak memory
+ * and what the NAT timeout thread costs.
+ *
+ * A fixed number of flow slots (hosts x flows per host) is kept busy.  Each
+ * flow plays a short script: a TCP handshake, data packets in both
+ * directions and (for the FIN share) a close, or an ICMP echo exchange.  A
+ * finished flow is replaced by a new one from the same host, limited to the
+ * arrival rate when one is given.  Flows that do not close leave their
+ * mappings to the idle timeouts, as abandoned connections do.
+ *
+ * Inbound packets use the external port / id the NAT picked for the flow,
+ * learnt from the translated outbound packet.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_natlog.h"
+#include "sr_utils.h"
+
+extern char* optarg;
+
+#define BENCH_INT_IP   0x0a000101 /* eth1, 10.0.1.1 */
+#define BENCH_EXT_IP   0xac400301 /* eth2, 172.64.3.1 */
+#define BENCH_INT_GW   0x0a000164 /* 10.0.1.100 */
+#define BENCH_EXT_GW   0xac400315 /* 172.64.3.21 */
+#define BENCH_POOL     0xac400400 /* -P pool addresses from 172.64.4.0 */
+#define BENCH_HOSTS    0x0a010000 /* internal hosts from 10.1.0.0 */
+#define BENCH_REMOTES  0x5db80000 /* servers from 93.184.0.0 */
+
+#define BENCH_FRAME (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t))
+
+/* latency histogram: 8 sub-buckets per power of two nanoseconds */
+#define LAT_SUB 8
+#define LAT_BUCKETS (64 * LAT_SUB)
+
+struct bench_flow {
+    uint32_t ip_int;   /* network order */
+    uint32_t ip_rem;   /* network order */
+    uint16_t port_int;
+    uint16_t port_rem;
+    uint32_t ip_ext;   /* learnt from the first translated packet */
+    uint16_t aux_ext;  /* learnt from the first translated packet, 0 if none */
+    bool icmp;
+    bool fin;
+    bool active;
+    int step;
+    int steps;
+    uint16_t seq;
+};
+
+/* The frame the NAT last sent out on eth2, to learn external ports. */
+static unsigned long bench_sent;
+static uint16_t bench_last_aux;
+static uint32_t bench_last_ip;
+
+static unsigned long long lat_hist[LAT_BUCKETS];
+static uint64_t lat_max;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static void usage(char* argv0)
+{
+    printf("Format: %s [-h] [-H hosts] [-f flows per host] [-d data packets per flow]\n", argv0);
+    printf("           [-F percent of flows closed with FIN] [-i percent of ICMP echo flows]\n");
+    printf("           [-a new flows per second, 0 = as fast as possible]\n");
+    printf("           [-t seconds] [-B NAT port block size] [-s seed]\n");
+    printf("           [-P external pool addresses] [-x (no flow cache)]\n");
+    printf("           [-R (reuse icmp ids per destination)] [-L nat event log]\n");
+    printf("   defaults -H 256 -f 16 -d 8 -F 80 -i 10 -a 0 -t 5\n");
+}
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int lat_bucket(uint64_t ns)
+{
+    unsigned int log = 0;
+    if (ns < LAT_SUB)
+        return ns;
+    while ((ns >> log) >= 2 * LAT_SUB)
+        log++;
+    return (log + 1) * LAT_SUB + (ns >> log) - LAT_SUB;
+}
+
+/* upper bound of a bucket, in ns */
+static uint64_t lat_value(unsigned int b)
+{
+    unsigned int log;
+    if (b < LAT_SUB)
+        return b;
+    log = b / LAT_SUB - 1;
+    return ((uint64_t)(b % LAT_SUB + LAT_SUB + 1) << log) - 1;
+}
+
+static uint64_t lat_percentile(unsigned long long total, double pct)
+{
+    unsigned long long want = (unsigned long long)(total * pct / 100.0);
+    unsigned long long seen = 0;
+    unsigned int b;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += lat_hist[b];
+        if (seen > want)
+            return lat_value(b);
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * The NAT sends through here instead of the VNS socket.
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+        const char* iface)
+{
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+
+    bench_sent++;
+    if (strcmp(iface, "eth2") != 0 || len < BENCH_FRAME)
+        return 0;
+    bench_last_ip = ip->ip_src;
+    if (ip->ip_p == ip_protocol_tcp)
+        bench_last_aux = ntohs(((sr_tcp_hdr_t *)(ip + 1))->source);
+    else if (ip->ip_p == ip_protocol_icmp)
+        bench_last_aux = ntohs(((sr_icmp_echo_hdr_t *)(ip + 1))->icmp_id);
+    return 0;
+}
+
+int sr_verify_routing_table(struct sr_instance* sr)
+{
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Traffic
+ *---------------------------------------------------------------------------*/
+
+static void bench_new_flow(struct bench_flow *flow, uint32_t host,
+        unsigned int data, unsigned int fin_pct, unsigned int icmp_pct)
+{
+    flow->ip_int = htonl(BENCH_HOSTS + host);
+    flow->ip_rem = htonl(BENCH_REMOTES + rng() % 4096);
+    flow->port_int = 1024 + rng() % 64000;
+    flow->port_rem = (rng() & 1) ? 443 : 80;
+    flow->aux_ext = 0;
+    flow->icmp = rng() % 100 < icmp_pct;
+    flow->fin = !flow->icmp && rng() % 100 < fin_pct;
+    flow->active = true;
+    flow->step = 0;
+    flow->seq++;
+    if (flow->icmp)  /* echo request and reply pairs */
+        flow->steps = 2 * (data ? data : 1);
+    else             /* handshake, data both ways, optional close */
+        flow->steps = 3 + 2 * data + (flow->fin ? 3 : 0);
+}
+
+static void bench_set_ip(sr_ip_hdr_t *ip, uint32_t src, uint32_t dst,
+        uint8_t proto, unsigned int len)
+{
+    ip->ip_v = 4;
+    ip->ip_hl = 5;
+    ip->ip_tos = 0;
+    ip->ip_len = htons(len);
+    ip->ip_id = 0;
+    ip->ip_off = 0;
+    ip->ip_ttl = 64;
+    ip->ip_p = proto;
+    ip->ip_src = src;
+    ip->ip_dst = dst;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum(ip, sizeof(sr_ip_hdr_t));
+}
+
+/* Builds the next packet of the flow's script into frame.  Returns its
+   length and whether it arrives on the internal side, 0 if the step has no
+   packet to send (inbound before the NAT gave the flow a port). */
+static unsigned int bench_packet(struct bench_flow *flow, uint8_t *frame,
+        bool *internal)
+{
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)frame;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(ip + 1);
+    sr_icmp_echo_hdr_t *icmp = (sr_icmp_echo_hdr_t *)(ip + 1);
+    unsigned int len = BENCH_FRAME;
+    int step = flow->step;
+    uint8_t flags;
+
+    memset(frame, 0, len);
+    eth->ether_type = htons(ethertype_ip);
+
+    if (flow->icmp) {
+        *internal = step % 2 == 0;
+        if (!*internal && flow->aux_ext == 0)
+            return 0;
+        icmp->icmp_type = *internal ? 8 : 0;
+        icmp->icmp_id = htons(*internal ? flow->port_int : flow->aux_ext);
+        icmp->icmp_seq = htons(step / 2);
+        icmp->icmp_sum = cksum(icmp, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+        if (*internal)
+            bench_set_ip(ip, flow->ip_int, flow->ip_rem, ip_protocol_icmp, len - sizeof(sr_ethernet_hdr_t));
+        else
+            bench_set_ip(ip, flow->ip_rem, flow->ip_ext, ip_protocol_icmp, len - sizeof(sr_ethernet_hdr_t));
+        return len;
+    }
+
+    if (step == 0) {               /* SYN */
+        *internal = true;
+        flags = tcp_flag_syn;
+    }
+    else if (step == 1) {          /* SYN+ACK */
+        *internal = false;
+        flags = tcp_flag_syn + tcp_flag_ack;
+    }
+    else if (step == 2) {          /* ACK */
+        *internal = true;
+        flags = tcp_flag_ack;
+    }
+    else if (step < flow->steps - (flow->fin ? 3 : 0)) {  /* data */
+        *internal = step % 2 == 1;
+        flags = tcp_flag_ack;
+    }
+    else {                         /* FIN, FIN+ACK, ACK */
+        int close = step - (flow->steps - 3);
+        *internal = close != 1;
+        flags = close == 0 ? tcp_flag_fin
+            : close == 1 ? tcp_flag_fin + tcp_flag_ack : tcp_flag_ack;
+    }
+    if (!*internal && flow->aux_ext == 0)
+        return 0;
+
+    tcp->flags = flags;
+    tcp->sequence_number = htonl(step);
+    tcp->window_size = htons(65535);
+    if (*internal) {
+        tcp->source = htons(flow->port_int);
+        tcp->destination = htons(flow->port_rem);
+        bench_set_ip(ip, flow->ip_int, flow->ip_rem, ip_protocol_tcp, len - sizeof(sr_ethernet_hdr_t));
+    }
+    else {
+        tcp->source = htons(flow->port_rem);
+        tcp->destination = htons(flow->aux_ext);
+        bench_set_ip(ip, flow->ip_rem, flow->ip_ext, ip_protocol_tcp, len - sizeof(sr_ethernet_hdr_t));
+    }
+    return len;
+}
+
+static void bench_setup(struct sr_instance *sr)
+{
+    unsigned char mac_int[6] = { 0x02, 0, 0, 0, 1, 1 };
+    unsigned char mac_ext[6] = { 0x02, 0, 0, 0, 2, 1 };
+    unsigned char mac_gw_int[6] = { 0x02, 0, 0, 0, 1, 100 };
+    unsigned char mac_gw_ext[6] = { 0x02, 0, 0, 0, 2, 21 };
+    struct in_addr dest, gw, mask;
+
+    memset(sr, 0, sizeof(*sr));
+    sr_add_interface(sr, "eth1");
+    sr_set_ether_ip(sr, htonl(BENCH_INT_IP));
+    sr_set_ether_addr(sr, mac_int);
+    sr_add_interface(sr, "eth2");
+    sr_set_ether_ip(sr, htonl(BENCH_EXT_IP));
+    sr_set_ether_addr(sr, mac_ext);
+
+    dest.s_addr = htonl(0x0a000000);
+    gw.s_addr = htonl(BENCH_INT_GW);
+    mask.s_addr = htonl(0xff000000);
+    sr_add_rt_entry(sr, dest, gw, mask, "eth1");
+    dest.s_addr = htonl(BENCH_REMOTES);
+    gw.s_addr = htonl(BENCH_EXT_GW);
+    mask.s_addr = htonl(0xffff0000);
+    sr_add_rt_entry(sr, dest, gw, mask, "eth2");
+
+    /* no ARP timeout thread: the next hops stay resolved */
+    sr_arpcache_init(&(sr->cache));
+    sr_arpcache_insert(&(sr->cache), mac_gw_int, htonl(BENCH_INT_GW));
+    sr_arpcache_insert(&(sr->cache), mac_gw_ext, htonl(BENCH_EXT_GW));
+}
+
+/*-----------------------------------------------------------------------------
+ *---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+    int c;
+    unsigned int hosts = 256, flows_per_host = 16, data = 8;
+    unsigned int fin_pct = 80, icmp_pct = 10, rate = 0, secs = 5;
+    unsigned int block = 0, npool = 0;
+    int flowcache = 1;
+    int icmp_reuse = 0;
+    char *nat_log = NULL;
+    struct sr_natlog *log = NULL;
+    unsigned long logged, log_dropped;
+    struct sr_instance sr;
+    static struct sr_nat nat;
+    struct bench_flow *flows;
+    unsigned int nflows, i;
+    uint8_t frame[BENCH_FRAME];
+    struct sr_if *eth1, *eth2;
+    unsigned long long packets = 0, skipped = 0, started = 0, finished = 0;
+    uint64_t start, end, deadline, last_tick;
+    double tokens = 0, elapsed;
+    struct timespec cpu0, cpu1;
+    clockid_t cid;
+    struct rusage ru;
+    struct sr_nat_stats stats;
+    struct sr_nat_usage live;
+    struct sr_nat_stats icmp;
+    unsigned long created = 0;
+    uint64_t sweep_ns;
+    int type;
+
+    while ((c = getopt(argc, argv, "hH:f:d:F:i:a:t:B:s:P:xRL:")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'H':
+                hosts = atoi((char *) optarg);
+                break;
+            case 'f':
+                flows_per_host = atoi((char *) optarg);
+                break;
+            case 'd':
+                data = atoi((char *) optarg);
+                break;
+            case 'F':
+                fin_pct = atoi((char *) optarg);
+                break;
+            case 'i':
+                icmp_pct = atoi((char *) optarg);
+                break;
+            case 'a':
+                rate = atoi((char *) optarg);
+                break;
+            case 't':
+                secs = atoi((char *) optarg);
+                break;
+            case 'B':
+                block = atoi((char *) optarg);
+                break;
+            case 's':
+                rng_state ^= strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL;
+                break;
+            case 'P':
+                npool = atoi((char *) optarg);
+                break;
+            case 'x':
+                flowcache = 0;
+                break;
+            case 'R':
+                icmp_reuse = 1;
+                break;
+            case 'L':
+                nat_log = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        } /* switch */
+    } /* -- while -- */
+
+    if (hosts == 0 || flows_per_host == 0 || hosts > 0xffff
+        || npool > SR_NAT_POOL_MAX) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    bench_setup(&sr);
+    if (flowcache && sr_flowcache_init(&(sr.flows)) != 0)
+        exit(1);
+    sr.nat = &nat;
+    sr_nat_init(&sr, 60, 7440, 300, 300);
+    if (npool) {
+        static uint32_t pool[SR_NAT_POOL_MAX];
+        for (i = 0; i < npool; i++)
+            pool[i] = htonl(BENCH_POOL + i);
+        sr_nat_set_pool(&nat, pool, npool);
+    }
+    sr_nat_ext_ip(&nat, &sr);
+    if (block && sr_nat_set_port_blocks(&nat, block, false) != 0)
+        exit(1);
+    if (icmp_reuse && sr_nat_set_icmp_reuse(&nat) != 0)
+        exit(1);
+    if (nat_log) {
+        if ((log = sr_natlog_open(nat_log)) == NULL)
+            exit(1);
+        sr_nat_set_log(&nat, log);
+    }
+    eth1 = sr_get_interface(&sr, "eth1");
+    eth2 = sr_get_interface(&sr, "eth2");
+
+    nflows = hosts * flows_per_host;
+    flows = calloc(nflows, sizeof(struct bench_flow));
+    for (i = 0; i < nflows; i++) {
+        if (rate == 0) {
+            bench_new_flow(&flows[i], i % hosts, data, fin_pct, icmp_pct);
+            started++;
+        }
+    }
+
+    pthread_getcpuclockid(nat.thread, &cid);
+    clock_gettime(cid, &cpu0);
+
+    start = last_tick = now_ns();
+    deadline = start + (uint64_t)secs * 1000000000ULL;
+    for (;;) {
+        struct bench_flow *flow = &flows[rng() % nflows];
+        unsigned int len;
+        bool internal;
+        unsigned long sent;
+        uint64_t t0, t1;
+
+        if ((packets & 1023) == 0) {
+            uint64_t now = now_ns();
+            if (now >= deadline)
+                break;
+            if (rate) {
+                tokens += (double)(now - last_tick) * rate / 1e9;
+                if (tokens > nflows)
+                    tokens = nflows;
+            }
+            last_tick = now;
+        }
+
+        if (!flow->active) {
+            if (rate && tokens < 1) {
+                packets++;  /* keeps the clock check going */
+                skipped++;
+                continue;
+            }
+            if (rate)
+                tokens -= 1;
+            bench_new_flow(flow, (flow - flows) % hosts, data, fin_pct, icmp_pct);
+            started++;
+        }
+
+        len = bench_packet(flow, frame, &internal);
+        if (len) {
+            sent = bench_sent;
+            t0 = now_ns();
+            sr_natHandle(&sr, frame, len, internal ? eth1 : eth2,
+                         internal ? "eth1" : "eth2");
+            t1 = now_ns();
+            lat_hist[lat_bucket(t1 - t0)]++;
+            if (t1 - t0 > lat_max)
+                lat_max = t1 - t0;
+            if (internal && bench_sent != sent) {
+                flow->ip_ext = bench_last_ip;
+                flow->aux_ext = bench_last_aux;
+            }
+        }
+        else {
+            skipped++;
+        }
+        packets++;
+        if (++flow->step == flow->steps) {
+            flow->active = false;
+            finished++;
+        }
+    }
+    end = now_ns();
+    elapsed = (end - start) / 1e9;
+    packets -= skipped;
+
+    clock_gettime(cid, &cpu1);
+    sweep_ns = now_ns();
+    for (i = 0; i < SR_NAT_SHARDS; i++)
+        sr_nat_sweep(&nat, &(nat.shards[i]), time(NULL));
+    sweep_ns = now_ns() - sweep_ns;
+
+    for (type = 0; type < SR_NAT_MAPPING_TYPES; type++) {
+        sr_nat_get_stats(&nat, type, &stats);
+        created += stats.created;
+    }
+    sr_nat_get_stats(&nat, nat_mapping_icmp, &icmp);
+    sr_nat_get_usage(&nat, &live);
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("bench_nat: %u hosts x %u flows, %u data packets/flow, %u%% FIN, "
+           "%u%% ICMP, arrival %s%u flows/s, %.1f s\n", hosts, flows_per_host,
+           data, fin_pct, icmp_pct, rate ? "" : "max ", rate, elapsed);
+    printf("packets         %llu (%.0f pps), %lu forwarded\n", packets,
+           packets / elapsed, bench_sent);
+    printf("flows           %llu started, %llu finished\n", started, finished);
+    printf("new mappings    %lu (%.0f/s), %lu live, %lu connections, %lu evicted\n",
+           created, created / elapsed, live.mappings, live.conns,
+           live.evicted);
+    printf("latency ns      p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           (unsigned long long)lat_percentile(packets, 50),
+           (unsigned long long)lat_percentile(packets, 90),
+           (unsigned long long)lat_percentile(packets, 99),
+           (unsigned long long)lat_percentile(packets, 99.9),
+           (unsigned long long)lat_max);
+    printf("icmp ids        %lu exhausted, %lu reused, %lu refused\n",
+           icmp.exhausted, icmp.reused, icmp.no_port);
+    if (flowcache)
+        printf("flow cache      %lu hits, %lu misses, %lu stale\n",
+               sr.flows.hits, sr.flows.misses, sr.flows.stale);
+    if (log) {
+        /* let the writer pick up the last events */
+        usleep(2 * SR_NATLOG_FLUSH_MS * 1000);
+        sr_natlog_counts(log, &logged, &log_dropped);
+        printf("nat log         %lu written, %lu dropped\n", logged,
+               log_dropped);
+    }
+    printf("peak rss        %ld KB\n", ru.ru_maxrss);
+    printf("timeout thread  %.2f ms cpu (%.3f%%), full sweep %.3f ms\n",
+           ((cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec)) / 1e6,
+           ((cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec)) / 1e7 / elapsed,
+           sweep_ns / 1e6);
+
+    free(flows);
+    sr_flowcache_destroy(&(sr.flows));
+    if (log)
+        sr_natlog_close(log);
+    return 0;
+} /* -- main -- */
@@ -0,0 +1,138 @@
+/*-----------------------------------------------------------------------------
+ * File: check_nat_tcp.c
+ *
+ * Description:
+ *
+ * Exhaustive check of the NAT's TCP connection tracking table.  For every
+ * state, last_state, side and flag byte, the move sr_nat_tcp_next makes is
+ * compared with the switch statements the external and internal connection
+ * handlers used before the table replaced them.  Prints each difference and
+ * exits non-zero if there is one.
+ *
+ * sr_nat.c is included so that the static tables are visible; build with
+ * make check_nat_tcp.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include "sr_nat.c"
+
+/* Nothing is sent, the router code just needs to link */
+int sr_send_packet(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+        const char* iface)
+{
+    return 0;
+}
+
+/* What a packet does to a connection */
+struct check_move {
+    int state;      /* next state, or -1 if the connection is removed */
+    bool last_state;
+    bool drop;
+    bool uncache;
+};
+
+/* The old sr_nat_handle_external_conn / sr_nat_handle_internal_conn
+   switches, after the connection lookup */
+static struct check_move check_old(int state, bool last_state,
+                                   bool internal, uint8_t flags)
+{
+    struct check_move m;
+    /* the external side answers what the internal one did last and the
+       other way round */
+    bool answers = internal ? !last_state : last_state;
+
+    m.state = state;
+    m.last_state = last_state;
+    m.drop = false;
+    m.uncache = false;
+
+    switch (state)
+    {
+        case nat_conn_unest:
+            if (internal) {
+                if (flags == tcp_flag_syn && !last_state)
+                { m.state = nat_conn_syn; m.last_state = true; }
+            }
+            else if (!last_state)
+            { m.drop = true; }
+            break;
+        case nat_conn_syn:
+            if (flags == tcp_flag_syn+tcp_flag_ack && answers)
+            { m.state = nat_conn_synack; m.last_state = internal; }
+            break;
+        case nat_conn_synack:
+            if (flags == tcp_flag_ack && answers)
+            { m.state = nat_conn_est; m.last_state = internal; }
+            break;
+        case nat_conn_est:
+            if (flags == tcp_flag_fin) {
+                m.state = nat_conn_fin1;
+                m.last_state = internal;
+                m.uncache = true;
+            }
+            break;
+        case nat_conn_fin1:
+            if (flags == tcp_flag_fin && answers)
+            { m.state = nat_conn_fin1ack; m.last_state = internal; }
+            else if (flags == tcp_flag_fin+tcp_flag_ack && answers)
+            { m.state = nat_conn_fin2; m.last_state = internal; }
+            break;
+        case nat_conn_fin1ack:
+            if (flags == tcp_flag_fin && answers)
+            { m.state = nat_conn_fin1ack; m.last_state = internal; }
+            break;
+        case nat_conn_fin2:
+            if (flags == tcp_flag_ack && answers)
+            { m.state = -1; }
+            break;
+    }
+    return m;
+}
+
+/* The same move as sr_nat_tcp_step makes it */
+static struct check_move check_table(int state, bool last_state,
+                                     bool internal, uint8_t flags)
+{
+    struct check_move m;
+    uint8_t next = sr_nat_tcp_next[state][last_state][internal]
+        [sr_nat_tcp_class[flags]];
+
+    m.state = (next & SR_NAT_TCP_CLOSE) ? -1 : (next & SR_NAT_TCP_STATE);
+    m.last_state = (next & SR_NAT_TCP_MOVE) ? internal : last_state;
+    m.drop = (next & SR_NAT_TCP_DROP) != 0;
+    m.uncache = (next & SR_NAT_TCP_UNCACHE) != 0;
+    if (m.state == -1)
+    { m.last_state = last_state; m.drop = false; m.uncache = false; }
+    return m;
+}
+
+int main(int argc, char **argv)
+{
+    int state, last_state, internal, flags;
+    unsigned int checked = 0, bad = 0;
+
+    for (state = nat_conn_unest; state <= nat_conn_fin2; state++)
+        for (last_state = 0; last_state < 2; last_state++)
+            for (internal = 0; internal < 2; internal++)
+                for (flags = 0; flags < 256; flags++)
+                {
+                    struct check_move o = check_old(state, last_state,
+                                                    internal, flags);
+                    struct check_move t = check_table(state, last_state,
+                                                      internal, flags);
+                    checked++;
+                    if (o.state == t.state && o.last_state == t.last_state
+                        && o.drop == t.drop && o.uncache == t.uncache)
+                    { continue; }
+                    bad++;
+                    printf("state %d last_state %d %s flags 0x%02x: "
+                           "old %d/%d/%d/%d table %d/%d/%d/%d\n",
+                           state, last_state,
+                           internal ? "internal" : "external", flags,
+                           o.state, o.last_state, o.drop, o.uncache,
+                           t.state, t.last_state, t.drop, t.uncache);
+                }
+
+    printf("%u cases, %u differ\n", checked, bad);
+    return bad ? 1 : 0;
+}
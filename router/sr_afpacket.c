@@ -0,0 +1,330 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_afpacket.c
+ *
+ * Description:
+ *
+ * AF_PACKET backend for local packet i/o (sr_io.h).  Every interface gets a
+ * packet socket with memory mapped TPACKET_V3 rings:
+ *
+ * - receive: the kernel fills blocks of frames; a block is handed over once
+ *   full or after SR_AFP_BLOCK_TOV_MS.  The receive loop walks a whole block
+ *   and passes every frame to sr_handlepacket where it lies in the ring, then
+ *   gives the block back.  It only makes a syscall, poll(..), when no block
+ *   is ready.
+ * - transmit: frames are copied into the next free slot of the ring.  The
+ *   receive loop tells the kernel to send them (one send(..) per interface)
+ *   after each pass over the interfaces; other threads do so straight away.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+
+#define SR_AFP_BLOCK_SIZE (1 << 18)
+#define SR_AFP_RX_BLOCKS 64
+#define SR_AFP_TX_BLOCKS 16
+#define SR_AFP_FRAME_SIZE 2048
+#define SR_AFP_TX_FRAMES (SR_AFP_TX_BLOCKS * (SR_AFP_BLOCK_SIZE / SR_AFP_FRAME_SIZE))
+#define SR_AFP_BLOCK_TOV_MS 2
+
+/* where a frame's data starts in a slot of the ring */
+#define SR_AFP_DATA (TPACKET_ALIGN(sizeof(struct tpacket3_hdr)))
+
+struct sr_afp_port {
+  char name[sr_IFACE_NAMELEN];
+  int fd;
+  uint8_t *rx;            /* SR_AFP_RX_BLOCKS blocks */
+  uint8_t *tx;            /* SR_AFP_TX_FRAMES slots, mapped behind rx */
+  unsigned int rx_next;   /* next block to look at */
+  unsigned int tx_next;   /* next slot to fill */
+  unsigned int tx_queued; /* filled since the last send(..) */
+  unsigned long tx_dropped;  /* ring full */
+};
+
+struct sr_afpacket {
+  struct sr_io io;  /* first: passed around as its sr_io */
+  pthread_mutex_t lock;  /* transmit rings */
+  unsigned int nports;
+  struct sr_afp_port ports[SR_IO_PORTS];
+};
+
+/* set in the receive loop, which sends once per pass */
+static __thread int sr_afp_receiving = 0;
+
+static void sr_afp_kick(struct sr_afp_port *port)
+{
+  port->tx_queued = 0;
+  /* ENOBUFS and the like: the frames stay in the ring for the next one */
+  sendto(port->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static int sr_afp_send(struct sr_io *io, uint8_t *buf, unsigned int len,
+  const char *iface)
+{
+  struct sr_afpacket *afp = (struct sr_afpacket *)io;
+  struct sr_afp_port *port = NULL;
+  struct tpacket3_hdr *hdr;
+  unsigned int i;
+
+  for (i = 0; i < afp->nports; i++) {
+    if (strcmp(afp->ports[i].name, iface) == 0) {
+      port = &(afp->ports[i]);
+      break;
+    }
+  }
+  if (port == NULL || len > SR_AFP_FRAME_SIZE - SR_AFP_DATA)
+    return -1;
+
+  pthread_mutex_lock(&(afp->lock));
+  hdr = (struct tpacket3_hdr *)(port->tx + port->tx_next * SR_AFP_FRAME_SIZE);
+  if (__atomic_load_n(&(hdr->tp_status), __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+    sr_afp_kick(port);
+    if (__atomic_load_n(&(hdr->tp_status), __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+      port->tx_dropped++;
+      pthread_mutex_unlock(&(afp->lock));
+      return -1;
+    }
+  }
+  memcpy((uint8_t *)hdr + SR_AFP_DATA, buf, len);
+  hdr->tp_len = len;
+  hdr->tp_snaplen = len;
+  hdr->tp_next_offset = 0;
+  __atomic_store_n(&(hdr->tp_status), TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+  port->tx_next = (port->tx_next + 1) % SR_AFP_TX_FRAMES;
+  port->tx_queued++;
+  if (!sr_afp_receiving)
+    sr_afp_kick(port);
+  pthread_mutex_unlock(&(afp->lock));
+  return 0;
+}
+
+/* Frames from virtual devices (veth, tap) may carry only the pseudo header
+   sum in their tcp/udp checksum, for the device to complete on the way out
+   (TP_STATUS_CSUMNOTREADY).  The router forwards frames as they are, so the
+   checksum is completed here. */
+static void sr_afp_csum(uint8_t *frame, unsigned int len)
+{
+  sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)frame;
+  sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+  unsigned int hl, l4len, off, i;
+  uint8_t *l4;
+  uint16_t word;
+  uint32_t sum;
+
+  if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)
+    || eth->ether_type != htons(ethertype_ip)
+    || (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)))
+    return;
+  hl = ip->ip_hl * 4;
+  if (ip->ip_p == ip_protocol_tcp)
+    off = 16;
+  else if (ip->ip_p == ip_protocol_udp)
+    off = 6;
+  else
+    return;
+  if (ntohs(ip->ip_len) < hl + off + 2
+    || sizeof(sr_ethernet_hdr_t) + ntohs(ip->ip_len) > len)
+    return;
+  l4 = frame + sizeof(sr_ethernet_hdr_t) + hl;
+  l4len = ntohs(ip->ip_len) - hl;
+
+  memset(l4 + off, 0, 2);
+  sum = (ip->ip_src >> 16) + (ip->ip_src & 0xffff) + (ip->ip_dst >> 16)
+    + (ip->ip_dst & 0xffff) + htons(ip->ip_p) + htons(l4len);
+  for (i = 0; i + 1 < l4len; i += 2) {
+    memcpy(&word, l4 + i, 2);
+    sum += word;
+  }
+  if (l4len & 1) {
+    word = 0;
+    memcpy(&word, l4 + l4len - 1, 1);
+    sum += word;
+  }
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  word = ~sum;
+  if (word == 0 && ip->ip_p == ip_protocol_udp)
+    word = 0xffff;
+  memcpy(l4 + off, &word, 2);
+}
+
+/* Handles the port's next block if the kernel has handed it over.
+   Returns 1 if it did. */
+static int sr_afp_rx_block(struct sr_instance *sr, struct sr_afp_port *port)
+{
+  struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+    (port->rx + port->rx_next * SR_AFP_BLOCK_SIZE);
+  struct tpacket3_hdr *pkt;
+  unsigned int i;
+
+  if ((__atomic_load_n(&(block->hdr.bh1.block_status), __ATOMIC_ACQUIRE)
+    & TP_STATUS_USER) == 0)
+    return 0;
+
+  pkt = (struct tpacket3_hdr *)((uint8_t *)block
+    + block->hdr.bh1.offset_to_first_pkt);
+  for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+    struct sockaddr_ll *sll = (struct sockaddr_ll *)((uint8_t *)pkt + SR_AFP_DATA);
+    /* our own frames, on kernels without PACKET_IGNORE_OUTGOING */
+    if (sll->sll_pkttype != PACKET_OUTGOING) {
+      if (pkt->tp_status & TP_STATUS_CSUMNOTREADY)
+        sr_afp_csum((uint8_t *)pkt + pkt->tp_mac, pkt->tp_snaplen);
+      sr_log_packet(sr, (uint8_t *)pkt + pkt->tp_mac, pkt->tp_snaplen);
+      sr_handlepacket(sr, (uint8_t *)pkt + pkt->tp_mac, pkt->tp_snaplen,
+        port->name);
+    }
+    pkt = (struct tpacket3_hdr *)((uint8_t *)pkt + pkt->tp_next_offset);
+  }
+
+  __atomic_store_n(&(block->hdr.bh1.block_status), TP_STATUS_KERNEL,
+    __ATOMIC_RELEASE);
+  port->rx_next = (port->rx_next + 1) % SR_AFP_RX_BLOCKS;
+  return 1;
+}
+
+static int sr_afp_run(struct sr_io *io, struct sr_instance *sr)
+{
+  struct sr_afpacket *afp = (struct sr_afpacket *)io;
+  struct pollfd fds[SR_IO_PORTS];
+  unsigned int i;
+  int busy;
+
+  for (i = 0; i < afp->nports; i++) {
+    fds[i].fd = afp->ports[i].fd;
+    fds[i].events = POLLIN;
+  }
+  sr_afp_receiving = 1;
+  while (!sr->stopping) {
+    /* one block per interface and pass, so none starves the others */
+    busy = 0;
+    for (i = 0; i < afp->nports; i++)
+      busy |= sr_afp_rx_block(sr, &(afp->ports[i]));
+
+    pthread_mutex_lock(&(afp->lock));
+    for (i = 0; i < afp->nports; i++)
+      if (afp->ports[i].tx_queued)
+        sr_afp_kick(&(afp->ports[i]));
+    pthread_mutex_unlock(&(afp->lock));
+
+    if (!busy && sr_io_wait(sr, fds, afp->nports, -1) < 0 && errno != EINTR) {
+      perror("poll(..):sr_afpacket.c::sr_afp_run");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int sr_afp_open_port(struct sr_afp_port *port,
+  const struct sr_io_port *cfg)
+{
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  size_t rx_len = (size_t)SR_AFP_RX_BLOCKS * SR_AFP_BLOCK_SIZE;
+  size_t tx_len = (size_t)SR_AFP_TX_BLOCKS * SR_AFP_BLOCK_SIZE;
+  int version = TPACKET_V3, one = 1;
+  unsigned int ifindex = if_nametoindex(cfg->dev);
+  uint8_t *map;
+
+  strncpy(port->name, cfg->name, sr_IFACE_NAMELEN - 1);
+  if (ifindex == 0) {
+    fprintf(stderr, "AF_PACKET: no device %s\n", cfg->dev);
+    return -1;
+  }
+  if ((port->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+    perror("socket(..):sr_afpacket.c::sr_afp_open_port");
+    return -1;
+  }
+  if (setsockopt(port->fd, SOL_PACKET, PACKET_VERSION, &version,
+      sizeof(version)) != 0)
+    goto fail;
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = SR_AFP_BLOCK_SIZE;
+  req.tp_frame_size = SR_AFP_FRAME_SIZE;
+  req.tp_block_nr = SR_AFP_RX_BLOCKS;
+  req.tp_frame_nr = SR_AFP_RX_BLOCKS * (SR_AFP_BLOCK_SIZE / SR_AFP_FRAME_SIZE);
+  req.tp_retire_blk_tov = SR_AFP_BLOCK_TOV_MS;
+  if (setsockopt(port->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+    goto fail;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = SR_AFP_BLOCK_SIZE;
+  req.tp_frame_size = SR_AFP_FRAME_SIZE;
+  req.tp_block_nr = SR_AFP_TX_BLOCKS;
+  req.tp_frame_nr = SR_AFP_TX_FRAMES;
+  if (setsockopt(port->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0)
+    goto fail;
+
+  map = mmap(NULL, rx_len + tx_len, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, port->fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  port->rx = map;
+  port->tx = map + rx_len;
+
+#ifdef PACKET_IGNORE_OUTGOING
+  setsockopt(port->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+#ifdef PACKET_QDISC_BYPASS
+  setsockopt(port->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+#endif
+  (void)one;
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind(port->fd, (struct sockaddr *)&sll, sizeof(sll)) != 0)
+    goto fail;
+
+  if (cfg->promisc) {
+    struct packet_mreq mr;
+    memset(&mr, 0, sizeof(mr));
+    mr.mr_ifindex = ifindex;
+    mr.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr,
+        sizeof(mr)) != 0)
+      goto fail;
+  }
+  return 0;
+
+fail:
+  fprintf(stderr, "AF_PACKET on %s: %s\n", cfg->dev, strerror(errno));
+  close(port->fd);
+  return -1;
+}
+
+struct sr_io *sr_afpacket_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports)
+{
+  struct sr_afpacket *afp = calloc(1, sizeof(struct sr_afpacket));
+  unsigned int i;
+
+  afp->io.name = "AF_PACKET (TPACKET_V3)";
+  afp->io.send = sr_afp_send;
+  afp->io.run = sr_afp_run;
+  pthread_mutex_init(&(afp->lock), NULL);
+  for (i = 0; i < nports; i++) {
+    if (sr_afp_open_port(&(afp->ports[i]), &(ports[i])) != 0) {
+      while (i-- > 0)
+        close(afp->ports[i].fd);
+      free(afp);
+      return NULL;
+    }
+  }
+  afp->nports = nports;
+  return &(afp->io);
+}
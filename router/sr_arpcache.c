@@ -96,29 +96,43 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 
 /* You should not need to touch the rest of this code. */
 
+/* Entries are changed between these two, with the lock held. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELEASE);
+}
+
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
-    
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
+    struct sr_arpentry entry, *copy = NULL;
+    unsigned long seq;
+    int i, found;
+
+    /* read again if a writer got in the way */
+    do {
+        seq = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE);
+        found = 0;
+        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+            if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
+                entry = cache->entries[i];
+                found = 1;
+            }
         }
-    }
-    
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&(cache->seq), __ATOMIC_RELAXED));
+
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
-    if (entry) {
+    if (found) {
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+        memcpy(copy, &entry, sizeof(struct sr_arpentry));
     }
-        
-    pthread_mutex_unlock(&(cache->lock));
-    
+
     return copy;
 }
 
@@ -203,10 +217,13 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
     }
     
     if (i != SR_ARPCACHE_SZ) {
+        sr_arpcache_write_begin(cache);
         memcpy(cache->entries[i].mac, mac, 6);
         cache->entries[i].ip = ip;
         cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
+        sr_arpcache_write_end(cache);
+        __atomic_fetch_add(&(cache->gen), 1, __ATOMIC_RELEASE);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -277,6 +294,8 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     /* Invalidate all entries */
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
+    cache->gen = 0;
+    cache->seq = 0;
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -291,25 +310,34 @@ int sr_arpcache_destroy(struct sr_arpcache *cache) {
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* Invalidates entries that were added more than SR_ARPCACHE_TO seconds ago
+   and resends or gives up on pending requests.  Called once a second. */
+void sr_arpcache_tick(struct sr_instance *sr) {
+    struct sr_arpcache *cache = &(sr->cache);
+
+    pthread_mutex_lock(&(cache->lock));
+    time_t curtime = time(NULL);
+
+    int i;
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
+            sr_arpcache_write_begin(cache);
+            cache->entries[i].valid = 0;
+            sr_arpcache_write_end(cache);
+            __atomic_fetch_add(&(cache->gen), 1, __ATOMIC_RELEASE);
+        }
+    }
+    sr_arpcache_sweepreqs(sr);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Thread which runs sr_arpcache_tick once a second. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
-    struct sr_arpcache *cache = &(sr->cache);
-    
+
     while (1) {
         sleep(1.0);
-        pthread_mutex_lock(&(cache->lock));
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
-        }
-        sr_arpcache_sweepreqs(sr);
-        pthread_mutex_unlock(&(cache->lock));
+        sr_arpcache_tick(sr);
     }
     return NULL;
 }
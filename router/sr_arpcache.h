@@ -102,12 +102,17 @@ struct sr_arpreq {
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    unsigned long gen;          /* bumped when an entry is added or expires */
+    unsigned long seq;          /* odd while entries are changed, see
+                                   sr_arpcache_lookup */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
-   You must free the returned structure if it is not NULL. */
+   You must free the returned structure if it is not NULL.  Takes no lock:
+   entries are read under a sequence count, so forwarding threads do not
+   wait on each other or on the timeout thread. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
@@ -146,6 +151,7 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
+void  sr_arpcache_tick(struct sr_instance *sr);
 
 /* Helper function to handle ARP requests */
 void handle_arpreq(struct sr_instance*, struct sr_arpreq *);
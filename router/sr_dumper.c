@@ -2,6 +2,7 @@
 #include <sys/types.h>
 
 #include <stdio.h>
+#include <string.h>
 #include "sr_dumper.h"
 
 static void
@@ -63,6 +64,98 @@ sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp)
         (void)fwrite((char *)sp, h->caplen, 1, fp);
 }
 
+/*
+ * The same record, into memory.
+ */
+unsigned int
+sr_dump_rec(unsigned char *rec, const struct pcap_pkthdr *h,
+    const unsigned char *sp)
+{
+        struct pcap_sf_pkthdr sf_hdr;
+
+        sf_hdr.ts.tv_sec  = h->ts.tv_sec;
+        sf_hdr.ts.tv_usec = h->ts.tv_usec;
+        sf_hdr.caplen     = h->caplen;
+        sf_hdr.len        = h->len;
+        memcpy(rec, &sf_hdr, sizeof(sf_hdr));
+        memcpy(rec + sizeof(sf_hdr), sp, h->caplen);
+        return sizeof(sf_hdr) + h->caplen;
+}
+
+static uint32_t
+sf_swap32(uint32_t v, int flags)
+{
+        if (!(flags & SR_DUMP_SWAPPED))
+                return v;
+        return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000)
+            | (v << 24);
+}
+
+/*
+ * Open a dump file for reading, written by sr_dump() or tcpdump.
+ */
+FILE *
+sr_dump_read_open(const char *fname, int *flags)
+{
+        struct pcap_file_header hdr;
+        FILE *fp = fopen(fname, "r");
+
+        if (fp == NULL) {
+                perror(fname);
+                return (NULL);
+        }
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+                fprintf(stderr, "sr_dump_read_open: %s: no header\n", fname);
+                fclose(fp);
+                return (NULL);
+        }
+        *flags = 0;
+        if (hdr.magic == TCPDUMP_MAGIC_NSEC || sf_swap32(hdr.magic,
+            SR_DUMP_SWAPPED) == TCPDUMP_MAGIC_NSEC)
+                *flags |= SR_DUMP_NSEC;
+        if (sf_swap32(hdr.magic, SR_DUMP_SWAPPED) == TCPDUMP_MAGIC
+            || sf_swap32(hdr.magic, SR_DUMP_SWAPPED) == TCPDUMP_MAGIC_NSEC)
+                *flags |= SR_DUMP_SWAPPED;
+        else if (hdr.magic != TCPDUMP_MAGIC && hdr.magic != TCPDUMP_MAGIC_NSEC) {
+                fprintf(stderr, "sr_dump_read_open: %s: not a pcap file\n",
+                    fname);
+                fclose(fp);
+                return (NULL);
+        }
+        if (sf_swap32(hdr.linktype, *flags) != LINKTYPE_ETHERNET) {
+                fprintf(stderr, "sr_dump_read_open: %s: not ethernet\n",
+                    fname);
+                fclose(fp);
+                return (NULL);
+        }
+        return fp;
+}
+
+/*
+ * Read the next packet; what does not fit in size bytes is skipped.
+ */
+int
+sr_dump_read(FILE *fp, int flags, struct pcap_pkthdr *h, unsigned char *sp,
+    unsigned int size)
+{
+        struct pcap_sf_pkthdr sf_hdr;
+        uint32_t caplen;
+
+        if (fread(&sf_hdr, sizeof(sf_hdr), 1, fp) != 1)
+                return feof(fp) ? 0 : -1;
+        h->ts.tv_sec = sf_swap32(sf_hdr.ts.tv_sec, flags);
+        h->ts.tv_usec = sf_swap32(sf_hdr.ts.tv_usec, flags);
+        if (flags & SR_DUMP_NSEC)
+                h->ts.tv_usec /= 1000;
+        caplen = sf_swap32(sf_hdr.caplen, flags);
+        h->len = sf_swap32(sf_hdr.len, flags);
+        h->caplen = min(caplen, size);
+        if (fread(sp, 1, h->caplen, fp) != h->caplen
+            || fseek(fp, caplen - h->caplen, SEEK_CUR) != 0)
+                return -1;
+        return 1;
+}
+
 void
 sr_dump_close(FILE *fp)
 {
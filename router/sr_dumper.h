@@ -20,6 +20,7 @@
 #define PCAP_PROTO_LEN 2
 
 #define TCPDUMP_MAGIC 0xa1b2c3d4
+#define TCPDUMP_MAGIC_NSEC 0xa1b23c4d  /* time stamps in nanoseconds */
 
 #define LINKTYPE_ETHERNET 1
 
@@ -73,6 +74,27 @@ FILE* sr_dump_open(const char *fname, int thiszone, int snaplen);
  */
 void sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp);
 
+/**
+ * Write the record for a packet into rec, which has room for
+ * sizeof(struct pcap_sf_pkthdr) + h->caplen bytes; returns its length
+ */
+unsigned int sr_dump_rec(unsigned char *rec, const struct pcap_pkthdr *h,
+                         const unsigned char *sp);
+
+/**
+ * Open a dump file for reading; *flags says how to read its records
+ */
+#define SR_DUMP_SWAPPED 1  /* written in the other byte order */
+#define SR_DUMP_NSEC 2     /* time stamps in nanoseconds */
+FILE* sr_dump_read_open(const char *fname, int *flags);
+
+/**
+ * Read the next packet of a dump file: its header into h, up to size bytes
+ * of it into sp; returns 1, 0 at the end of the file, -1 if it is cut short
+ */
+int sr_dump_read(FILE *fp, int flags, struct pcap_pkthdr *h,
+                 unsigned char *sp, unsigned int size);
+
 /**
  * Close the file
  */
@@ -0,0 +1,175 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoll.c
+ *
+ * Description:
+ *
+ * Event loop mode, see sr_epoll.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "sr_router.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_epoll.h"
+
+#define SR_EPOLL_EVENTS 64
+#define SR_EPOLL_TIMER 0  /* epoll_event data */
+#define SR_EPOLL_IO 1
+
+struct sr_epoll {
+  int fd;
+  int timer;              /* timerfd */
+  unsigned long tick;     /* usec between expiries */
+  unsigned long arp_usec; /* since sr_arpcache_tick last ran */
+  int watching;           /* the packet i/o is in the epoll */
+};
+
+/* Runs what the expiries since the last call are due. */
+static void sr_epoll_timer(struct sr_instance *sr, struct sr_epoll *ep)
+{
+  uint64_t n, i;
+
+  if (read(ep->timer, &n, sizeof(n)) != sizeof(n))
+    return;
+
+  /* expiries missed while the loop was busy are caught up, but no shard
+     is swept twice in a row */
+  if (sr->nat)
+    for (i = 0; i < n && i < SR_NAT_SHARDS && !sr->stopping; i++)
+      sr->stopping = sr_nat_tick(sr->nat);
+
+  ep->arp_usec += n * ep->tick;
+  if (ep->arp_usec >= 1000000) {
+    ep->arp_usec %= 1000000;
+    sr_arpcache_tick(sr);
+  }
+}
+
+static int sr_epoll_add(struct sr_epoll *ep, int fd, uint32_t data)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = data;
+  if (epoll_ctl(ep->fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    perror("epoll_ctl(..):sr_epoll.c::sr_epoll_add");
+    return -1;
+  }
+  return 0;
+}
+
+int sr_epoll_wait(struct sr_instance *sr, struct pollfd *fds,
+  unsigned int nfds, int timeout)
+{
+  struct sr_epoll *ep = sr->epoll;
+  struct epoll_event ev[SR_EPOLL_EVENTS];
+  unsigned int i;
+  int n, ready = 0;
+
+  if (!ep->watching) {
+    for (i = 0; i < nfds; i++)
+      if (sr_epoll_add(ep, fds[i].fd, SR_EPOLL_IO) != 0)
+        return -1;
+    ep->watching = 1;
+  }
+
+  if ((n = epoll_wait(ep->fd, ev, SR_EPOLL_EVENTS, timeout)) < 0)
+    return -1;
+  for (i = 0; i < (unsigned int)n; i++) {
+    if (ev[i].data.u32 == SR_EPOLL_TIMER)
+      sr_epoll_timer(sr, ep);
+    else
+      ready++;
+  }
+  return ready;
+}
+
+int sr_epoll_run(struct sr_instance *sr)
+{
+  struct sr_epoll *ep = sr->epoll;
+  struct epoll_event ev[2];
+  int i, n, ret;
+
+  if (sr_epoll_add(ep, sr->sockfd, SR_EPOLL_IO) != 0)
+    return -1;
+  ep->watching = 1;
+
+  while (!sr->stopping) {
+    if ((n = epoll_wait(ep->fd, ev, 2, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait(..):sr_epoll.c::sr_epoll_run");
+      return -1;
+    }
+    for (i = 0; i < n; i++) {
+      if (ev[i].data.u32 == SR_EPOLL_TIMER) {
+        sr_epoll_timer(sr, ep);
+        continue;
+      }
+      /* one recv(..), then whatever whole messages it brought */
+      do {
+        if ((ret = sr_read_from_server(sr)) != 1)
+          return ret;
+      } while ((ret = sr_read_pending(sr)) == 1);
+      if (ret < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+int sr_epoll_open(struct sr_instance *sr, unsigned int msec)
+{
+  struct sr_epoll *ep = calloc(1, sizeof(struct sr_epoll));
+  struct itimerspec its;
+
+  if (ep == NULL)
+    return -1;
+  ep->tick = msec ? msec * 1000UL : SR_NAT_TICK_USEC;
+  if (ep->tick > 1000000) {
+    fprintf(stderr, "-e: at most 1000 msec\n");
+    free(ep);
+    return -1;
+  }
+  if ((ep->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1(..):sr_epoll.c::sr_epoll_open");
+    free(ep);
+    return -1;
+  }
+  if ((ep->timer = timerfd_create(CLOCK_MONOTONIC,
+      TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    perror("timerfd_create(..):sr_epoll.c::sr_epoll_open");
+    goto fail;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_interval.tv_sec = ep->tick / 1000000;
+  its.it_interval.tv_nsec = (ep->tick % 1000000) * 1000L;
+  its.it_value = its.it_interval;
+  if (timerfd_settime(ep->timer, 0, &its, NULL) != 0) {
+    perror("timerfd_settime(..):sr_epoll.c::sr_epoll_open");
+    goto fail;
+  }
+  if (sr_epoll_add(ep, ep->timer, SR_EPOLL_TIMER) != 0)
+    goto fail;
+
+  sr->epoll = ep;
+  return 0;
+
+fail:
+  if (ep->timer >= 0)
+    close(ep->timer);
+  close(ep->fd);
+  free(ep);
+  return -1;
+}
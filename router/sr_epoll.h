@@ -0,0 +1,51 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoll.h
+ *
+ * Description:
+ *
+ * Event loop mode (-e <msec>): the forwarding thread waits on its packet
+ * i/o and on a timerfd with one epoll, and runs the ARP and NAT upkeep
+ * itself between bursts of packets, in place of the sr_arpcache_timeout and
+ * sr_nat_timeout threads and their sleeps.
+ *
+ * - VNS: once the connection is readable every whole message in the receive
+ *   buffer is handled, what they sent is written out, and the loop waits
+ *   again.
+ * - local interfaces (-X): the backends wait through sr_io_wait(..), which
+ *   puts their descriptors in the same epoll.  The pcap replay never waits,
+ *   so it runs no timers.
+ * - timers: the timerfd fires every <msec>.  Every expiry runs sr_nat_tick,
+ *   which sweeps one of the SR_NAT_SHARDS shards, so a mapping, connection
+ *   or held syn is removed at most SR_NAT_SHARDS x <msec> after it expires
+ *   (a second with the default, SR_NAT_TICK_USEC).  sr_arpcache_tick runs
+ *   once per second of expiries, as its retries are counted in seconds.
+ *
+ * Not with -a, which has timers of its own.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EPOLL_H
+#define SR_EPOLL_H
+
+struct sr_instance;
+struct pollfd;
+
+/* Sets up the epoll and the timer as sr->epoll, firing every msec (0 for
+   SR_NAT_TICK_USEC); before sr_init and sr_nat_init, which then start no
+   timeout threads.  Returns 0 on success. */
+int sr_epoll_open(struct sr_instance *sr, unsigned int msec);
+
+/* Runs the VNS connection in place of sr_read_from_server.  Returns 0 when
+   the server closed the session or a tick saw SIGTERM/SIGINT (sr->stopping),
+   -1 on error. */
+int sr_epoll_run(struct sr_instance *sr);
+
+/* poll(..) for a backend's receive loop (see sr_io_wait): waits for one of
+   fds, running the timers that fire meanwhile.  The descriptors are added
+   to the epoll on the first call and must stay the same; revents is not
+   set.  Returns the number of descriptors ready, which may be 0 after a
+   timer, or -1 as poll(..) does. */
+int sr_epoll_wait(struct sr_instance *sr, struct pollfd *fds,
+  unsigned int nfds, int timeout);
+
+#endif
@@ -0,0 +1,194 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flowcache.c
+ *
+ * Description:
+ *
+ * Per flow forwarding cache for NAT'd traffic, see sr_flowcache.h.
+ *
+ * The cache is direct mapped.  Each entry is guarded by a sequence count
+ * so that readers never take a lock: a reader copies the entry and treats
+ * a copy torn by a concurrent write as a miss.  A writer that finds the
+ * entry being written by another thread leaves it alone.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_flowcache.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_arpcache.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+#define SR_FLOW_TCP_SLOW (tcp_flag_syn | tcp_flag_fin | tcp_flag_rst)
+
+static unsigned int sr_flow_hash(const struct sr_flow_key *key)
+{
+  uint32_t h = key->ip_src * 0x9e3779b1U;
+  h ^= key->ip_dst + 0x7f4a7c15U + (h << 6) + (h >> 2);
+  h ^= (((uint32_t)key->port_src << 16) | key->port_dst) * 0x85ebca6bU;
+  h ^= key->proto + (uint32_t)(uintptr_t)key->in_if;
+  h ^= h >> 15;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h & (SR_FLOWCACHE_SZ - 1);
+}
+
+static bool sr_flow_key_eq(const struct sr_flow_key *a, const struct sr_flow_key *b)
+{
+  return a->ip_src == b->ip_src && a->ip_dst == b->ip_dst
+    && a->port_src == b->port_src && a->port_dst == b->port_dst
+    && a->proto == b->proto && a->in_if == b->in_if;
+}
+
+int sr_flowcache_init(struct sr_flowcache *cache)
+{
+  cache->entries = calloc(SR_FLOWCACHE_SZ, sizeof(struct sr_flow_entry));
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->stale = 0;
+  return cache->entries ? 0 : -1;
+}
+
+void sr_flowcache_destroy(struct sr_flowcache *cache)
+{
+  free(cache->entries);
+  cache->entries = NULL;
+}
+
+int sr_flow_key(uint8_t *packet, unsigned int len, struct sr_if *in_if,
+  struct sr_flow_key *key)
+{
+  sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  uint8_t *l4 = packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);
+
+  if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + 8
+    || ipHeader->ip_v != 4 || ipHeader->ip_hl != 5 || ipHeader->ip_ttl <= 1
+    || (ntohs(ipHeader->ip_off) & (IP_MF | IP_OFFMASK)))
+    return -1;
+
+  key->in_if = in_if;
+  key->ip_src = ipHeader->ip_src;
+  key->ip_dst = ipHeader->ip_dst;
+  key->proto = ipHeader->ip_p;
+
+  if (ipHeader->ip_p == ip_protocol_tcp) {
+    sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *)l4;
+    /* connection state changes go through the NAT's state machine */
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t)
+      || (tcpHeader->flags & SR_FLOW_TCP_SLOW))
+      return -1;
+    key->port_src = tcpHeader->source;
+    key->port_dst = tcpHeader->destination;
+  }
+  else if (ipHeader->ip_p == ip_protocol_udp) {
+    sr_udp_hdr_t *udpHeader = (sr_udp_hdr_t *)l4;
+    key->port_src = udpHeader->source;
+    key->port_dst = udpHeader->destination;
+  }
+  else if (ipHeader->ip_p == ip_protocol_icmp) {
+    sr_icmp_echo_hdr_t *icmpHeader = (sr_icmp_echo_hdr_t *)l4;
+    if ((icmpHeader->icmp_type != 8 && icmpHeader->icmp_type != 0)
+      || icmpHeader->icmp_code != 0)
+      return -1;
+    key->port_src = icmpHeader->icmp_id;
+    key->port_dst = icmpHeader->icmp_type << 8;
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+int sr_flowcache_lookup(struct sr_instance *sr, const struct sr_flow_key *key,
+  struct sr_flow_entry *entry)
+{
+  struct sr_flowcache *cache = &(sr->flows);
+  struct sr_flow_entry *slot;
+  unsigned int seq;
+
+  if (cache->entries == NULL)
+    return -1;
+  slot = &(cache->entries[sr_flow_hash(key)]);
+
+  seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+  memcpy(entry, slot, sizeof(*entry));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if ((seq & 1) || seq != __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED)
+    || !sr_flow_key_eq(&(entry->key), key)) {
+    __atomic_fetch_add(&(cache->misses), 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  if (entry->rt_gen != __atomic_load_n(&(sr->rt_gen), __ATOMIC_ACQUIRE)
+    || entry->arp_gen != __atomic_load_n(&(sr->cache.gen), __ATOMIC_ACQUIRE)
+    || sr->nat == NULL || !sr_nat_use_ref(sr->nat, &(entry->nat))) {
+    __atomic_fetch_add(&(cache->stale), 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  __atomic_fetch_add(&(cache->hits), 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void sr_flowcache_fill(struct sr_instance *sr, const struct sr_flow_key *key,
+  uint8_t *packet, const struct sr_nat_ref *ref)
+{
+  struct sr_flowcache *cache = &(sr->flows);
+  sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  uint8_t *l4 = packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);
+  struct sr_flow_entry entry, *slot;
+  struct sr_arpentry *arp;
+  struct sr_rt *rt;
+  uint16_t port_old;
+  unsigned int seq;
+
+  if (cache->entries == NULL)
+    return;
+  memset(&entry, 0, sizeof(entry));
+  entry.key = *key;
+  entry.nat = *ref;
+
+  /* the generations are read before what they guard */
+  entry.rt_gen = __atomic_load_n(&(sr->rt_gen), __ATOMIC_ACQUIRE);
+  entry.arp_gen = __atomic_load_n(&(sr->cache.gen), __ATOMIC_ACQUIRE);
+  rt = sr_find_routing_entry_int(sr, ipHeader->ip_dst);
+  if (rt == NULL)
+    return;
+  entry.out_if = sr_get_interface(sr, rt->interface);
+  arp = sr_arpcache_lookup(&(sr->cache), rt->gw.s_addr);
+  if (entry.out_if == NULL || arp == NULL) {
+    free(arp);
+    return;
+  }
+  memcpy(entry.dst_mac, arp->mac, ETHER_ADDR_LEN);
+  free(arp);
+
+  entry.rewrite_src = !ref->inbound;
+  entry.ip_new = entry.rewrite_src ? ipHeader->ip_src : ipHeader->ip_dst;
+  entry.ip_delta = cksum_delta32(entry.rewrite_src ? key->ip_src : key->ip_dst,
+    entry.ip_new);
+  if (key->proto == ip_protocol_icmp) {
+    entry.port_new = ((sr_icmp_echo_hdr_t *)l4)->icmp_id;
+    entry.l4_delta = cksum_delta16(key->port_src, entry.port_new);
+  }
+  else {
+    /* tcp and udp share the port layout, and the pseudo header */
+    sr_udp_hdr_t *ports = (sr_udp_hdr_t *)l4;
+    entry.port_new = entry.rewrite_src ? ports->source : ports->destination;
+    port_old = entry.rewrite_src ? key->port_src : key->port_dst;
+    entry.l4_delta = cksum_delta_add(entry.ip_delta,
+      cksum_delta16(port_old, entry.port_new));
+  }
+
+  slot = &(cache->entries[sr_flow_hash(key)]);
+  seq = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+  if ((seq & 1) || !__atomic_compare_exchange_n(&(slot->seq), &seq, seq + 1,
+      false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;  /* another thread is filling it */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  entry.seq = seq + 1;
+  memcpy(slot, &entry, sizeof(entry));
+  __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,88 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flowcache.h
+ *
+ * Description:
+ *
+ * Per flow cache of the complete forwarding decision for NAT'd traffic:
+ * egress interface, next hop MAC, the rewritten address and port and the
+ * checksum deltas of the rewrite.  The next packets of a flow are sent with
+ * one probe instead of a route lookup, two NAT table lookups, a connection
+ * lookup and an ARP lookup.
+ *
+ * Entries are never invalidated explicitly.  Each one records the routing
+ * table and ARP cache generations and a NAT reference (see sr_nat_ref)
+ * it was derived at; a lookup that finds any of them changed treats the
+ * entry as a miss and the packet takes the slow path, which refills it.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FLOWCACHE_H
+#define SR_FLOWCACHE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "sr_if.h"
+#include "sr_nat.h"
+
+#define SR_FLOWCACHE_SZ 16384  /* entries, power of two */
+
+struct sr_instance;
+
+/* A flow as it arrives, before translation.  Addresses and ports are in
+   network byte order. */
+struct sr_flow_key {
+  struct sr_if *in_if;
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t port_src;  /* tcp/udp port, icmp echo id */
+  uint16_t port_dst;  /* tcp/udp port, icmp type and code */
+  uint8_t proto;
+};
+
+struct sr_flow_entry {
+  unsigned int seq;  /* odd while the entry is being written */
+  struct sr_flow_key key;
+
+  /* what to do with the flow's packets */
+  struct sr_if *out_if;
+  unsigned char dst_mac[ETHER_ADDR_LEN];
+  bool rewrite_src;  /* source (outbound) or destination (inbound) */
+  uint32_t ip_new;
+  uint16_t port_new;
+  uint16_t ip_delta; /* checksum deltas of the rewrite, see cksum_apply */
+  uint16_t l4_delta;
+
+  /* what it was derived from */
+  unsigned long rt_gen;
+  unsigned long arp_gen;
+  struct sr_nat_ref nat;
+};
+
+struct sr_flowcache {
+  struct sr_flow_entry *entries;  /* NULL when the cache is off */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stale;  /* found but outdated by a route, ARP or NAT change */
+};
+
+int  sr_flowcache_init(struct sr_flowcache *cache);
+void sr_flowcache_destroy(struct sr_flowcache *cache);
+
+/* Fills key from a received frame.  Returns -1 for packets the cache does
+   not handle (fragments, IP options, expiring TTL, TCP SYN/FIN/RST, ICMP
+   other than echo); those always take the slow path. */
+int sr_flow_key(uint8_t *packet /* borrowed */, unsigned int len,
+  struct sr_if *in_if, struct sr_flow_key *key);
+
+/* Copies the entry for key into entry.  Returns 0 if there is one and it
+   is still current; the NAT mapping it uses is marked as used. */
+int sr_flowcache_lookup(struct sr_instance *sr, const struct sr_flow_key *key,
+  struct sr_flow_entry *entry);
+
+/* Records how a packet of flow key was translated (packet is the
+   translated frame) and where it went.  Nothing is cached if the next hop
+   is not resolved. */
+void sr_flowcache_fill(struct sr_instance *sr, const struct sr_flow_key *key,
+  uint8_t *packet /* borrowed */, const struct sr_nat_ref *ref);
+
+#endif /* SR_FLOWCACHE_H */
@@ -0,0 +1,191 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_io.c
+ *
+ * Description:
+ *
+ * Local packet i/o: the interfaces file and the choice of backend, see
+ * sr_io.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_epoll.h"
+
+/* The ethernet address of Linux device dev, into addr. */
+static int sr_io_dev_addr(const char *dev, unsigned char *addr)
+{
+  struct ifreq ifr;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int ret = -1;
+
+  if (fd < 0)
+    return -1;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, dev, IF_NAMESIZE - 1);
+  if (ioctl(fd, SIOCGIFHWADDR, &ifr) == 0) {
+    memcpy(addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    ret = 0;
+  }
+  close(fd);
+  return ret;
+}
+
+int sr_io_parse_mac(const char *s, unsigned char *addr)
+{
+  unsigned int b[ETHER_ADDR_LEN];
+  int i;
+
+  if (sscanf(s, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4],
+      &b[5]) != ETHER_ADDR_LEN)
+    return -1;
+  for (i = 0; i < ETHER_ADDR_LEN; i++) {
+    if (b[i] > 0xff)
+      return -1;
+    addr[i] = b[i];
+  }
+  return 0;
+}
+
+int sr_io_wait(struct sr_instance *sr, struct pollfd *fds, unsigned int nfds,
+  int timeout)
+{
+  if (sr->epoll)
+    return sr_epoll_wait(sr, fds, nfds, timeout);
+  return poll(fds, nfds, timeout);
+}
+
+/* A locally administered ethernet address made from ip (network order),
+   for a device the router creates itself. */
+static void sr_io_make_mac(uint32_t ip, unsigned char *addr)
+{
+  addr[0] = 0x02;
+  addr[1] = 0x00;
+  memcpy(addr + 2, &ip, 4);
+}
+
+int sr_io_open(struct sr_instance *sr, const char *file)
+{
+  static struct sr_io_port ports[SR_IO_PORTS];
+  static struct in_addr ips[SR_IO_PORTS];
+  static unsigned char addrs[SR_IO_PORTS][ETHER_ADDR_LEN];
+  static unsigned int linenos[SR_IO_PORTS];
+  unsigned int nports = 0, lineno = 0, i;
+  char line[512], backend[32] = "", mode[32] = "", arg[256] = "";
+  FILE *fp = fopen(file, "r");
+
+  if (fp == NULL) {
+    perror(file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char name[sr_IFACE_NAMELEN], dev[SR_IO_PATH], ip[32], mac[SR_IO_PATH];
+    char *hash = strchr(line, '#'), *dash;
+    int n;
+
+    lineno++;
+    if (hash)
+      *hash = '\0';
+    n = sscanf(line, "%31s %255s %31s %255s", name, dev, ip, mac);
+    if (n <= 0)
+      continue;
+    if (n >= 2 && strcmp(name, "backend") == 0) {
+      strncpy(backend, dev, sizeof(backend) - 1);
+      if (n >= 3)
+        strncpy(mode, ip, sizeof(mode) - 1);
+      if (n >= 4)
+        strncpy(arg, mac, sizeof(arg) - 1);
+      continue;
+    }
+    if (n == 2) {
+      /* IP_CONFIG: "<node>-<interface> <ip>" for the router's interfaces,
+         which become tap devices of that name; hosts are skipped */
+      if ((dash = strrchr(name, '-')) == NULL)
+        continue;
+      /* too long for an address: left empty, a bad interface below */
+      if (strlen(dev) < sizeof(ip))
+        strcpy(ip, dev);
+      else
+        ip[0] = '\0';
+      strcpy(dev, name);
+      memmove(name, dash + 1, strlen(dash + 1) + 1);
+      if (backend[0] == '\0')
+        strncpy(backend, "tap", sizeof(backend) - 1);
+      n = 3;
+    }
+    if (n < 3 || inet_aton(ip, &(ips[nports])) == 0
+      || (n == 4 && sr_io_parse_mac(mac, addrs[nports]) != 0)) {
+      fprintf(stderr, "%s:%u: bad interface\n", file, lineno);
+      fclose(fp);
+      return -1;
+    }
+    if (nports == SR_IO_PORTS) {
+      fprintf(stderr, "%s: more than %d interfaces\n", file, SR_IO_PORTS);
+      fclose(fp);
+      return -1;
+    }
+    memset(&(ports[nports]), 0, sizeof(struct sr_io_port));
+    strncpy(ports[nports].name, name, sr_IFACE_NAMELEN - 1);
+    strncpy(ports[nports].dev, dev, SR_IO_PATH - 1);
+    ports[nports].promisc = n == 4;
+    linenos[nports] = lineno;
+    nports++;
+  }
+  fclose(fp);
+
+  if (nports == 0) {
+    fprintf(stderr, "%s: no interfaces\n", file);
+    return -1;
+  }
+  if (backend[0] == '\0')
+    strncpy(backend, "afpacket", sizeof(backend) - 1);
+
+  /* the addresses not given: the device's own, or made up where there is no
+     device yet (tap creates it) or at all (pcap) */
+  for (i = 0; i < nports; i++) {
+    if (strcmp(backend, "pcap") != 0 && strlen(ports[i].dev) >= IF_NAMESIZE) {
+      fprintf(stderr, "%s:%u: bad device %s\n", file, linenos[i],
+        ports[i].dev);
+      return -1;
+    }
+    if (ports[i].promisc)
+      ;
+    else if (strcmp(backend, "tap") == 0 || strcmp(backend, "pcap") == 0)
+      sr_io_make_mac(ips[i].s_addr, addrs[i]);
+    else if (sr_io_dev_addr(ports[i].dev, addrs[i]) != 0) {
+      fprintf(stderr, "%s:%u: no device %s\n", file, linenos[i],
+        ports[i].dev);
+      return -1;
+    }
+    sr_add_interface(sr, ports[i].name);
+    sr_set_ether_addr(sr, addrs[i]);
+    sr_set_ether_ip(sr, ips[i].s_addr);
+  }
+
+  if (strcmp(backend, "afpacket") == 0)
+    sr->io = sr_afpacket_open(sr, ports, nports);
+  else if (strcmp(backend, "xdp") == 0)
+    sr->io = sr_xdp_open(sr, ports, nports, mode);
+  else if (strcmp(backend, "tap") == 0)
+    sr->io = sr_tap_open(sr, ports, nports, mode);
+  else if (strcmp(backend, "pcap") == 0)
+    sr->io = sr_pcap_open(sr, ports, nports, mode, arg);
+  else
+    fprintf(stderr, "%s: unknown backend %s\n", file, backend);
+  if (sr->io == NULL)
+    return -1;
+
+  printf("Router interfaces on %s:\n", sr->io->name);
+  sr_print_if_list(sr);
+  return 0;
+}
@@ -0,0 +1,94 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_io.h
+ *
+ * Description:
+ *
+ * Local packet i/o, for running the router directly on Linux interfaces
+ * (veth, bridge ports, NICs) instead of through the VNS server.
+ *
+ * The interfaces come from a file (-X) rather than from VNSHWINFO, one per
+ * line, '#' starting a comment:
+ *
+ *   <router interface> <Linux device> <ip address> [<ethernet address>]
+ *
+ * e.g. "eth1 veth1 10.0.1.1".  The router interface takes the device's
+ * ethernet address unless one is given, in which case the device is put in
+ * promiscuous mode.  A line "backend <name> [<mode>]" picks the backend:
+ * afpacket (the default), xdp, whose mode is native or generic, tap,
+ * whose mode is the number of queues, or pcap (see sr_pcap.c), which
+ * replays a capture file per interface in place of a device: "backend pcap
+ * [fast|paced] [<neighbor file>]".  Leave the devices without addresses of
+ * their own, or the kernel will answer and route for them too.
+ *
+ * The tap backend creates its devices and pcap has none, so the router
+ * makes up an ethernet address from the ip address unless one is given.
+ * The IP_CONFIG file also works as it is: "sw0-eth1 10.0.1.1" is router
+ * interface eth1 on tap device sw0-eth1, lines for hosts (no '-') are
+ * skipped, and the backend is tap unless a backend line says otherwise.
+ *
+ * A backend sends frames for sr_send_packet and runs the receive loop in
+ * place of sr_read_from_server.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_IO_H
+#define SR_IO_H
+
+#include <inttypes.h>
+#include <net/if.h>
+#include "sr_if.h"
+
+#define SR_IO_PORTS 16  /* interfaces per router */
+#define SR_IO_PATH 256  /* longest device (or capture file) name */
+
+struct sr_instance;
+struct pollfd;
+
+/* An interface as configured */
+struct sr_io_port {
+  char name[sr_IFACE_NAMELEN];  /* router interface, e.g. eth1 */
+  char dev[SR_IO_PATH];         /* Linux device, or capture file (pcap) */
+  int promisc;                  /* the ethernet address was given */
+};
+
+struct sr_io {
+  const char *name;
+  /* Sends a frame out of router interface iface; called from any thread.
+     Returns 0 if it was queued for the wire. */
+  int (*send)(struct sr_io *io, uint8_t *buf, unsigned int len,
+    const char *iface);
+  /* Hands received frames to sr_handlepacket; returns only on error, or
+     with 0 once a replay (pcap) is done. */
+  int (*run)(struct sr_io *io, struct sr_instance *sr);
+};
+
+/* Reads the interfaces file, adds the interfaces to sr and opens the
+   backend as sr->io.  Returns 0 on success. */
+int sr_io_open(struct sr_instance *sr, const char *file);
+
+/* "00:11:22:33:44:55" into addr; 0 on success. */
+int sr_io_parse_mac(const char *s, unsigned char *addr);
+
+/* poll(..) for the receive loops: with -e (sr_epoll.h) the wait goes
+   through the event loop, which runs the timers meanwhile. */
+int sr_io_wait(struct sr_instance *sr, struct pollfd *fds, unsigned int nfds,
+  int timeout);
+
+/* -- sr_afpacket.c -- */
+struct sr_io *sr_afpacket_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports);
+
+/* -- sr_xdp.c -- */
+struct sr_io *sr_xdp_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports, const char *mode);
+
+/* -- sr_tap.c -- */
+struct sr_io *sr_tap_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports, const char *mode);
+
+/* -- sr_pcap.c -- */
+struct sr_io *sr_pcap_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports, const char *mode,
+  const char *neighbors);
+
+#endif
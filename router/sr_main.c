@@ -25,6 +25,9 @@
 #include <stdbool.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -33,6 +36,11 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_nat.h"
+#include "sr_natlog.h"
+#include "sr_io.h"
+#include "sr_uring.h"
+#include "sr_workers.h"
+#include "sr_epoll.h"
 #include "sr_rt.h"
 
 extern char* optarg;
@@ -50,12 +58,14 @@ extern char* optarg;
 #define DEFAULT_ICMP_TIMEOUT 60
 #define DEFAULT_TCP_EST_TIMEOUT 7440
 #define DEFAULT_TCP_TRANS_TIMEOUT 300
+#define DEFAULT_UDP_TIMEOUT 300
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static int sr_add_pool(uint32_t* pool, unsigned int* npool, char* arg);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -75,7 +85,24 @@ int main(int argc, char **argv)
     uint32_t icmp_timeout=DEFAULT_ICMP_TIMEOUT;
     uint32_t tcp_est_timeout=DEFAULT_TCP_EST_TIMEOUT;
     uint32_t tcp_trans_timeout=DEFAULT_TCP_TRANS_TIMEOUT;
+    uint32_t udp_timeout=DEFAULT_UDP_TIMEOUT;
+    unsigned int port_block = 0;
+    bool port_block_det = false;
+    bool icmp_reuse = false;
+    char *snap_file = NULL;
+    char *nat_log = NULL;
+    char *io_file = NULL;
+    unsigned int snap_interval = 0;
+    bool warm_restart = false;
+    unsigned int max_mappings = 0, max_conns = 0;
+    unsigned int host_max_mappings = 0, host_max_conns = 0;
+    static uint32_t pool[SR_NAT_POOL_MAX];
+    unsigned int npool = 0;
     bool nat_usage = false;
+    bool use_uring = false;
+    unsigned int workers = 0;
+    bool use_epoll = false;
+    unsigned int tick_msec = 0;
 
     struct sr_instance sr;
     struct sr_nat nat;
@@ -83,7 +110,7 @@ int main(int argc, char **argv)
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:U:B:DS:W:wM:C:q:Q:P:iL:X:aj:e:")) != EOF)
     {
         switch (c)
         {
@@ -127,10 +154,82 @@ int main(int argc, char **argv)
             case 'R':
                 tcp_trans_timeout = atoi((char *) optarg);
                 break;
+            case 'U':
+                udp_timeout = atoi((char *) optarg);
+                break;
+            case 'B':
+                port_block = atoi((char *) optarg);
+                break;
+            case 'D':
+                port_block_det = true;
+                break;
+            case 'i':
+                icmp_reuse = true;
+                break;
+            case 'L':
+                nat_log = optarg;
+                break;
+            case 'X':
+                io_file = optarg;
+                break;
+            case 'a':
+                use_uring = true;
+                break;
+            case 'j':
+                workers = atoi((char *) optarg);
+                break;
+            case 'e':
+                use_epoll = true;
+                tick_msec = atoi((char *) optarg);
+                break;
+            case 'S':
+                snap_file = optarg;
+                break;
+            case 'W':
+                snap_interval = atoi((char *) optarg);
+                break;
+            case 'w':
+                warm_restart = true;
+                break;
+            case 'M':
+                max_mappings = atoi((char *) optarg);
+                break;
+            case 'C':
+                max_conns = atoi((char *) optarg);
+                break;
+            case 'q':
+                host_max_mappings = atoi((char *) optarg);
+                break;
+            case 'Q':
+                host_max_conns = atoi((char *) optarg);
+                break;
+            case 'P':
+                if (sr_add_pool(pool, &npool, optarg) != 0)
+                {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
 
         } /* switch */
     } /* -- while -- */
 
+    if (use_uring && io_file)
+    {
+        fprintf(stderr, "-a runs the VNS connection, not -X interfaces\n");
+        exit(1);
+    }
+    if (use_uring && workers)
+    {
+        fprintf(stderr, "-a sends from its loop only, not from -j workers\n");
+        exit(1);
+    }
+    if (use_uring && use_epoll)
+    {
+        fprintf(stderr, "-a and -e are two different event loops\n");
+        exit(1);
+    }
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
 
@@ -162,19 +261,36 @@ int main(int argc, char **argv)
         }
     }
 
+    /* -- forwarding threads, before a backend sets up its interfaces -- */
+    if(workers && sr_workers_open(&sr, workers) != 0)
+    { return 1; }
+
     Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
     if(template)
         Debug("Requesting topology template %s\n", template);
     else
         Debug("Requesting topology %d\n", topo);
 
+    if(io_file)
+    {
+        /* run on local interfaces, configured from a file */
+        if(sr_io_open(&sr, io_file) != 0)
+        { return 1; }
+        if(sr_verify_routing_table(&sr) != 0)
+        {
+            fprintf(stderr,"Routing table not consistent with %s\n", io_file);
+            return 1;
+        }
+    }
     /* connect to server and negotiate session */
-    if(sr_connect_to_server(&sr,port,server) == -1)
+    else if(sr_connect_to_server(&sr,port,server) == -1)
     {
         return 1;
     }
 
-    if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
+    if(io_file)
+    { /* routing table read above */ }
+    else if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
         Debug("Connected to new instantiation of topology template %s\n", template);
         sr_load_rt_wrap(&sr, "rtable.vrhost");
     }
@@ -183,6 +299,13 @@ int main(int argc, char **argv)
       sr_load_rt_wrap(&sr, rtable);
     }
 
+    /* the io_uring loop takes over from the arp and nat threads */
+    if(use_uring && sr_uring_open(&sr) != 0)
+    { return 1; }
+    /* and so does the epoll loop */
+    if(use_epoll && sr_epoll_open(&sr, tick_msec) != 0)
+    { return 1; }
+
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
 
@@ -190,13 +313,47 @@ int main(int argc, char **argv)
     if (nat_usage){
         printf("NAT mode enabled\n");
         sr.nat=&nat;
-        sr_nat_init(&sr,icmp_timeout,tcp_est_timeout,tcp_trans_timeout);
+        sr_nat_init(&sr,icmp_timeout,tcp_est_timeout,tcp_trans_timeout,udp_timeout);
+        if (npool && sr_nat_set_pool(&nat, pool, npool) != 0)
+        { exit(1); }
+        if (sr_get_interface(&sr, "eth2"))
+            sr_nat_ext_ip(&nat, &sr);
+        if (port_block &&
+            sr_nat_set_port_blocks(&nat, port_block, port_block_det) != 0)
+        { exit(1); }
+        if (icmp_reuse && sr_nat_set_icmp_reuse(&nat) != 0)
+        { exit(1); }
+        if (nat_log) {
+            struct sr_natlog *log = sr_natlog_open(nat_log);
+            if (log == NULL)
+            { exit(1); }
+            sr_nat_set_log(&nat, log);
+        }
+        if (max_mappings || max_conns || host_max_mappings || host_max_conns)
+            sr_nat_set_limits(&nat, max_mappings, max_conns,
+                              host_max_mappings, host_max_conns);
+        if (snap_file) {
+            if (warm_restart)
+                sr_nat_restore(&nat, snap_file);
+            sr_nat_set_checkpoint(&nat, snap_file, snap_interval);
+        }
     }else{
         sr.nat=NULL;
     }
 
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    if(sr.io)
+    { sr.io->run(sr.io, &sr); }
+    else if(sr.uring)
+    { sr_uring_run(&sr); }
+    else if(sr.epoll)
+    { sr_epoll_run(&sr); }
+    else
+    { while( sr_read_from_server(&sr) == 1); }
+
+    /* SIGTERM/SIGINT, seen by a tick on the -a or -e loop */
+    if(sr.stopping)
+    { sr_nat_shutdown(sr.nat); }
 
     sr_destroy_instance(&sr);
 
@@ -217,6 +374,15 @@ static void usage(char* argv0)
     printf("           [-l log file] [-I icmp query timeout]\n");
     printf("           [-E tcp established idle timeout]\n");
     printf("           [-R tcp transitory idle timeout]\n");
+    printf("           [-U udp idle timeout]\n");
+    printf("           [-B ports per internal host block] [-D] [-i]\n");
+    printf("           [-S nat checkpoint file] [-W checkpoint interval] [-w]\n");
+    printf("           [-M max mappings] [-C max connections]\n");
+    printf("           [-q max mappings per host] [-Q max connections per host]\n");
+    printf("           [-P external address[/prefix length]] ...\n");
+    printf("           [-L nat event log: file, udp:host:port or unix:path]\n");
+    printf("           [-X local interfaces file] [-a] [-j workers]\n");
+    printf("           [-e timer msec]\n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
     printf("            icmp query timeout=%d  \n",
@@ -225,6 +391,28 @@ static void usage(char* argv0)
             DEFAULT_TCP_EST_TIMEOUT);
     printf("            tcp transitory idle timeout=%d  \n",
             DEFAULT_TCP_TRANS_TIMEOUT);
+    printf("            udp idle timeout=%d  \n",
+            DEFAULT_UDP_TIMEOUT);
+    printf("            -B gives each internal host its own block of external\n");
+    printf("            ports, -D derives the block from the host's address\n");
+    printf("            -S saves the NAT table on SIGTERM (and every -W seconds),\n");
+    printf("            -w restores it from there at startup\n");
+    printf("            -M/-C/-q/-Q limit the NAT table (0 = unlimited); at the\n");
+    printf("            limit the least recently used idle mapping is evicted\n");
+    printf("            -P adds addresses to the NAT's external pool (default:\n");
+    printf("            eth2's address); each internal host keeps one of them\n");
+    printf("            -i lets an address that is out of icmp ids share them\n");
+    printf("            between echoes to different destinations\n");
+    printf("            -L logs every NAT mapping, connection and port block\n");
+    printf("            created or removed, in batches of binary records\n");
+    printf("            -X runs on Linux interfaces (AF_PACKET) instead of VNS,\n");
+    printf("            lines: <interface> <device> <ip> [<ethernet address>]\n");
+    printf("            -a runs the VNS connection, capture and timers on one\n");
+    printf("            io_uring loop (not with -X)\n");
+    printf("            -j forwards on that many threads, each flow on one\n");
+    printf("            -e waits on the packet i/o and the timers with one epoll\n");
+    printf("            and runs the ARP and NAT upkeep in between, every msec\n");
+    printf("            (0: %d); not with -a\n", SR_NAT_TICK_USEC / 1000);
 } /* -- usage -- */
 
 /*-----------------------------------------------------------------------------
@@ -269,6 +457,13 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_flowcache_destroy(&(sr->flows));
+
+    if(sr->rbuf)
+    { free(sr->rbuf); }
+    if(sr->txq)
+    { free(sr->txq); }
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -287,11 +482,24 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    sr->rbuf = 0;
+    sr->rbuf_start = sr->rbuf_end = 0;
+    sr->txq = 0;
+    sr->vns_batch = 0;
+    sr->io = 0;
+    sr->uring = 0;
+    sr->workers = 0;
+    sr->epoll = 0;
+    sr->stopping = 0;
+    pthread_mutex_init(&(sr->send_lock), NULL);
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->nat = 0;
+    sr->rt_gen = 0;
+    sr->flows.entries = NULL;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -358,4 +566,40 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     printf("---------------------------------------------\n");
     sr_print_routing_table(sr);
     printf("---------------------------------------------\n");
-}
\ No newline at end of file
+}
+/*-----------------------------------------------------------------------------
+ * Method: sr_add_pool(..)
+ * Scope: local
+ *
+ * Adds the address, or every address of the prefix, in arg to the NAT's
+ * external address pool.
+ *---------------------------------------------------------------------------*/
+
+static int sr_add_pool(uint32_t* pool, unsigned int* npool, char* arg)
+{
+    struct in_addr addr;
+    char* slash = strchr(arg, '/');
+    unsigned int plen = 32;
+    uint32_t first, i, count;
+
+    if (slash)
+    {
+        *slash = 0;
+        plen = atoi(slash + 1);
+    }
+    if (inet_aton(arg, &addr) == 0 || plen == 0 || plen > 32)
+    {
+        fprintf(stderr, "Bad NAT pool address %s\n", arg);
+        return -1;
+    }
+    count = 1U << (32 - plen);
+    first = ntohl(addr.s_addr) & ~(count - 1);
+    if (*npool + count > SR_NAT_POOL_MAX)
+    {
+        fprintf(stderr, "NAT pool holds at most %d addresses\n", SR_NAT_POOL_MAX);
+        return -1;
+    }
+    for (i = 0; i < count; i++)
+    { pool[(*npool)++] = htonl(first + i); }
+    return 0;
+} /* -- sr_add_pool -- */
@@ -1,4 +1,3 @@
-
 #include <signal.h>
 #include <assert.h>
 #include "sr_nat.h"
@@ -9,18 +8,1021 @@
 #include "sr_router.h"
 #include "sr_utils.h"
 #include "sr_protocol.h"
+#include "sr_natlog.h"
+
+#define AUX_SPAN (MAX_PORT - MIN_PORT + 1)
+
+/* Pointers that lookups follow without the lock are published with release
+   stores and read with acquire loads. */
+#define SR_NAT_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define SR_NAT_PUBLISH(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* The four octets of a network order address, for a %u.%u.%u.%u format */
+#define SR_NAT_IP_OCTETS(ip) ntohl(ip) >> 24, (ntohl(ip) >> 16) & 0xff, \
+  (ntohl(ip) >> 8) & 0xff, ntohl(ip) & 0xff
+
+/* This thread's read section slot, taken on its first lookup */
+static __thread struct sr_nat_reader *sr_nat_self = NULL;
+
+static uint32_t sr_nat_mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  return h ^ (h >> 16);
+}
+
+/* ip_remote is 0 except for the echo mappings of icmp id reuse, which
+   share ids and are told apart by their remote end. */
+static unsigned int sr_nat_hash_int(uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type, uint32_t ip_remote) {
+  return sr_nat_mix(ip_int ^ sr_nat_mix(((uint32_t)type << 16) | aux_int)
+    ^ ip_remote * 0x9e3779b1U) & (SR_NAT_HASH_SZ - 1);
+}
+
+static unsigned int sr_nat_hash_ext(uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type, uint32_t ip_remote) {
+  return sr_nat_mix(ip_ext ^ sr_nat_mix(((uint32_t)type << 16) | aux_ext)
+    ^ ip_remote * 0x9e3779b1U) & (SR_NAT_HASH_SZ - 1);
+}
+
+/* The remote end a mapping of type is keyed on: the packet's with icmp id
+   reuse, none otherwise. */
+static uint32_t sr_nat_remote(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_remote) {
+  return (nat->icmp_reuse && type == nat_mapping_icmp) ? ip_remote : 0;
+}
+
+/* Port blocks per shard, over all pool addresses */
+static unsigned int sr_nat_blocks(struct sr_nat *nat) {
+  return nat->blocks * nat->npool;
+}
+
+/* Internal hosts are spread over the shards by address, so every flow of a
+   host (and both directions of it) is handled by the same shard. */
+struct sr_nat_shard *sr_nat_shard_int(struct sr_nat *nat, uint32_t ip_int) {
+  if (nat->block_deterministic)
+    return &(nat->shards[(ntohl(ip_int) % (sr_nat_blocks(nat) * SR_NAT_SHARDS))
+      / sr_nat_blocks(nat)]);
+  return &(nat->shards[(sr_nat_mix(ip_int) >> 16) & (SR_NAT_SHARDS - 1)]);
+}
+
+/* The pool address an internal host is paired with.  Takes the bits of the
+   hash that sr_nat_shard_int leaves alone, so that every shard sees every
+   address. */
+static unsigned int sr_nat_pair(struct sr_nat *nat, uint32_t ip_int) {
+  return (sr_nat_mix(ip_int) & 0xffff) % nat->npool;
+}
+
+/* Index of ip_ext in the pool, -1 if it is not in it. */
+static int sr_nat_pool_index(struct sr_nat *nat, uint32_t ip_ext) {
+  unsigned int i;
+  for (i = 0; i < nat->npool; i++) {
+    if (nat->pool[i] == ip_ext)
+      return i;
+  }
+  return -1;
+}
+
+bool sr_nat_pool_has(struct sr_nat *nat, uint32_t ip) {
+  return sr_nat_pool_index(nat, ip) >= 0;
+}
+
+/* Each shard owns a contiguous slice of [MIN_PORT, MAX_PORT]; values below
+   MIN_PORT (unsolicited connections to well known ports) are spread by
+   modulo. */
+struct sr_nat_shard *sr_nat_shard_ext(struct sr_nat *nat, uint16_t aux_ext) {
+  unsigned int idx;
+  if (aux_ext < MIN_PORT)
+    idx = aux_ext % SR_NAT_SHARDS;
+  else
+    idx = (aux_ext - MIN_PORT) / (AUX_SPAN / SR_NAT_SHARDS);
+  if (idx >= SR_NAT_SHARDS)
+    idx = SR_NAT_SHARDS - 1;
+  return &(nat->shards[idx]);
+}
+
+void sr_nat_read_lock(struct sr_nat *nat) {
+  struct sr_nat_reader *self = sr_nat_self;
+
+  if (self == NULL) {
+    unsigned int slot = __atomic_fetch_add(&(nat->nreaders), 1, __ATOMIC_SEQ_CST);
+    if (slot >= SR_NAT_READERS) {
+      fprintf(stderr, "NAT: more than %d threads looking mappings up\n",
+        SR_NAT_READERS);
+      abort();
+    }
+    self = sr_nat_self = &(nat->readers[slot]);
+  }
+  if (self->depth++ > 0)
+    return;
+  __atomic_store_n(&(self->epoch), __atomic_load_n(&(nat->epoch),
+    __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  /* the epoch is announced before anything is read */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void sr_nat_read_unlock(struct sr_nat *nat) {
+  struct sr_nat_reader *self = sr_nat_self;
+  if (--self->depth == 0)
+    __atomic_store_n(&(self->epoch), 0, __ATOMIC_RELEASE);
+}
+
+/* Moves the epoch on once every thread in a read section has entered it
+   in the current epoch.  Entries retired in epoch e can then be freed when
+   the epoch reaches e + 2. */
+static void sr_nat_epoch_advance(struct sr_nat *nat) {
+  unsigned long epoch = __atomic_load_n(&(nat->epoch), __ATOMIC_SEQ_CST);
+  unsigned int n = __atomic_load_n(&(nat->nreaders), __ATOMIC_SEQ_CST);
+  unsigned int i;
+
+  if (n > SR_NAT_READERS)
+    n = SR_NAT_READERS;
+  for (i = 0; i < n; i++) {
+    unsigned long seen = __atomic_load_n(&(nat->readers[i].epoch), __ATOMIC_SEQ_CST);
+    if (seen != 0 && seen != epoch)
+      return;
+  }
+  __atomic_compare_exchange_n(&(nat->epoch), &epoch, epoch + 1, false,
+    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Stamps an unlinked entry with the current epoch.  The unlink must be
+   visible before the epoch is read. */
+static unsigned long sr_nat_retire_epoch(struct sr_nat *nat) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&(nat->epoch), __ATOMIC_SEQ_CST);
+}
+
+/* Frees the retired entries stamped before epoch before.  The lists are
+   newest first.  The shard lock must be held. */
+static void sr_nat_reclaim(struct sr_nat_shard *shard, unsigned long before) {
+  struct sr_nat_mapping **map = &(shard->retired);
+  struct sr_nat_connection **conn = &(shard->retired_conns);
+  struct sr_nat_mapping *del_map;
+  struct sr_nat_connection *del_conn;
+
+  while (*map != NULL && (*map)->retired >= before)
+    map = &((*map)->next);
+  while ((del_map = *map) != NULL) {
+    *map = del_map->next;
+    free(del_map);
+  }
+  while (*conn != NULL && (*conn)->retired >= before)
+    conn = &((*conn)->next_retired);
+  while ((del_conn = *conn) != NULL) {
+    *conn = del_conn->next_retired;
+    free(del_conn);
+  }
+}
+
+/* Stamps mapping as used now.  Runs without the lock: the lists are put
+   back in order lazily, see sr_nat_lru_oldest. */
+static void sr_nat_touch(struct sr_nat_mapping *mapping) {
+  time_t now = time(NULL);
+  if (__atomic_load_n(&(mapping->time_wait), __ATOMIC_RELAXED) != now)
+    __atomic_store_n(&(mapping->time_wait), now, __ATOMIC_RELAXED);
+}
+
+static time_t sr_nat_used(struct sr_nat_mapping *mapping) {
+  return __atomic_load_n(&(mapping->time_wait), __ATOMIC_RELAXED);
+}
+
+static void sr_nat_conn_touch(struct sr_nat_connection *conn) {
+  __atomic_store_n(&(conn->time_wait), (int)time(NULL), __ATOMIC_RELAXED);
+}
+
+static int sr_nat_conn_used(struct sr_nat_connection *conn) {
+  return __atomic_load_n(&(conn->time_wait), __ATOMIC_RELAXED);
+}
+
+/* Invalidates the sr_nat_refs to mapping.  Called under the lock, after an
+   unlink and before the entry is retired (see sr_nat_use_ref). */
+static void sr_nat_changed(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  __atomic_store_n(&(mapping->gen), ++shard->gen, __ATOMIC_SEQ_CST);
+}
+
+/* What lookups hand out: the mapping's identity without its links, which
+   may change (or be retired) as soon as the lookup returns. */
+static struct sr_nat_mapping *sr_nat_copy_mapping(struct sr_nat_mapping *mapping) {
+  struct sr_nat_mapping *copy = calloc(1, sizeof(struct sr_nat_mapping));
+  copy->type = mapping->type;
+  copy->ip_int = mapping->ip_int;
+  copy->ip_ext = mapping->ip_ext;
+  copy->aux_int = mapping->aux_int;
+  copy->aux_ext = mapping->aux_ext;
+  copy->ip_remote = mapping->ip_remote;
+  copy->time_wait = sr_nat_used(mapping);
+  copy->shard = mapping->shard;
+  copy->addr = mapping->addr;
+  copy->host = mapping->host;
+  return copy;
+}
+
+/* ip_remote as given by sr_nat_remote */
+static struct sr_nat_mapping *sr_nat_find_ext(struct sr_nat_shard *shard,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+  uint32_t ip_remote) {
+  struct sr_nat_mapping *mapping = SR_NAT_LOAD(
+    shard->ext_hash[sr_nat_hash_ext(ip_ext, aux_ext, type, ip_remote)]);
+  for (; mapping != NULL; mapping = SR_NAT_LOAD(mapping->next_ext)) {
+    if (mapping->type == type && mapping->aux_ext == aux_ext
+      && mapping->ip_ext == ip_ext && mapping->ip_remote == ip_remote)
+      break;
+  }
+  return mapping;
+}
+
+static struct sr_nat_mapping *sr_nat_find_int(struct sr_nat_shard *shard,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t ip_remote) {
+  struct sr_nat_mapping *mapping = SR_NAT_LOAD(
+    shard->int_hash[sr_nat_hash_int(ip_int, aux_int, type, ip_remote)]);
+  for (; mapping != NULL; mapping = SR_NAT_LOAD(mapping->next_int)) {
+    if (mapping->type == type && mapping->ip_int == ip_int
+      && mapping->aux_int == aux_int && mapping->ip_remote == ip_remote)
+      break;
+  }
+  return mapping;
+}
+
+static struct sr_nat_connection *sr_nat_find_conn(struct sr_nat_mapping *mapping,
+  uint32_t ip_dst, uint16_t port_dst) {
+  struct sr_nat_connection *conn = SR_NAT_LOAD(mapping->conns);
+  for (; conn != NULL; conn = SR_NAT_LOAD(conn->next)) {
+    if (conn->ip_dst == ip_dst && conn->port_dst == port_dst)
+      break;
+  }
+  return conn;
+}
+
+/* The connection before conn in mapping's list.  The shard lock must be
+   held. */
+static struct sr_nat_connection *sr_nat_conn_prev(struct sr_nat_mapping *mapping,
+  struct sr_nat_connection *conn) {
+  struct sr_nat_connection *prev = NULL, *walk = mapping->conns;
+  for (; walk != conn; walk = walk->next)
+    prev = walk;
+  return prev;
+}
+
+/* Appends mapping as the most recently used of the shard's and (if it has
+   one) its host's list. */
+static void sr_nat_lru_append(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  struct sr_nat_host *host = mapping->host;
+
+  mapping->queued = sr_nat_used(mapping);
+  mapping->next = NULL;
+  mapping->prev = shard->mappings_tail;
+  if (shard->mappings_tail)
+    shard->mappings_tail->next = mapping;
+  else
+    shard->mappings = mapping;
+  shard->mappings_tail = mapping;
+
+  if (host == NULL)
+    return;
+  mapping->host_next = NULL;
+  mapping->host_prev = host->lru_tail;
+  if (host->lru_tail)
+    host->lru_tail->host_next = mapping;
+  else
+    host->lru = mapping;
+  host->lru_tail = mapping;
+}
+
+static void sr_nat_lru_unlink(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  struct sr_nat_host *host = mapping->host;
+
+  if (mapping->prev)
+    mapping->prev->next = mapping->next;
+  else
+    shard->mappings = mapping->next;
+  if (mapping->next)
+    mapping->next->prev = mapping->prev;
+  else
+    shard->mappings_tail = mapping->prev;
+
+  if (host == NULL)
+    return;
+  if (mapping->host_prev)
+    mapping->host_prev->host_next = mapping->host_next;
+  else
+    host->lru = mapping->host_next;
+  if (mapping->host_next)
+    mapping->host_next->host_prev = mapping->host_prev;
+  else
+    host->lru_tail = mapping->host_prev;
+}
+
+/* Moves mapping to the most recently used end of its lists. */
+static void sr_nat_lru_requeue(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  mapping->queued = sr_nat_used(mapping);
+  if (mapping == shard->mappings_tail
+    && (mapping->host == NULL || mapping == mapping->host->lru_tail))
+    return;
+  sr_nat_lru_unlink(shard, mapping);
+  sr_nat_lru_append(shard, mapping);
+}
+
+/* Least recently used mapping of host, or of the shard if host is NULL.
+   Lookups only stamp time_wait, so a head that has been used since it was
+   queued gets a second chance at the tail until the head is one that has
+   not.  The shard lock must be held. */
+static struct sr_nat_mapping *sr_nat_lru_oldest(struct sr_nat_shard *shard,
+  struct sr_nat_host *host) {
+  unsigned int tries = host ? host->mappings : shard->nmappings;
+  struct sr_nat_mapping *mapping = host ? host->lru : shard->mappings;
+
+  for (; mapping != NULL && tries > 0; tries--) {
+    if (sr_nat_used(mapping) == mapping->queued)
+      break;
+    sr_nat_lru_requeue(shard, mapping);
+    mapping = host ? host->lru : shard->mappings;
+  }
+  return mapping;
+}
+
+/* Next free external aux value on pool address addr in the shard's slice,
+   or 0 if it is full.  The search starts a word past the last port handed
+   out, so that ports are not reused as soon as they are freed. */
+static uint16_t sr_nat_port_alloc(struct sr_nat_shard *shard, unsigned int addr,
+  sr_nat_mapping_type type) {
+  struct sr_nat_portmap *pm = &(shard->ports[addr * SR_NAT_MAPPING_TYPES + type]);
+  unsigned int nsum = (shard->nwords + 31) / 32;
+  unsigned int w = pm->next, i;
+
+  if (pm->free == 0)
+    return 0;
+  /* the rest of next's summary word, the other words, then its start */
+  for (i = 0; i <= nsum; i++) {
+    unsigned int s = (pm->next / 32 + i) % nsum;
+    uint32_t bits = pm->nonfull[s];
+    if (i == 0)
+      bits &= ~0U << (pm->next % 32);
+    if (bits) {
+      w = s * 32 + __builtin_ctz(bits);
+      break;
+    }
+  }
+  pm->next = (w + 1) % shard->nwords;
+  return shard->aux_lo + w * 32 + __builtin_ctz(~pm->used[w]);
+}
+
+/* Marks mapping's port taken / free in its address's portmap.  Ports
+   outside the shard's slice (restored unsolicited ones) are not tracked. */
+static void sr_nat_port_take(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  struct sr_nat_portmap *pm =
+    &(shard->ports[mapping->addr * SR_NAT_MAPPING_TYPES + mapping->type]);
+  unsigned int off = mapping->aux_ext - shard->aux_lo;
+
+  if (mapping->aux_ext < shard->aux_lo || mapping->aux_ext > shard->aux_hi)
+    return;
+  if (pm->refs && pm->refs[off]++ > 0)  /* a shared icmp id */
+    return;
+  pm->used[off / 32] |= 1U << (off % 32);
+  if (pm->used[off / 32] == 0xffffffffU)
+    pm->nonfull[off / 1024] &= ~(1U << (off / 32 % 32));
+  pm->free--;
+}
+
+static void sr_nat_port_give(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  struct sr_nat_portmap *pm =
+    &(shard->ports[mapping->addr * SR_NAT_MAPPING_TYPES + mapping->type]);
+  unsigned int off = mapping->aux_ext - shard->aux_lo;
+
+  if (mapping->aux_ext < shard->aux_lo || mapping->aux_ext > shard->aux_hi)
+    return;
+  if (pm->refs && --pm->refs[off] > 0)
+    return;
+  pm->used[off / 32] &= ~(1U << (off % 32));
+  pm->nonfull[off / 1024] |= 1U << (off / 32 % 32);
+  pm->free++;
+}
+
+/* An icmp id on pool address addr that is taken, but not by an echo
+   mapping towards ip_remote, for a new mapping to share; 0 if none of the
+   SR_NAT_REUSE_TRIES ids tried will do. */
+static uint16_t sr_nat_id_reuse(struct sr_nat *nat, struct sr_nat_shard *shard,
+  unsigned int addr, uint32_t ip_remote) {
+  struct sr_nat_portmap *pm =
+    &(shard->ports[addr * SR_NAT_MAPPING_TYPES + nat_mapping_icmp]);
+  unsigned int span = shard->aux_hi - shard->aux_lo + 1;
+  unsigned int i;
+
+  for (i = 0; i < SR_NAT_REUSE_TRIES; i++) {
+    unsigned int off = pm->reuse;
+    pm->reuse = (pm->reuse + 1) % span;
+    if (pm->refs[off] < 0xffff
+      && sr_nat_find_ext(shard, nat->pool[addr], shard->aux_lo + off,
+        nat_mapping_icmp, ip_remote) == NULL)
+      return shard->aux_lo + off;
+  }
+  return 0;
+}
+
+/* Links a filled in mapping (host set, or NULL) into the shard's list and
+   hash chains and its host's list. */
+static void sr_nat_link_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  unsigned int h_int = sr_nat_hash_int(mapping->ip_int, mapping->aux_int,
+    mapping->type, mapping->ip_remote);
+  unsigned int h_ext = sr_nat_hash_ext(mapping->ip_ext, mapping->aux_ext,
+    mapping->type, mapping->ip_remote);
+
+  mapping->shard = shard - nat->shards;
+  sr_nat_port_take(shard, mapping);
+  mapping->retired = 0;
+  mapping->gen = ++shard->gen;
+  sr_nat_lru_append(shard, mapping);
+  /* lookups may find it from here on */
+  mapping->next_int = shard->int_hash[h_int];
+  SR_NAT_PUBLISH(shard->int_hash[h_int], mapping);
+  mapping->next_ext = shard->ext_hash[h_ext];
+  SR_NAT_PUBLISH(shard->ext_hash[h_ext], mapping);
+  shard->nmappings++;
+  if (mapping->host)
+    mapping->host->mappings++;
+}
+
+/* Appends a new connection to mapping's list. */
+static void sr_nat_link_connection(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, struct sr_nat_connection *conn) {
+  struct sr_nat_connection *conn_list = mapping->conns;
+
+  conn->next = NULL;
+  conn->retired = 0;
+  if (conn_list != NULL){
+    while(conn_list->next != NULL)
+      conn_list = conn_list->next;
+
+    SR_NAT_PUBLISH(conn_list->next, conn);
+  }
+  else{
+    SR_NAT_PUBLISH(mapping->conns, conn);
+  }
+  mapping->nconns++;
+  shard->nconns++;
+  if (mapping->host)
+    mapping->host->conns++;
+}
+
+static struct sr_nat_host *sr_nat_new_host(struct sr_nat *nat,
+  struct sr_nat_shard *shard, uint32_t ip_int, unsigned int block);
+
+static unsigned int sr_nat_hash_host(uint32_t ip_int) {
+  return sr_nat_mix(ip_int) & (SR_NAT_HOST_HASH_SZ - 1);
+}
+
+static struct sr_nat_host *sr_nat_find_host(struct sr_nat_shard *shard,
+  uint32_t ip_int) {
+  struct sr_nat_host *host = shard->host_hash[sr_nat_hash_host(ip_int)];
+  for (; host != NULL; host = host->next) {
+    if (host->ip_int == ip_int)
+      break;
+  }
+  return host;
+}
+
+/* Hosts are only tracked when port blocks or per host limits need them. */
+static bool sr_nat_tracks_hosts(struct sr_nat *nat) {
+  return nat->block_size || nat->host_max_mappings || nat->host_max_conns;
+}
+
+/* Returns the host record for ip_int, creating it (and in port block mode
+   giving the host a block) if this is the first time it is seen. NULL if
+   the shard has no free block. */
+static struct sr_nat_host *sr_nat_get_host(struct sr_nat *nat,
+  struct sr_nat_shard *shard, uint32_t ip_int) {
+  struct sr_nat_host *host = sr_nat_find_host(shard, ip_int);
+  unsigned int block, tries;
+
+  if (host)
+    return host;
+  if (nat->block_size == 0)
+    return sr_nat_new_host(nat, shard, ip_int, 0);
+
+  block = shard->next_block;
+  if (nat->block_deterministic)
+    block = (ntohl(ip_int) % (sr_nat_blocks(nat) * SR_NAT_SHARDS)) % sr_nat_blocks(nat);
+  for (tries = sr_nat_blocks(nat); tries > 0; tries--) {
+    if (shard->block_owner[block] == NULL)
+      break;
+    /* deterministic slot taken (more hosts than blocks): probe onwards */
+    block = (block + 1) % sr_nat_blocks(nat);
+  }
+  if (tries == 0)
+    return NULL;
+  return sr_nat_new_host(nat, shard, ip_int, block);
+}
+
+/* Adds a host record for ip_int; in port block mode the host becomes the
+   owner of the (free) block.  Blocks are numbered address by address: the
+   first nat->blocks are on the first pool address, and so on. */
+static struct sr_nat_host *sr_nat_new_host(struct sr_nat *nat,
+  struct sr_nat_shard *shard, uint32_t ip_int, unsigned int block) {
+  struct sr_nat_host *host;
+  unsigned int words;
+  int type;
+
+  host = calloc(1, sizeof(struct sr_nat_host));
+  host->ip_int = ip_int;
+  host->next = shard->host_hash[sr_nat_hash_host(ip_int)];
+  shard->host_hash[sr_nat_hash_host(ip_int)] = host;
+  shard->nhosts++;
+  if (nat->block_size == 0)
+    return host;
+
+  words = (nat->block_size + 31) / 32;
+  host->block = block;
+  host->addr = block / nat->blocks;
+  host->block_lo = shard->aux_lo + (block % nat->blocks) * nat->block_size;
+  host->used[0] = calloc(SR_NAT_MAPPING_TYPES * words, sizeof(uint32_t));
+  for (type = 1; type < SR_NAT_MAPPING_TYPES; type++)
+    host->used[type] = host->used[0] + type * words;
+
+  shard->block_owner[block] = host;
+  shard->next_block = (block + 1) % sr_nat_blocks(nat);
+
+  Debug("NAT port block %u-%u of address %u assigned to %u.%u.%u.%u\n",
+    host->block_lo, host->block_lo + nat->block_size - 1, host->addr,
+    SR_NAT_IP_OCTETS(ip_int));
+  if (nat->log)
+    sr_natlog_block(nat->log, sr_natlog_block_assign, ip_int,
+      nat->pool[host->addr], host->block_lo,
+      host->block_lo + nat->block_size - 1);
+  return host;
+}
+
+static void sr_nat_put_host(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_host *host) {
+  struct sr_nat_host **walk = &(shard->host_hash[sr_nat_hash_host(host->ip_int)]);
+  while (*walk != host)
+    walk = &((*walk)->next);
+  *walk = host->next;
+  shard->nhosts--;
+
+  if (nat->block_size) {
+    shard->block_owner[host->block] = NULL;
+    Debug("NAT port block %u-%u of address %u released by %u.%u.%u.%u\n",
+      host->block_lo, host->block_lo + nat->block_size - 1, host->addr,
+      SR_NAT_IP_OCTETS(host->ip_int));
+    if (nat->log)
+      sr_natlog_block(nat->log, sr_natlog_block_release, host->ip_int,
+        nat->pool[host->addr], host->block_lo,
+        host->block_lo + nat->block_size - 1);
+  }
+  free(host->used[0]);
+  free(host);
+}
+
+/* Picks a free port / id for the host from its block's bitmap, 0 if the
+   block is exhausted. */
+static uint16_t sr_nat_block_alloc(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_host *host, sr_nat_mapping_type type) {
+  uint32_t *used = host->used[type];
+  unsigned int bit = host->next_bit[type];
+  unsigned int tries;
+
+  for (tries = nat->block_size; tries > 0; tries--) {
+    unsigned int cand = bit;
+    bit = (bit + 1) % nat->block_size;
+    if (used[cand / 32] == 0xffffffffU) {  /* skip full words */
+      bit = (cand / 32 + 1) * 32 % nat->block_size;
+      continue;
+    }
+    if (!(used[cand / 32] & (1U << (cand % 32)))
+      && sr_nat_find_ext(shard, nat->pool[host->addr], host->block_lo + cand,
+        type, 0) == NULL) {
+      used[cand / 32] |= 1U << (cand % 32);
+      host->next_bit[type] = bit;
+      return host->block_lo + cand;
+    }
+  }
+  return 0;
+}
+
+/* The block holding aux_ext on pool address addr, -1 if none does. */
+static int sr_nat_block_of(struct sr_nat *nat, struct sr_nat_shard *shard,
+  unsigned int addr, uint16_t aux_ext) {
+  unsigned int block;
+  if (aux_ext < shard->aux_lo)
+    return -1;
+  block = (aux_ext - shard->aux_lo) / nat->block_size;
+  return block < nat->blocks ? (int)(addr * nat->blocks + block) : -1;
+}
+
+/* Finds the host whose block holds aux_ext on pool address addr, from
+   the address and port alone. */
+static struct sr_nat_host *sr_nat_block_owner(struct sr_nat *nat,
+  struct sr_nat_shard *shard, unsigned int addr, uint16_t aux_ext) {
+  int block = sr_nat_block_of(nat, shard, addr, aux_ext);
+  return block >= 0 ? shard->block_owner[block] : NULL;
+}
+
+/* Evicts victim (with its connections) unless it is keep or was used
+   within the last second.  Returns 0 if it was evicted. */
+static int sr_nat_evict(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *victim, struct sr_nat_mapping *keep, time_t now) {
+  if (victim == NULL || victim == keep || difftime(now, sr_nat_used(victim)) < 1)
+    return -1;
+  Debug("NAT limit reached, evicting LRU mapping\n");
+  shard->stats[victim->type].evicted++;
+  while (victim->conns)
+    sr_nat_delete_connection(nat, shard, victim, victim->conns, NULL);
+  sr_nat_delete_mapping(nat, shard, victim);
+  return 0;
+}
 
-int sr_nat_init(struct sr_instance *sr, uint32_t icmp_to, uint32_t tcp_establish_to, uint32_t tcp_transitory_to) { /* Initializes the nat */
+/* Makes room for one more mapping (conn false) or connection (conn true)
+   of host (NULL when hosts are not tracked) by evicting least recently used
+   mappings, first the host's own, then the shard's.  keep is the mapping
+   the new connection belongs to.  The host record may be freed when its
+   last mapping goes, so callers look it up again afterwards.  Returns 0 if
+   there is room. */
+static int sr_nat_make_room(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_host *host, struct sr_nat_mapping *keep, bool conn) {
+  time_t now = time(NULL);
+  unsigned int host_max = conn ? nat->host_max_conns : nat->host_max_mappings;
+  unsigned int shard_max = conn ? nat->shard_max_conns : nat->shard_max_mappings;
+
+  while (host && host_max
+    && (conn ? host->conns : host->mappings) >= host_max) {
+    bool last = host->mappings == 1;
+    if (sr_nat_evict(nat, shard, sr_nat_lru_oldest(shard, host), keep, now) != 0)
+      goto refuse;
+    if (last)
+      break;
+  }
+  while (shard_max && (conn ? shard->nconns : shard->nmappings) >= shard_max) {
+    if (sr_nat_evict(nat, shard, sr_nat_lru_oldest(shard, NULL), keep, now) != 0)
+      goto refuse;
+  }
+  return 0;
+
+refuse:
+  Debug("NAT limit reached, refusing new entry\n");
+  shard->refused++;
+  return -1;
+}
+
+static unsigned int sr_nat_syn_hash(uint32_t ip_src, uint16_t port_src,
+  uint32_t ip_ext, uint16_t port_ext) {
+  return sr_nat_mix(ip_src ^ sr_nat_mix(ip_ext ^ (((uint32_t)port_src << 16) | port_ext)))
+    & (SR_NAT_SYN_SLOTS - 1);
+}
+
+/* Index of the held SYN of a flow, -1 if there is none. */
+static int sr_nat_syn_find(struct sr_nat_shard *shard, uint32_t ip_src,
+  uint16_t port_src, uint32_t ip_ext, uint16_t port_ext) {
+  int i = shard->syn_hash[sr_nat_syn_hash(ip_src, port_src, ip_ext, port_ext)];
+  for (; i >= 0; i = shard->syn[i].next) {
+    struct sr_nat_syn *syn = &(shard->syn[i]);
+    if (syn->ip_src == ip_src && syn->port_src == port_src
+      && syn->ip_ext == ip_ext && syn->port_ext == port_ext)
+      break;
+  }
+  return i;
+}
+
+static void sr_nat_syn_unhash(struct sr_nat_shard *shard, int idx) {
+  struct sr_nat_syn *syn = &(shard->syn[idx]);
+  int *walk = &(shard->syn_hash[sr_nat_syn_hash(syn->ip_src, syn->port_src,
+    syn->ip_ext, syn->port_ext)]);
+  while (*walk != idx)
+    walk = &(shard->syn[*walk].next);
+  *walk = syn->next;
+}
+
+/* Takes a token from the source's bucket, refilled at SR_NAT_SYN_RATE a
+   second.  Returns false if the source is over its rate. */
+static bool sr_nat_syn_rate_ok(struct sr_nat_shard *shard, uint32_t ip_src,
+  time_t now) {
+  struct sr_nat_syn_source *src =
+    &(shard->syn_src[sr_nat_mix(ip_src) & (SR_NAT_SYN_SOURCES - 1)]);
+  if (now > src->last) {
+    unsigned long tokens = src->tokens + (unsigned long)(now - src->last) * SR_NAT_SYN_RATE;
+    src->tokens = tokens > SR_NAT_SYN_BURST ? SR_NAT_SYN_BURST : tokens;
+    src->last = now;
+  }
+  if (src->tokens == 0)
+    return false;
+  src->tokens--;
+  return true;
+}
+
+/* Queues an unsolicited SYN sent to ip_ext:port_ext, keeping only the
+   headers the port unreachable quotes.  The shard lock must be held. */
+static int sr_nat_syn_add(struct sr_nat_shard *shard, uint8_t *packet,
+  unsigned int len, uint32_t ip_ext, uint16_t port_ext) {
+  sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
+  sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+  time_t now = time(NULL);
+  struct sr_nat_syn *syn;
+  sr_ip_hdr_t *quote;
+  int idx;
+
+  if (len < SR_NAT_SYN_HDRS)
+    return -1;
+  /* a retransmission keeps its place */
+  if (sr_nat_syn_find(shard, ipHeader->ip_src, tcpHeader->source, ip_ext,
+      port_ext) >= 0)
+    return 0;
+  if (shard->syn_count == SR_NAT_SYN_SLOTS
+    || !sr_nat_syn_rate_ok(shard, ipHeader->ip_src, now)) {
+    Debug("Dropping unsolicited syn, holding area full or source over rate\n");
+    shard->syn_dropped++;
+    return -1;
+  }
+
+  idx = (shard->syn_head + shard->syn_count) & (SR_NAT_SYN_SLOTS - 1);
+  shard->syn_count++;
+  syn = &(shard->syn[idx]);
+  syn->ip_src = ipHeader->ip_src;
+  syn->port_src = tcpHeader->source;
+  syn->ip_ext = ip_ext;
+  syn->port_ext = port_ext;
+  syn->expire = now + SR_NAT_SYN_HOLD;
+  memcpy(syn->hdrs, packet, SR_NAT_SYN_HDRS);
+
+  /* quote the destination the SYN was sent to, not its translation */
+  quote = (sr_ip_hdr_t *)(syn->hdrs + sizeof(struct sr_ethernet_hdr));
+  quote->ip_sum = cksum_adjust32(quote->ip_sum, quote->ip_dst, ip_ext);
+  quote->ip_dst = ip_ext;
+  ((sr_tcp_hdr_t *)(quote + 1))->destination = htons(port_ext);
+
+  syn->next = shard->syn_hash[sr_nat_syn_hash(syn->ip_src, syn->port_src,
+    ip_ext, port_ext)];
+  shard->syn_hash[sr_nat_syn_hash(syn->ip_src, syn->port_src, ip_ext,
+    port_ext)] = idx;
+  return 0;
+}
+
+/* Forgets the held SYN of a flow an internal host has just opened.  Its
+   slot stays in the ring, dead, until it reaches the head. */
+static void sr_nat_syn_release(struct sr_nat_shard *shard, uint32_t ip_src,
+  uint16_t port_src, uint32_t ip_ext, uint16_t port_ext) {
+  int idx = sr_nat_syn_find(shard, ip_src, port_src, ip_ext, port_ext);
+  if (idx < 0)
+    return;
+  Debug("Dropping held unsolicited syn\n");
+  sr_nat_syn_unhash(shard, idx);
+  shard->syn[idx].expire = 0;
+}
+
+/* Pops the timed out SYNs off the head of the ring and answers them with a
+   port unreachable, sent once the lock is released. */
+static void sr_nat_syn_expire(struct sr_nat *nat, struct sr_nat_shard *shard,
+  time_t now) {
+  uint8_t quotes[SR_NAT_SYN_SLOTS][SR_NAT_SYN_HDRS];
+  unsigned int n = 0, i;
+
+  pthread_mutex_lock(&(shard->lock));
+  while (shard->syn_count > 0) {
+    struct sr_nat_syn *syn = &(shard->syn[shard->syn_head]);
+    if (syn->expire > now)
+      break;
+    if (syn->expire != 0) {
+      sr_nat_syn_unhash(shard, shard->syn_head);
+      memcpy(quotes[n++], syn->hdrs, SR_NAT_SYN_HDRS);
+      shard->syn_unreach++;
+    }
+    shard->syn_head = (shard->syn_head + 1) & (SR_NAT_SYN_SLOTS - 1);
+    shard->syn_count--;
+  }
+  pthread_mutex_unlock(&(shard->lock));
+
+  for (i = 0; i < n && nat->sr != NULL; i++)
+    sr_sendICMP(nat->sr, quotes[i], "eth2", 3, 3);
+}
+
+int sr_nat_hold_syn(struct sr_nat *nat, uint8_t *packet, unsigned int len) {
+  sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
+  sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+  uint16_t port_ext = ntohs(tcpHeader->destination);
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, port_ext);
+  int ret;
+
+  pthread_mutex_lock(&(shard->lock));
+  ret = sr_nat_syn_add(shard, packet, len, ipHeader->ip_dst, port_ext);
+  pthread_mutex_unlock(&(shard->lock));
+  return ret;
+}
+
+int sr_nat_set_pool(struct sr_nat *nat, const uint32_t *addrs, unsigned int n) {
+  unsigned int i, j;
+
+  if (n == 0 || n > SR_NAT_POOL_MAX) {
+    fprintf(stderr, "NAT address pool must hold 1-%d addresses\n", SR_NAT_POOL_MAX);
+    return -1;
+  }
+  if (nat->block_size) {
+    fprintf(stderr, "NAT address pool must be set before port blocks\n");
+    return -1;
+  }
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+  }
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    unsigned int span = shard->aux_hi - shard->aux_lo + 1;
+    unsigned int nsum = (shard->nwords + 31) / 32;
+
+    for (j = 0; j < nat->npool * SR_NAT_MAPPING_TYPES; j++) {
+      free(shard->ports[j].used);
+      free(shard->ports[j].nonfull);
+      free(shard->ports[j].refs);
+    }
+    free(shard->ports);
+    shard->ports = calloc(n * SR_NAT_MAPPING_TYPES, sizeof(struct sr_nat_portmap));
+    for (j = 0; j < n * SR_NAT_MAPPING_TYPES; j++) {
+      struct sr_nat_portmap *pm = &(shard->ports[j]);
+      unsigned int w;
+      pm->used = calloc(shard->nwords, sizeof(uint32_t));
+      pm->nonfull = calloc(nsum, sizeof(uint32_t));
+      for (w = 0; w < shard->nwords; w++)
+        pm->nonfull[w / 32] |= 1U << (w % 32);
+      if (span % 32) {  /* the tail of the last word is not in the slice */
+        pm->used[shard->nwords - 1] = ~0U << (span % 32);
+      }
+      pm->next = 0;
+      pm->free = span;
+      pm->refs = NULL;
+      if (nat->icmp_reuse && j % SR_NAT_MAPPING_TYPES == nat_mapping_icmp)
+        pm->refs = calloc(span, sizeof(uint16_t));
+      pm->reuse = 0;
+    }
+  }
+  memcpy(nat->pool, addrs, n * sizeof(uint32_t));
+  nat->npool = n;
+  for (i = SR_NAT_SHARDS; i > 0; i--) {
+    pthread_mutex_unlock(&(nat->shards[i - 1].lock));
+  }
+  printf("NAT external address pool of %u, from %u.%u.%u.%u\n", n,
+    SR_NAT_IP_OCTETS(addrs[0]));
+  return 0;
+}
+
+int sr_nat_set_port_blocks(struct sr_nat *nat, uint16_t block_size,
+  bool deterministic) {
+  unsigned int i;
+
+  if (block_size == 0 || block_size > AUX_SPAN / SR_NAT_SHARDS) {
+    fprintf(stderr, "NAT port block size must be 1-%d\n", AUX_SPAN / SR_NAT_SHARDS);
+    return -1;
+  }
+  if (nat->icmp_reuse) {
+    fprintf(stderr, "NAT port blocks do not reuse icmp ids\n");
+    return -1;
+  }
+  if (nat->npool == 0) {  /* eth2 has no address yet */
+    nat->pending_block_size = block_size;
+    nat->pending_block_deterministic = deterministic;
+    return 0;
+  }
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+  }
+  nat->block_size = block_size;
+  nat->blocks = (AUX_SPAN / SR_NAT_SHARDS) / block_size;
+  nat->block_deterministic = deterministic;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    shard->block_owner = calloc(sr_nat_blocks(nat), sizeof(struct sr_nat_host *));
+    shard->next_block = 0;
+  }
+  for (i = SR_NAT_SHARDS; i > 0; i--) {
+    pthread_mutex_unlock(&(nat->shards[i - 1].lock));
+  }
+  printf("NAT port blocks of %u, %u per shard and address%s\n", block_size,
+    nat->blocks, deterministic ? ", deterministic" : "");
+  return 0;
+}
+
+int sr_nat_set_icmp_reuse(struct sr_nat *nat) {
+  unsigned int i, j;
+
+  if (nat->block_size || nat->pending_block_size) {
+    fprintf(stderr, "NAT port blocks do not reuse icmp ids\n");
+    return -1;
+  }
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+  }
+  nat->icmp_reuse = true;
+  /* portmaps the pool already has; later ones are sized by sr_nat_set_pool */
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    for (j = 0; j < nat->npool; j++) {
+      struct sr_nat_portmap *pm =
+        &(shard->ports[j * SR_NAT_MAPPING_TYPES + nat_mapping_icmp]);
+      if (pm->refs == NULL)
+        pm->refs = calloc(shard->aux_hi - shard->aux_lo + 1, sizeof(uint16_t));
+    }
+  }
+  for (i = SR_NAT_SHARDS; i > 0; i--) {
+    pthread_mutex_unlock(&(nat->shards[i - 1].lock));
+  }
+  printf("NAT icmp ids reused per destination\n");
+  return 0;
+}
+
+void sr_nat_set_limits(struct sr_nat *nat, unsigned int max_mappings,
+  unsigned int max_conns, unsigned int host_max_mappings,
+  unsigned int host_max_conns) {
+  nat->shard_max_mappings = (max_mappings + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS;
+  nat->shard_max_conns = (max_conns + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS;
+  nat->host_max_mappings = host_max_mappings;
+  nat->host_max_conns = host_max_conns;
+  printf("NAT limits: %u mappings, %u connections, per host %u mappings, "
+    "%u connections (0 = unlimited)\n", max_mappings, max_conns,
+    host_max_mappings, host_max_conns);
+}
+
+int sr_nat_init(struct sr_instance *sr, uint32_t icmp_to, uint32_t tcp_establish_to, uint32_t tcp_transitory_to, uint32_t udp_to) { /* Initializes the nat */
   assert(sr);
   struct sr_nat *nat = sr->nat;
   assert(nat);
+  int success = 0;
+  unsigned int i, j;
+
+  /* Initialize the shards and their locks */
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    shard->int_hash = calloc(SR_NAT_HASH_SZ, sizeof(struct sr_nat_mapping *));
+    shard->ext_hash = calloc(SR_NAT_HASH_SZ, sizeof(struct sr_nat_mapping *));
+    shard->mappings = NULL;
+    shard->mappings_tail = NULL;
+    shard->nmappings = 0;
+    shard->nconns = 0;
+    shard->refused = 0;
+    shard->nhosts = 0;
+    shard->aux_lo = MIN_PORT + i * (AUX_SPAN / SR_NAT_SHARDS);
+    shard->aux_hi = (i == SR_NAT_SHARDS - 1) ? MAX_PORT
+      : shard->aux_lo + (AUX_SPAN / SR_NAT_SHARDS) - 1;
+    shard->nwords = (shard->aux_hi - shard->aux_lo + 1 + 31) / 32;
+    shard->ports = NULL;  /* sized by sr_nat_set_pool */
+    memset(shard->stats, 0, sizeof(shard->stats));
+    memset(shard->host_hash, 0, sizeof(shard->host_hash));
+    shard->block_owner = NULL;
+    shard->next_block = 0;
+    shard->last_sweep = time(NULL);
+    shard->gen = 0;
+    shard->retired = NULL;
+    shard->retired_conns = NULL;
+    shard->syn_head = 0;
+    shard->syn_count = 0;
+    shard->syn_unreach = 0;
+    shard->syn_dropped = 0;
+    memset(shard->syn_hash, -1, sizeof(shard->syn_hash));
+    for (j = 0; j < SR_NAT_SYN_SOURCES; j++) {
+      shard->syn_src[j].tokens = SR_NAT_SYN_BURST;
+      shard->syn_src[j].last = shard->last_sweep;
+    }
+
+    pthread_mutexattr_init(&(shard->attr));
+    pthread_mutexattr_settype(&(shard->attr), PTHREAD_MUTEX_RECURSIVE);
+    success |= pthread_mutex_init(&(shard->lock), &(shard->attr));
+  }
 
-  /* Acquire mutex lock */
-  pthread_mutexattr_init(&(nat->attr));
-  pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+  nat->sr = sr;
+  nat->npool = 0;
+  nat->icmp_to=icmp_to;
+  nat->tcp_establish_to=tcp_establish_to;
+  nat->tcp_transitory_to=tcp_transitory_to;
+  nat->udp_to=udp_to;
+  nat->block_size = 0;
+  nat->blocks = 0;
+  nat->block_deterministic = false;
+  nat->pending_block_size = 0;
+  nat->pending_block_deterministic = false;
+  nat->icmp_reuse = false;
+  nat->log = NULL;
+  nat->shard_max_mappings = 0;
+  nat->shard_max_conns = 0;
+  nat->host_max_mappings = 0;
+  nat->host_max_conns = 0;
+  nat->snap_file = NULL;
+  nat->snap_interval = 0;
+  pthread_mutex_init(&(nat->snap_lock), NULL);
+  nat->restore_file = NULL;
+  nat->epoch = 1;  /* 0 marks a reader outside its read section */
+  nat->nreaders = 0;
+  memset(nat->readers, 0, sizeof(nat->readers));
+  /* Initialize any variables here */
+
+  nat->sweep_next = 0;
 
-  /* Initialize timeout thread */
+  /* Initialize timeout thread, unless the io_uring or epoll loop runs the
+     ticks */
+  if (sr->uring || sr->epoll)
+    return success;
 
   pthread_attr_init(&(nat->thread_attr));
   pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
@@ -28,296 +1030,933 @@ int sr_nat_init(struct sr_instance *sr, uint32_t icmp_to, uint32_t tcp_establish
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
   pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
 
-  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
-
-  nat->mappings = NULL;
-  nat->next_ext_port = MIN_PORT;
-  nat->icmp_to=icmp_to;
-  nat->tcp_establish_to=tcp_establish_to;
-  nat->tcp_transitory_to=tcp_transitory_to;
-  /* Initialize any variables here */
   return success;
 }
 
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-  pthread_mutex_lock(&(nat->lock));
   assert(nat);
+  int ret = 0;
+  unsigned int i, j;
+
+  if (nat->sr->uring == NULL && nat->sr->epoll == NULL) {
+    pthread_cancel(nat->thread);
+    pthread_join(nat->thread, NULL);
+  }
 
   /* free nat memory here */
-  if (nat) {
-    struct sr_nat_mapping *curr_map = nat->mappings;
-    struct sr_nat_mapping *free_map;
-    while(curr_map) {
-      struct sr_nat_connection *conn = curr_map->conns;
-      while (conn) {
-        conn = conn->next;
-        free(curr_map->conns);
-        curr_map->conns = conn;
-      }
-      free_map = curr_map;
-      curr_map = curr_map->next;
-      free(free_map);
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    while (shard->mappings) {
+      struct sr_nat_mapping *curr_map = shard->mappings;
+      while (curr_map->conns)
+        sr_nat_delete_connection(nat, shard, curr_map, curr_map->conns, NULL);
+      sr_nat_delete_mapping(nat, shard, curr_map);
     }
-  free(&(nat->ip_ext));
-  free(&(nat->icmp_to));
-  free(&(nat->tcp_establish_to));
-  free(&(nat->tcp_transitory_to));
-
+    sr_nat_reclaim(shard, (unsigned long)-1);  /* no readers are left */
+    for (j = 0; j < nat->npool * SR_NAT_MAPPING_TYPES; j++) {
+      free(shard->ports[j].used);
+      free(shard->ports[j].nonfull);
+      free(shard->ports[j].refs);
+    }
+    free(shard->ports);
+    shard->ports = NULL;
+    free(shard->block_owner);
+    shard->block_owner = NULL;
+    free(shard->int_hash);
+    free(shard->ext_hash);
+    pthread_mutex_unlock(&(shard->lock));
+    ret |= pthread_mutex_destroy(&(shard->lock)) |
+      pthread_mutexattr_destroy(&(shard->attr));
   }
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-  pthread_mutexattr_destroy(&(nat->attr));
+  return ret;
 }
 
-void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
-  struct sr_nat *nat = nat_ptr;
-  while (1) {
-    sleep(1.0);
-    
-    /* pthread_mutex_lock(&(nat->lock)); */
-    time_t curtime = time(NULL);
-    /* handle periodic tasks here */
-    struct sr_nat_mapping *curr_map = nat->mappings;
-    struct sr_nat_mapping *prev_map = NULL;
-
-    for(;curr_map != NULL; curr_map = curr_map->next){
-      int time_passed = difftime(curtime,curr_map->time_wait);
-/*      Debug("Mapping time passed %d\n",time_passed);*/
-      if (curr_map->type == nat_mapping_icmp && time_passed>=nat->icmp_to){
-        Debug("Deleting ICMP mapping\n");
-        sr_nat_delete_mapping(nat,curr_map,prev_map);
+/* Expires the idle mappings and connections of one shard.  Called with
+   nothing locked; only this shard's lock is taken. */
+void sr_nat_sweep(struct sr_nat *nat, struct sr_nat_shard *shard, time_t curtime) {
+  sr_nat_epoch_advance(nat);
+  pthread_mutex_lock(&(shard->lock));
+
+  struct sr_nat_mapping *curr_map = shard->mappings;
+  struct sr_nat_mapping *next_map;
+
+  for(;curr_map != NULL; curr_map = next_map){
+    next_map = curr_map->next;
+    int time_passed = difftime(curtime,sr_nat_used(curr_map));
+    if (curr_map->type == nat_mapping_icmp && time_passed>=nat->icmp_to){
+      Debug("Deleting ICMP mapping\n");
+      shard->stats[nat_mapping_icmp].expired++;
+      sr_nat_delete_mapping(nat,shard,curr_map);
+      continue;
+    }
+    else if (curr_map->type == nat_mapping_udp && time_passed>=nat->udp_to){
+      shard->stats[nat_mapping_udp].expired++;
+      sr_nat_delete_mapping(nat,shard,curr_map);
+      continue;
+    }
+    else if (curr_map->type == nat_mapping_tcp){
+      if (curr_map->conns == NULL){
+        Debug("Cleanup of TCP mapping\n");
+        shard->stats[nat_mapping_tcp].expired++;
+        sr_nat_delete_mapping(nat,shard,curr_map);
+        continue;
       }
-      else if (curr_map->type == nat_mapping_tcp){
-        if (curr_map->conns == NULL){
-          Debug("Cleanup of TCP mapping\n");
-          sr_nat_delete_mapping(nat,curr_map,prev_map);
-        }else{
-          struct sr_nat_connection *curr_conn = curr_map->conns;
-          struct sr_nat_connection *prev_conn = NULL;
-          for(;curr_conn!=NULL;curr_conn=curr_conn->next){
-            int conn_time_passed = difftime(curtime,curr_conn->time_wait);
-            if(conn_time_passed>=nat->tcp_establish_to && curr_conn->state == nat_conn_est){
-              sr_nat_delete_connection(curr_map,curr_conn,prev_conn);
-            }else if (time_passed>=nat->tcp_transitory_to && curr_conn->state != nat_conn_est && curr_conn->state != nat_conn_unest){
-              sr_nat_delete_connection(curr_map,curr_conn,prev_conn);
-            }else if(conn_time_passed>=6 && curr_conn->packet != NULL){
-              /*uint8_t *packet = curr_conn->packet;*/
-              /*sr_sendICMP(sr, curr_conn->packet, "eth2", 3, 3);*/
-              free(curr_conn->packet);
-              sr_nat_delete_connection(curr_map,curr_conn,prev_conn);
-            }
-            else {
-              prev_conn = curr_conn;
-            }
-          }
+      struct sr_nat_connection *curr_conn = curr_map->conns;
+      struct sr_nat_connection *prev_conn = NULL;
+      struct sr_nat_connection *next_conn;
+      for(;curr_conn!=NULL;curr_conn=next_conn){
+        next_conn = curr_conn->next;
+        int conn_time_passed = difftime(curtime,sr_nat_conn_used(curr_conn));
+        if(conn_time_passed>=nat->tcp_establish_to && curr_conn->state == nat_conn_est){
+          sr_nat_delete_connection(nat,shard,curr_map,curr_conn,prev_conn);
+        }else if (conn_time_passed>=nat->tcp_transitory_to && curr_conn->state != nat_conn_est && curr_conn->state != nat_conn_unest){
+          sr_nat_delete_connection(nat,shard,curr_map,curr_conn,prev_conn);
+        }
+        else {
+          prev_conn = curr_conn;
         }
       }
-      else
-        prev_map = curr_map;
     }
-    /*pthread_mutex_unlock(&(nat->lock));*/
   }
-  return NULL;
+  shard->last_sweep = curtime;
+  sr_nat_reclaim(shard, __atomic_load_n(&(nat->epoch), __ATOMIC_SEQ_CST) - 1);
+
+  pthread_mutex_unlock(&(shard->lock));
+
+  sr_nat_syn_expire(nat, shard, curtime);
 }
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+/* Set from the SIGTERM/SIGINT handler; the next sr_nat_tick reports it,
+   and sr_nat_shutdown writes the final checkpoint and flushes the event
+   log. */
+static volatile sig_atomic_t sr_nat_stopping = 0;
 
-  pthread_mutex_lock(&(nat->lock));
-   /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *search_mapping = nat->mappings;
-  for(;search_mapping != NULL; search_mapping = search_mapping->next){
-    if (search_mapping->type == type && search_mapping->aux_ext == aux_ext)
-      break;
+static void sr_nat_stop(int sig) {
+  sr_nat_stopping = sig;
+}
+
+int sr_nat_tick(struct sr_nat *nat) {
+  /* Every shard is swept once a second, each at its own phase, so the
+     forwarding path never finds more than one shard busy expiring. */
+  sr_nat_sweep(nat, &(nat->shards[nat->sweep_next]), time(NULL));
+  nat->sweep_next = (nat->sweep_next + 1) % SR_NAT_SHARDS;
+
+  return sr_nat_stopping != 0;
+}
+
+void sr_nat_shutdown(struct sr_nat *nat) {
+  pthread_mutex_lock(&(nat->snap_lock));
+  /* nothing is written over a checkpoint that is still to be restored */
+  if (nat->snap_file
+    && __atomic_load_n(&(nat->restore_file), __ATOMIC_ACQUIRE) == NULL)
+    printf("NAT checkpoint: %ld mappings saved to %s\n",
+      sr_nat_save(nat, nat->snap_file), nat->snap_file);
+  nat->snap_file = NULL;  /* and no periodic one after it */
+  pthread_mutex_unlock(&(nat->snap_lock));
+  if (nat->log) {
+    struct sr_natlog *log = nat->log;
+    nat->log = NULL;
+    sr_natlog_close(log);
   }
+}
 
-  if(!search_mapping){
-    pthread_mutex_unlock(&(nat->lock));
-    return NULL;    /*Not found*/
+void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
+  struct sr_nat *nat = nat_ptr;
+  while (1) {
+    usleep(SR_NAT_TICK_USEC);
+    if (sr_nat_tick(nat)) {
+      sr_nat_shutdown(nat);
+      exit(0);
+    }
   }
-  else
-    search_mapping->time_wait = time(NULL);
+  return NULL;
+}
 
-  struct sr_nat_mapping *copy =(struct sr_nat_mapping *) malloc(sizeof (struct sr_nat_mapping));
-  memcpy(copy,search_mapping,sizeof (struct sr_nat_mapping));
+/* Writes the -W checkpoint every snap_interval seconds.  sr_nat_save walks
+   every shard and fsyncs, so it runs on a thread of its own rather than
+   with the ticks, which may be on the forwarding thread (-a, -e). */
+static void *sr_nat_checkpointer(void *nat_ptr) {
+  struct sr_nat *nat = nat_ptr;
+  while (!sr_nat_stopping) {
+    sleep(nat->snap_interval);
+    pthread_mutex_lock(&(nat->snap_lock));
+    if (nat->snap_file && !sr_nat_stopping
+      && __atomic_load_n(&(nat->restore_file), __ATOMIC_ACQUIRE) == NULL)
+      sr_nat_save(nat, nat->snap_file);
+    pthread_mutex_unlock(&(nat->snap_lock));
+  }
+  return NULL;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+/* Checkpoint file layout, host byte order (addresses and ports stay in the
+   byte order they are kept in).  A header, then per mapping one record
+   followed by its connection records.  Times are stored as seconds idle so
+   that the timeouts carry on from where they were. */
+#define SR_NAT_SNAP_MAGIC 0x4e415453 /* "NATS" */
+#define SR_NAT_SNAP_VERSION 3
+
+struct sr_nat_snap_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;    /* mapping records */
+  uint32_t reserved;
+  int64_t taken;     /* time(NULL) when written */
+};
+
+struct sr_nat_snap_map {
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint8_t type;
+  uint8_t pad[3];
+  uint32_t idle;
+  uint32_t nconns;
+  uint32_t ip_remote;
+};
+
+struct sr_nat_snap_conn {
+  uint32_t ip_dst;
+  uint32_t ip_src;
+  uint16_t port_dst;
+  uint16_t port_src;
+  uint8_t state;
+  uint8_t last_state;
+  uint8_t pad[2];
+  uint32_t idle;
+};
+
+static uint32_t sr_nat_idle(time_t now, time_t then) {
+  return then < now ? (uint32_t)(now - then) : 0;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ){
-
-  pthread_mutex_lock(&(nat->lock));
-  print_addr_ip_int(ip_int);
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *search_mapping = nat->mappings;
-  for(;search_mapping != NULL; search_mapping = search_mapping->next){
-    if (search_mapping->type == type && search_mapping->ip_int == ip_int
-      && search_mapping->aux_int == aux_int)
-      break;
+long sr_nat_save(struct sr_nat *nat, const char *file) {
+  struct sr_nat_snap_hdr hdr;
+  char tmp[512];
+  char *buf;
+  FILE *fp;
+  time_t now = time(NULL);
+  unsigned int i;
+  long count = 0;
+  int err = 0;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    perror("NAT checkpoint");
+    return -1;
   }
-  
-  if(!search_mapping){
-    pthread_mutex_unlock(&(nat->lock));
-    return NULL;    /*Not found*/
+  buf = malloc(1 << 20);
+  setvbuf(fp, buf, _IOFBF, 1 << 20);
+
+  /* count is patched in once the shards have been walked */
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SR_NAT_SNAP_MAGIC;
+  hdr.version = SR_NAT_SNAP_VERSION;
+  hdr.taken = now;
+  err |= fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+
+  /* one shard locked at a time: the others keep forwarding */
+  for (i = 0; i < SR_NAT_SHARDS && !err; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    struct sr_nat_mapping *map;
+    pthread_mutex_lock(&(shard->lock));
+    for (map = shard->mappings; map != NULL && !err; map = map->next) {
+      struct sr_nat_snap_map rec;
+      struct sr_nat_connection *conn;
+
+      memset(&rec, 0, sizeof(rec));
+      rec.ip_int = map->ip_int;
+      rec.ip_ext = map->ip_ext;
+      rec.aux_int = map->aux_int;
+      rec.aux_ext = map->aux_ext;
+      rec.type = map->type;
+      rec.ip_remote = map->ip_remote;
+      rec.idle = sr_nat_idle(now, sr_nat_used(map));
+      rec.nconns = map->nconns;
+      err |= fwrite(&rec, sizeof(rec), 1, fp) != 1;
+
+      for (conn = map->conns; conn != NULL && !err; conn = conn->next) {
+        struct sr_nat_snap_conn crec;
+        memset(&crec, 0, sizeof(crec));
+        crec.ip_dst = conn->ip_dst;
+        crec.ip_src = conn->ip_src;
+        crec.port_dst = conn->port_dst;
+        crec.port_src = conn->port_src;
+        crec.state = conn->state;
+        crec.last_state = conn->last_state;
+        crec.idle = sr_nat_idle(now, sr_nat_conn_used(conn));
+        err |= fwrite(&crec, sizeof(crec), 1, fp) != 1;
+      }
+      count++;
+    }
+    pthread_mutex_unlock(&(shard->lock));
   }
-  else {
-    search_mapping->time_wait = time(NULL); 
+
+  hdr.count = count;
+  if (!err)
+    err |= fseek(fp, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+  err |= fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+  err |= fclose(fp) != 0;
+  free(buf);
+  if (err || rename(tmp, file) != 0) {
+    perror("NAT checkpoint");
+    unlink(tmp);
+    return -1;
   }
-  struct sr_nat_mapping *copy =(struct sr_nat_mapping *) malloc(sizeof (struct sr_nat_mapping));
-  memcpy(copy,search_mapping,sizeof (struct sr_nat_mapping));
+  return count;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+/* Puts a restored mapping back under its shard, reclaiming its port from
+   the owning host's block in block mode.  The shard lock must be held. */
+static int sr_nat_restore_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  struct sr_nat_host *host = NULL;
+  struct sr_nat_connection *conn;
+  unsigned int bit;
+  int addr = sr_nat_pool_index(nat, mapping->ip_ext);
+
+  /* the pool or icmp id reuse has changed since */
+  if (addr < 0
+    || sr_nat_remote(nat, mapping->type, mapping->ip_remote) != mapping->ip_remote
+    || sr_nat_find_ext(shard, mapping->ip_ext, mapping->aux_ext,
+      mapping->type, mapping->ip_remote))
+    return -1;
+  mapping->addr = addr;
+  if (nat->block_size && mapping->ip_int != 0) {
+    host = sr_nat_block_owner(nat, shard, addr, mapping->aux_ext);
+    if (host == NULL && sr_nat_find_host(shard, mapping->ip_int) == NULL) {
+      int block = sr_nat_block_of(nat, shard, addr, mapping->aux_ext);
+      if (block >= 0)
+        host = sr_nat_new_host(nat, shard, mapping->ip_int, block);
+    }
+    /* the port lies outside any block this host could own */
+    if (host == NULL || host->ip_int != mapping->ip_int)
+      return -1;
+    bit = mapping->aux_ext - host->block_lo;
+    host->used[mapping->type][bit / 32] |= 1U << (bit % 32);
+  }
+  else if (sr_nat_tracks_hosts(nat) && mapping->ip_int != 0) {
+    host = sr_nat_get_host(nat, shard, mapping->ip_int);
+  }
+  mapping->host = host;
+  sr_nat_link_mapping(nat, shard, mapping);
+
+  for (conn = mapping->conns; conn != NULL; conn = conn->next)
+    mapping->nconns++;
+  shard->nconns += mapping->nconns;
+  if (host)
+    host->conns += mapping->nconns;
+  return 0;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat, uint32_t ip_int, 
-  uint16_t aux_int, sr_nat_mapping_type type ) {
+long sr_nat_restore(struct sr_nat *nat, const char *file) {
+  struct sr_nat_snap_hdr hdr;
+  char *buf;
+  FILE *fp;
+  time_t now = time(NULL);
+  uint32_t i, j;
+  long restored = 0, skipped = 0;
+  int err = 0;
+
+  if (nat->npool == 0) {  /* eth2 has no address yet */
+    nat->restore_file = file;
+    return 0;
+  }
 
-  pthread_mutex_lock(&(nat->lock));
+  fp = fopen(file, "rb");
+  if (fp == NULL) {
+    perror("NAT restore");
+    return -1;
+  }
+  buf = malloc(1 << 20);
+  setvbuf(fp, buf, _IOFBF, 1 << 20);
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SR_NAT_SNAP_MAGIC
+    || hdr.version != SR_NAT_SNAP_VERSION) {
+    fprintf(stderr, "NAT restore: %s is not a NAT checkpoint\n", file);
+    fclose(fp);
+    free(buf);
+    return -1;
+  }
 
-  /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = malloc(sizeof(struct sr_nat_mapping));
-  uint16_t aux_ext;
-  if (type != nat_mapping_icmp){
-    aux_ext = nat->next_ext_port;
-    bool found_port = false;
-    uint16_t port = nat->next_ext_port+1;
-    struct sr_nat_mapping *mappings;
-    for(;!found_port;port++){
-      found_port=true;
-      if (port > MAX_PORT){
-        port=MIN_PORT;
+  for (i = 0; i < hdr.count && !err; i++) {
+    struct sr_nat_snap_map rec;
+    struct sr_nat_mapping *mapping;
+    struct sr_nat_connection *tail;
+    struct sr_nat_shard *shard;
+
+    if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.type >= SR_NAT_MAPPING_TYPES) {
+      err = 1;
+      break;
+    }
+    mapping = malloc(sizeof(struct sr_nat_mapping));
+    mapping->type = rec.type;
+    mapping->ip_int = rec.ip_int;
+    mapping->ip_ext = rec.ip_ext;
+    mapping->aux_int = rec.aux_int;
+    mapping->aux_ext = rec.aux_ext;
+    mapping->ip_remote = rec.ip_remote;
+    mapping->time_wait = now - rec.idle;
+    mapping->conns = NULL;
+    mapping->nconns = 0;
+    mapping->host = NULL;
+    tail = NULL;
+
+    for (j = 0; j < rec.nconns; j++) {
+      struct sr_nat_snap_conn crec;
+      struct sr_nat_connection *conn;
+      /* the state indexes sr_nat_tcp_next; nothing creates unest any more
+         and the sweep would never expire it */
+      if (fread(&crec, sizeof(crec), 1, fp) != 1
+        || crec.state == nat_conn_unest || crec.state > nat_conn_fin2
+        || crec.last_state > 1) {
+        err = 1;
+        break;
       }
-      mappings = nat->mappings;
-      for(;mappings!=NULL;mappings=mappings->next){
-        if(mappings->aux_ext==port){
-          found_port=false;
-        }
+      conn = calloc(1, sizeof(struct sr_nat_connection));
+      conn->ip_dst = crec.ip_dst;
+      conn->ip_src = crec.ip_src;
+      conn->port_dst = crec.port_dst;
+      conn->port_src = crec.port_src;
+      conn->state = crec.state;
+      conn->last_state = crec.last_state;
+      conn->time_wait = now - crec.idle;
+      conn->next = NULL;
+      if (tail)
+        tail->next = conn;
+      else
+        mapping->conns = conn;
+      tail = conn;
+    }
+
+    /* a mapping is only usable if both directions reach the same shard */
+    shard = sr_nat_shard_ext(nat, mapping->aux_ext);
+    pthread_mutex_lock(&(shard->lock));
+    if (err || (mapping->ip_int != 0
+        && sr_nat_shard_int(nat, mapping->ip_int) != shard)
+      || sr_nat_restore_mapping(nat, shard, mapping) != 0) {
+      while (mapping->conns) {
+        tail = mapping->conns;
+        mapping->conns = tail->next;
+        free(tail);
       }
+      free(mapping);
+      skipped++;
+    }
+    else {
+      restored++;
     }
-    nat->next_ext_port = port;
+    pthread_mutex_unlock(&(shard->lock));
+  }
+  fclose(fp);
+  free(buf);
+
+  if (err)
+    fprintf(stderr, "NAT restore: %s is truncated or corrupt\n", file);
+  printf("NAT restored %ld mappings from %s (%ld skipped, %ld s old)\n",
+    restored, file, skipped, (long)(now - hdr.taken));
+  return restored;
+}
 
+void sr_nat_set_checkpoint(struct sr_nat *nat, const char *file,
+  unsigned int interval) {
+  signal(SIGTERM, sr_nat_stop);
+  signal(SIGINT, sr_nat_stop);
+  nat->snap_file = file;
+  nat->snap_interval = interval;
+  if (interval) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sr_nat_checkpointer, nat) == 0)
+      pthread_detach(thread);
+    else
+      perror("NAT checkpoint thread");
   }
-  else{
-    aux_ext = nrand16(1);
-  } 
-  /*Set values*/
-  mapping->type = type;
-  mapping->ip_int = ip_int;
-  mapping->ip_ext = nat->ip_ext;
-  mapping->aux_int = aux_int;
-  mapping->aux_ext = aux_ext;
-  mapping->time_wait = time(NULL);
-  mapping->next=NULL;
-  mapping->conns = NULL; 
+}
 
-  /*Add to mappings*/
-  struct sr_nat_mapping *map_list = nat->mappings;
-  if (map_list != NULL){
-    while(map_list->next != NULL) {
-      map_list=map_list->next;
-    }
-    map_list->next=mapping;
+void sr_nat_set_log(struct sr_nat *nat, struct sr_natlog *log) {
+  signal(SIGTERM, sr_nat_stop);
+  signal(SIGINT, sr_nat_stop);
+  nat->log = log;
+}
+
+void sr_nat_get_stats(struct sr_nat *nat, sr_nat_mapping_type type,
+  struct sr_nat_stats *stats) {
+  unsigned int i;
+  memset(stats, 0, sizeof(*stats));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    stats->created += shard->stats[type].created;
+    stats->expired += shard->stats[type].expired;
+    stats->xlate_out += __atomic_load_n(&(shard->stats[type].xlate_out), __ATOMIC_RELAXED);
+    stats->xlate_in += __atomic_load_n(&(shard->stats[type].xlate_in), __ATOMIC_RELAXED);
+    stats->no_port += shard->stats[type].no_port;
+    stats->exhausted += shard->stats[type].exhausted;
+    stats->reused += shard->stats[type].reused;
+    stats->evicted += shard->stats[type].evicted;
+    pthread_mutex_unlock(&(shard->lock));
   }
-  else{
-    nat->mappings = mapping;
+}
+
+void sr_nat_get_usage(struct sr_nat *nat, struct sr_nat_usage *usage) {
+  unsigned int i;
+  int type;
+  memset(usage, 0, sizeof(*usage));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    usage->mappings += shard->nmappings;
+    usage->conns += shard->nconns;
+    usage->hosts += shard->nhosts;
+    usage->refused += shard->refused;
+    usage->syn_held += shard->syn_count;
+    usage->syn_unreach += shard->syn_unreach;
+    usage->syn_dropped += shard->syn_dropped;
+    for (type = 0; type < SR_NAT_MAPPING_TYPES; type++)
+      usage->evicted += shard->stats[type].evicted;
+    pthread_mutex_unlock(&(shard->lock));
   }
+}
 
-  struct sr_nat_mapping *copy = (struct sr_nat_mapping *) malloc(sizeof (struct sr_nat_mapping));
-  memcpy(copy,mapping,sizeof(struct sr_nat_mapping));
+/* Get the mapping associated with given external (ip, port) pair.
+   You must free the returned structure if it is not NULL.
+   Takes no lock: only the idle time and a counter are written. */
+struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+    uint32_t ip_remote) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, aux_ext);
+  struct sr_nat_mapping *copy = NULL;
+
+  sr_nat_read_lock(nat);
+  struct sr_nat_mapping *search_mapping = sr_nat_find_ext(shard, ip_ext, aux_ext,
+    type, sr_nat_remote(nat, type, ip_remote));
+  if (search_mapping) {
+    sr_nat_touch(search_mapping);
+    __atomic_fetch_add(&(shard->stats[type].xlate_in), 1, __ATOMIC_RELAXED);
+    copy = sr_nat_copy_mapping(search_mapping);
+  }
+  sr_nat_read_unlock(nat);
+  return copy;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
+/* Get the mapping associated with given internal (ip, port) pair.
+   You must free the returned structure if it is not NULL.
+   Takes no lock, like sr_nat_lookup_external. */
+struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t ip_remote){
+
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int);
+  struct sr_nat_mapping *copy = NULL;
+
+  sr_nat_read_lock(nat);
+  struct sr_nat_mapping *search_mapping = sr_nat_find_int(shard, ip_int, aux_int,
+    type, sr_nat_remote(nat, type, ip_remote));
+  if (search_mapping) {
+    sr_nat_touch(search_mapping);
+    __atomic_fetch_add(&(shard->stats[type].xlate_out), 1, __ATOMIC_RELAXED);
+    copy = sr_nat_copy_mapping(search_mapping);
+  }
+  sr_nat_read_unlock(nat);
   return copy;
 }
 
-struct sr_nat_mapping *sr_nat_insert_mapping_unsol(struct sr_nat *nat,
-  uint16_t aux_ext, sr_nat_mapping_type type ) {
+int sr_nat_get_ref(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_ext, uint16_t aux_ext, uint32_t ip_remote, uint16_t port_remote,
+  bool inbound, struct sr_nat_ref *ref) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, aux_ext);
+  int ret = -1;
+
+  pthread_mutex_lock(&(shard->lock));
+  ref->ip_ext = ip_ext;
+  ref->aux_ext = aux_ext;
+  ref->type = type;
+  ref->ip_remote = sr_nat_remote(nat, type, ip_remote);
+  ref->inbound = inbound;
+  ref->conn = NULL;
+  ref->mapping = sr_nat_find_ext(shard, ip_ext, aux_ext, type, ref->ip_remote);
+  if (ref->mapping == NULL)
+    goto done;
+  ref->gen = ref->mapping->gen;
+  if (type == nat_mapping_tcp) {
+    /* keyed like the connection handlers key it */
+    ref->conn = sr_nat_find_conn(ref->mapping, ip_remote, ntohs(port_remote));
+    if (ref->conn == NULL || ref->conn->state != nat_conn_est)
+      goto done;
+  }
+  ret = 0;
+done:
+  pthread_mutex_unlock(&(shard->lock));
+  return ret;
+}
+
+/* One probe of the external table.  A mapping's gen changes before it or
+   any of its connections is retired, so finding it linked with the same
+   gen inside the read section means ref->conn cannot be freed either. */
+bool sr_nat_use_ref(struct sr_nat *nat, const struct sr_nat_ref *ref) {
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, ref->aux_ext);
+  struct sr_nat_mapping *mapping;
+  bool ok = false;
+
+  sr_nat_read_lock(nat);
+  mapping = sr_nat_find_ext(shard, ref->ip_ext, ref->aux_ext, ref->type,
+    ref->ip_remote);
+  if (mapping == ref->mapping
+    && __atomic_load_n(&(mapping->gen), __ATOMIC_SEQ_CST) == ref->gen) {
+    sr_nat_touch(mapping);
+    if (ref->conn)
+      sr_nat_conn_touch(ref->conn);
+    if (ref->inbound)
+      __atomic_fetch_add(&(shard->stats[ref->type].xlate_in), 1, __ATOMIC_RELAXED);
+    else
+      __atomic_fetch_add(&(shard->stats[ref->type].xlate_out), 1, __ATOMIC_RELAXED);
+    ok = true;
+  }
+  sr_nat_read_unlock(nat);
+  return ok;
+}
+
+/* Insert a new mapping into the nat's mapping table.
+   Actually returns a copy to the new mapping, for thread safety.
+   Returns NULL if the shard has run out of external ports / ids.
+ */
+struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat, uint32_t ip_int, 
+  uint16_t aux_int, sr_nat_mapping_type type, uint32_t ip_remote) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int);
+  pthread_mutex_lock(&(shard->lock));
+  ip_remote = sr_nat_remote(nat, type, ip_remote);
+
+  /* lookups do not hold the lock, so another thread may have inserted it
+     since the caller's lookup missed */
+  struct sr_nat_mapping *mapping = sr_nat_find_int(shard, ip_int, aux_int, type,
+    ip_remote);
+  if (mapping) {
+    struct sr_nat_mapping *copy = sr_nat_copy_mapping(mapping);
+    pthread_mutex_unlock(&(shard->lock));
+    return copy;
+  }
 
-  pthread_mutex_lock(&(nat->lock));
-  uint32_t ip_int = htonl(0);
-  uint16_t aux_int= htons(1);
   /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = (struct sr_nat_mapping *) malloc(sizeof (struct sr_nat_mapping));
+  struct sr_nat_host *host = NULL;
+  uint16_t aux_ext = 0;
+  unsigned int addr = 0;
+  if (nat->npool == 0) {  /* eth2 has no address yet */
+    shard->stats[type].no_port++;
+    pthread_mutex_unlock(&(shard->lock));
+    return NULL;
+  }
+  if (sr_nat_tracks_hosts(nat))
+    host = sr_nat_get_host(nat, shard, ip_int);
+  if ((host || nat->block_size == 0)
+    && sr_nat_make_room(nat, shard, host, NULL, false) != 0) {
+    if (host && host->mappings == 0)
+      sr_nat_put_host(nat, shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return NULL;
+  }
+  if (host)  /* eviction may have released it */
+    host = sr_nat_get_host(nat, shard, ip_int);
+
+  if (nat->block_size) {
+    if (host) {
+      addr = host->addr;
+      aux_ext = sr_nat_block_alloc(nat, shard, host, type);
+      if (aux_ext == 0)
+        shard->stats[type].exhausted++;
+    }
+    if (host && aux_ext == 0 && host->mappings == 0)
+      sr_nat_put_host(nat, shard, host);
+  }
+  else {
+    addr = sr_nat_pair(nat, ip_int);
+    aux_ext = sr_nat_port_alloc(shard, addr, type);
+    if (aux_ext == 0) {
+      shard->stats[type].exhausted++;
+      if (ip_remote != 0
+        && (aux_ext = sr_nat_id_reuse(nat, shard, addr, ip_remote)) != 0)
+        shard->stats[type].reused++;
+    }
+    if (aux_ext == 0 && host && host->mappings == 0)
+      sr_nat_put_host(nat, shard, host);
+  }
+  if (aux_ext == 0) {
+    Debug("NAT shard out of external ports\n");
+    shard->stats[type].no_port++;
+    pthread_mutex_unlock(&(shard->lock));
+    return NULL;
+  }
+  mapping = malloc(sizeof(struct sr_nat_mapping));
 
-  Debug("%d\n",aux_ext);
-    
-  /*Sets values*/
+  /*Set values*/
   mapping->type = type;
   mapping->ip_int = ip_int;
-  mapping->ip_ext = nat->ip_ext;
+  mapping->ip_ext = nat->pool[addr];
+  mapping->addr = addr;
   mapping->aux_int = aux_int;
   mapping->aux_ext = aux_ext;
+  mapping->ip_remote = ip_remote;
   mapping->time_wait = time(NULL);
-  mapping->next=NULL;
-
   mapping->conns = NULL; 
+  mapping->nconns = 0;
+  mapping->host = host;
 
-  /*Adds to mappings*/
-  struct sr_nat_mapping *map_list = nat->mappings;
-  if (map_list != NULL){
-    while(map_list->next != NULL)
-      map_list=map_list->next;
-
-    map_list->next=mapping;
-  }
-  else{
-    nat->mappings = mapping;
-  }
+  /*Add to mappings*/
+  sr_nat_link_mapping(nat, shard, mapping);
+  shard->stats[type].created++;
+  if (nat->log)
+    sr_natlog_mapping(nat->log, sr_natlog_map_create, mapping);
+  __atomic_fetch_add(&(shard->stats[type].xlate_out), 1, __ATOMIC_RELAXED);
 
-  /*Generates copy and returns it*/
-  struct sr_nat_mapping *copy = (struct sr_nat_mapping *) malloc(sizeof (struct sr_nat_mapping));
-  memcpy(copy,mapping,sizeof(struct sr_nat_mapping));
+  struct sr_nat_mapping *copy = sr_nat_copy_mapping(mapping);
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
   return copy;
 }
 
-void sr_nat_delete_mapping(struct sr_nat *nat, struct sr_nat_mapping *del_map,
-  struct sr_nat_mapping *prev){
+/* Removes del_map (whose connections are gone) from the shard and retires
+   it, to be freed once no lookup can still hold it.  The shard lock must
+   be held. */
+void sr_nat_delete_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *del_map){
 
   assert(del_map);
-
-  if(prev == NULL){
-    nat->mappings = del_map->next;
-  }
-  else{
-    prev->next = del_map->next;
+  struct sr_nat_mapping **walk;
+  struct sr_nat_host *host = del_map->host;
+
+  if (nat->log)
+    sr_natlog_mapping(nat->log, sr_natlog_map_delete, del_map);
+  sr_nat_lru_unlink(shard, del_map);
+  shard->nmappings--;
+
+  walk = &(shard->int_hash[sr_nat_hash_int(del_map->ip_int, del_map->aux_int,
+    del_map->type, del_map->ip_remote)]);
+  while (*walk != del_map)
+    walk = &((*walk)->next_int);
+  SR_NAT_PUBLISH(*walk, del_map->next_int);
+
+  walk = &(shard->ext_hash[sr_nat_hash_ext(del_map->ip_ext, del_map->aux_ext,
+    del_map->type, del_map->ip_remote)]);
+  while (*walk != del_map)
+    walk = &((*walk)->next_ext);
+  SR_NAT_PUBLISH(*walk, del_map->next_ext);
+  sr_nat_port_give(shard, del_map);
+
+  if (host) {
+    /* give the port back to the owning host's block */
+    if (nat->block_size) {
+      unsigned int bit = del_map->aux_ext - host->block_lo;
+      host->used[del_map->type][bit / 32] &= ~(1U << (bit % 32));
+    }
+    if (--host->mappings == 0)
+      sr_nat_put_host(nat, shard, host);
   }
-  free(del_map);
+
+  /* its chain links stay intact for lookups still walking through it */
+  sr_nat_changed(shard, del_map);
+  __atomic_store_n(&(del_map->retired), sr_nat_retire_epoch(nat),
+    __ATOMIC_RELAXED);
+  del_map->next = shard->retired;
+  shard->retired = del_map;
 }
 
 void sr_nat_ext_ip(struct sr_nat *nat,struct sr_instance* sr)
 {
-    pthread_mutex_lock(&(nat->lock));
+    const char *file = nat->restore_file;
+
     nat->ip_ext = sr_get_interface(sr,"eth2")->ip;
+    if (nat->npool == 0)  /* no -P: eth2's address is the whole pool */
+        sr_nat_set_pool(nat, &(nat->ip_ext), 1);
+
+    /* what waited for the pool, before the first packet */
+    if (nat->pending_block_size) {
+        sr_nat_set_port_blocks(nat, nat->pending_block_size,
+            nat->pending_block_deterministic);
+        nat->pending_block_size = 0;
+    }
+    if (file) {
+        sr_nat_restore(nat, file);
+        /* only now may sr_nat_checkpointer write over it */
+        __atomic_store_n(&(nat->restore_file), NULL, __ATOMIC_RELEASE);
+    }
 /*    Debug("Ext IP set to ");
     print_addr_ip_int(nat->ip_ext);*/
-    pthread_mutex_unlock(&(nat->lock));
 }
 
 /* tcp functions! */
-void sr_nat_delete_connection(struct sr_nat_mapping *map, struct sr_nat_connection *del_conn,
+void sr_nat_delete_connection(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *map, struct sr_nat_connection *del_conn,
   struct sr_nat_connection *prev){
 
   assert(del_conn);
+  if (nat->log)
+    sr_natlog_conn(nat->log, sr_natlog_conn_delete, map, del_conn->ip_dst,
+      del_conn->port_dst);
+  map->nconns--;
+  shard->nconns--;
+  if (map->host)
+    map->host->conns--;
 
   if(prev == NULL){
-    map->conns = del_conn->next;
+    SR_NAT_PUBLISH(map->conns, del_conn->next);
   }else{
-    prev->next = del_conn->next;
+    SR_NAT_PUBLISH(prev->next, del_conn->next);
+  }
+  sr_nat_changed(shard, map);
+  __atomic_store_n(&(del_conn->retired), sr_nat_retire_epoch(nat),
+    __ATOMIC_RELAXED);
+  del_conn->next_retired = shard->retired_conns;
+  shard->retired_conns = del_conn;
+}
+
+/* TCP connection tracking.  A connection moves on one lookup in
+   sr_nat_tcp_next, indexed by its state, the side that moved it last
+   (last_state: 1 internal, 0 external), the side the packet comes from and
+   the class of the packet's flags.  Only the exact flag combinations below
+   move a connection; anything else is of class sr_nat_tcp_other.  This is
+   on purpose: it keeps the moves of the handlers the table replaced, which
+   make check_nat_tcp compares it against, so a fin with psh or ece set or
+   a rst does not start or end a close and the connection is left to the
+   idle timeouts. */
+enum {
+  sr_nat_tcp_other,
+  sr_nat_tcp_syn,
+  sr_nat_tcp_synack,
+  sr_nat_tcp_ack,
+  sr_nat_tcp_fin,
+  sr_nat_tcp_finack,
+  sr_nat_tcp_classes
+};
+
+static const uint8_t sr_nat_tcp_class[256] = {
+  0, 4, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  3, 5, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* An entry is the next state plus what else to do */
+#define SR_NAT_TCP_STATE   0x07
+#define SR_NAT_TCP_MOVE    0x08  /* the packet's side becomes last_state */
+#define SR_NAT_TCP_DROP    0x10  /* do not forward the packet */
+#define SR_NAT_TCP_CLOSE   0x20  /* remove the connection */
+#define SR_NAT_TCP_UNCACHE 0x40  /* leaves established: drop cached refs */
+
+#define UN nat_conn_unest
+#define SY nat_conn_syn
+#define SA nat_conn_synack
+#define ES nat_conn_est
+#define F1 nat_conn_fin1
+#define FA nat_conn_fin1ack
+#define F2 nat_conn_fin2
+#define MV SR_NAT_TCP_MOVE
+
+/* [state][last_state][from internal][class]; classes in the order other,
+   syn, syn+ack, ack, fin, fin+ack */
+static const uint8_t sr_nat_tcp_next[7][2][2][sr_nat_tcp_classes] = {
+  { /* unest: held for an inbound syn, waiting for the internal one */
+    { { UN|SR_NAT_TCP_DROP, UN|SR_NAT_TCP_DROP, UN|SR_NAT_TCP_DROP,
+        UN|SR_NAT_TCP_DROP, UN|SR_NAT_TCP_DROP, UN|SR_NAT_TCP_DROP },
+      { UN, SY|MV, UN, UN, UN, UN } },
+    { { UN, UN, UN, UN, UN, UN },
+      { UN, UN, UN, UN, UN, UN } } },
+  { /* syn: waiting for the other side's syn+ack */
+    { { SY, SY, SY, SY, SY, SY },
+      { SY, SY, SA|MV, SY, SY, SY } },
+    { { SY, SY, SA|MV, SY, SY, SY },
+      { SY, SY, SY, SY, SY, SY } } },
+  { /* synack: waiting for the ack */
+    { { SA, SA, SA, SA, SA, SA },
+      { SA, SA, SA, ES|MV, SA, SA } },
+    { { SA, SA, SA, ES|MV, SA, SA },
+      { SA, SA, SA, SA, SA, SA } } },
+  { /* est: a fin from either side starts the close */
+    { { ES, ES, ES, ES, F1|MV|SR_NAT_TCP_UNCACHE, ES },
+      { ES, ES, ES, ES, F1|MV|SR_NAT_TCP_UNCACHE, ES } },
+    { { ES, ES, ES, ES, F1|MV|SR_NAT_TCP_UNCACHE, ES },
+      { ES, ES, ES, ES, F1|MV|SR_NAT_TCP_UNCACHE, ES } } },
+  { /* fin1: the other side answers with a fin or a fin+ack */
+    { { F1, F1, F1, F1, F1, F1 },
+      { F1, F1, F1, F1, FA|MV, F2|MV } },
+    { { F1, F1, F1, F1, FA|MV, F2|MV },
+      { F1, F1, F1, F1, F1, F1 } } },
+  { /* fin1ack: waiting for the other side's fin */
+    { { FA, FA, FA, FA, FA, FA },
+      { FA, FA, FA, FA, FA|MV, FA } },
+    { { FA, FA, FA, FA, FA|MV, FA },
+      { FA, FA, FA, FA, FA, FA } } },
+  { /* fin2: the other side's ack closes it */
+    { { F2, F2, F2, F2, F2, F2 },
+      { F2, F2, F2, F2|SR_NAT_TCP_CLOSE, F2, F2 } },
+    { { F2, F2, F2, F2|SR_NAT_TCP_CLOSE, F2, F2 },
+      { F2, F2, F2, F2, F2, F2 } } }
+};
+
+#undef UN
+#undef SY
+#undef SA
+#undef ES
+#undef F1
+#undef FA
+#undef F2
+#undef MV
+
+/* Moves conn on a packet with the given flags from the internal side
+   (internal 1) or the external one (0).  Returns 1 if the packet is to be
+   dropped.  The shard lock must be held. */
+static int sr_nat_tcp_step(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, struct sr_nat_connection *conn,
+  unsigned int internal, uint8_t flags) {
+
+  uint8_t next = sr_nat_tcp_next[conn->state][conn->last_state != 0]
+    [internal][sr_nat_tcp_class[flags]];
+
+  Debug("TCP connection state %d -> %d\n", conn->state,
+    next & SR_NAT_TCP_STATE);
+  if (next & SR_NAT_TCP_CLOSE) {
+    sr_nat_delete_connection(nat, shard, mapping, conn,
+      sr_nat_conn_prev(mapping, conn));
+    return 0;
   }
-  free(del_conn);
+  if (next & SR_NAT_TCP_UNCACHE)
+    sr_nat_changed(shard, mapping);  /* no longer cacheable */
+  __atomic_store_n(&(conn->state), next & SR_NAT_TCP_STATE, __ATOMIC_RELAXED);
+  if (next & SR_NAT_TCP_MOVE)
+    conn->last_state = internal;
+  sr_nat_conn_touch(conn);
+  return (next & SR_NAT_TCP_DROP) != 0;
+}
+
+/* Established connections only move on a fin (sr_nat_tcp_next), so a
+   segment without syn, fin or rst on one that is still linked just touches
+   it, without the shard lock.  Inside the read section. */
+static bool sr_nat_tcp_express(struct sr_nat_mapping *mapping,
+  struct sr_nat_connection *conn, uint8_t flags) {
+  if (conn == NULL || (flags & (tcp_flag_syn | tcp_flag_fin | tcp_flag_rst))
+    || __atomic_load_n(&(conn->state), __ATOMIC_RELAXED) != nat_conn_est
+    || __atomic_load_n(&(conn->retired), __ATOMIC_RELAXED)
+    || __atomic_load_n(&(mapping->retired), __ATOMIC_RELAXED))
+    return false;
+  sr_nat_conn_touch(conn);
+  return true;
 }
 
 int sr_nat_handle_external_conn(struct sr_nat *nat,
@@ -333,148 +1972,55 @@ int sr_nat_handle_external_conn(struct sr_nat *nat,
   assert(ipHeader->ip_p == ip_protocol_tcp);
   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 
-  pthread_mutex_lock(&(nat->lock));
-
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *mapping = nat->mappings;
-  for(;mapping != NULL; mapping = mapping->next){
-    if (mapping->ip_int == copy->ip_int
-      && mapping->aux_int == copy->aux_int)
-      break;
+  struct sr_nat_shard *shard = &(nat->shards[copy->shard]);
+  int ret = 0;
+
+  /* the lookups take no lock, only the state update below does */
+  sr_nat_read_lock(nat);
+  struct sr_nat_mapping *mapping = sr_nat_find_ext(shard, copy->ip_ext,
+    copy->aux_ext, nat_mapping_tcp, 0);
+  if (mapping == NULL) {
+    /* expired since the caller looked it up */
+    sr_nat_read_unlock(nat);
+    return 1;
   }
-  assert(mapping);
 
-  uint32_t ip_dst = ntohs(ipHeader->ip_src);
+  uint32_t ip_dst = ipHeader->ip_src;
   uint16_t port_dst = ntohs(tcpHeader->source);
 
   Debug("Connection lookup\n");
-  struct sr_nat_connection *conn = mapping->conns;
-  struct sr_nat_connection *prev_conn = NULL;
-  for(;conn != NULL; conn = conn->next){
-    if (conn->ip_dst == ip_dst && conn->port_dst == port_dst)
-      break;
-    prev_conn = conn;
+  struct sr_nat_connection *conn = sr_nat_find_conn(mapping, ip_dst, port_dst);
+  if (sr_nat_tcp_express(mapping, conn, tcpHeader->flags)) {
+    sr_nat_read_unlock(nat);
+    return 0;
+  }
+
+  pthread_mutex_lock(&(shard->lock));
+  if (mapping->retired) {
+    ret = 1;
+    goto done;
   }
+  if (conn == NULL || conn->retired)  /* may have changed since */
+    conn = sr_nat_find_conn(mapping, ip_dst, port_dst);
   /*Connection doesn't exist*/
   if (conn == NULL){
     if(tcpHeader->flags != tcp_flag_syn){
       Debug("Huh? This isn't a syn packet\n");
-      pthread_mutex_unlock(&(nat->lock));
-      return 1;
-    }
-    Debug("No current connection, making unsolicited syn conn\n");
-    conn = malloc(sizeof(struct sr_nat_connection));
-    conn->ip_dst=ip_dst;
-    conn->port_dst=port_dst;
-    conn->state=nat_conn_unest;
-    conn->last_state = false;
-    uint8_t* unsol_pac = malloc(len);
-    memcpy(unsol_pac,packet,len);
-    conn->packet= unsol_pac;
-    conn->next=NULL;
-
-    /*Adds to connections*/
-    struct sr_nat_connection *conn_list = mapping->conns;
-    if (conn_list != NULL){
-      while(conn_list->next != NULL)
-        conn_list=conn_list->next;
-
-      conn_list->next = conn;
-    }
-    else{
-      mapping->conns = conn;
+      ret = 1;
+      goto done;
     }
+    Debug("No current connection, holding unsolicited syn\n");
+    /* the packet is already translated: quote what was actually sent */
+    sr_nat_syn_add(shard, packet, len, mapping->ip_ext, mapping->aux_ext);
+    ret = 1;
+    goto done;
   }
 
-  /*Do state operations on the connection*/
-  switch (conn->state) {
-    /*Do nothing here*/
-    case nat_conn_unest:
-      if (conn->last_state)
-        Debug("Got here somehow?\n");
-      else{
-        Debug("Holding on to packet\n");
-          conn->time_wait = time(NULL);
-          pthread_mutex_unlock(&(nat->lock));
-          return 1;
-      }
-      break;
-
-    /*Look for syn+ack*/  
-    case nat_conn_syn:
-      if (tcpHeader->flags == tcp_flag_syn+tcp_flag_ack
-        && conn->last_state){
-        Debug("Syn Ack recieved\n");
-        conn->state=nat_conn_synack;
-        conn->last_state = false;
-      }else if (tcpHeader->flags == tcp_flag_syn+tcp_flag_ack
-        && conn->last_state){
-        Debug("Second syn, drop it\n");
-        conn->last_state = false;
-        pthread_mutex_unlock(&(nat->lock));
-        return 1;
-      }
-      break;
-
-    /*Look for ack to establish connection*/
-    case nat_conn_synack:
-      if (tcpHeader->flags == tcp_flag_ack
-        && conn->last_state){
-        Debug("Connection established\n");
-        conn->state=nat_conn_est;
-        conn->last_state = false;
-      }
-      break;
-
-    /*Look for fin*/
-    case nat_conn_est:
-      if (tcpHeader->flags == tcp_flag_fin){
-        Debug("Fin1 recieved\n");
-        conn->state=nat_conn_fin1;
-        conn->last_state = false;
-      }
-      break;
-
-    /*Look for ack or fin+ack*/
-    case nat_conn_fin1:
-      if (tcpHeader->flags == tcp_flag_fin
-        && conn->last_state){
-        Debug("Ack recieved\n");
-        conn->state=nat_conn_fin1ack;
-        conn->last_state = false;
-      }
-      else if (tcpHeader->flags == tcp_flag_fin+tcp_flag_ack
-        && conn->last_state){
-        Debug("Fin Ack recieved\n");
-        conn->state=nat_conn_fin2;
-        conn->last_state = false;
-      }
-      break;
-
-    /*Look for fin again*/
-    case nat_conn_fin1ack:
-      if (tcpHeader->flags == tcp_flag_fin
-        && conn->last_state){
-        Debug("Fin2 recieved\n");
-        conn->state=nat_conn_fin1ack;
-        conn->last_state = false;
-      }
-      break;
-
-    /*Look for ack to fully close connection*/
-    case nat_conn_fin2:
-      if (tcpHeader->flags == tcp_flag_ack
-        && conn->last_state){
-        Debug("Closing connection\n");
-        sr_nat_delete_connection(mapping,conn,prev_conn);
-        pthread_mutex_unlock(&(nat->lock));
-        return 0;
-      }
-      break;
-  }
-  conn->time_wait=time(NULL);
-  pthread_mutex_unlock(&(nat->lock));
-  return 0;
+  ret = sr_nat_tcp_step(nat, shard, mapping, conn, 0, tcpHeader->flags);
+done:
+  pthread_mutex_unlock(&(shard->lock));
+  sr_nat_read_unlock(nat);
+  return ret;
 }
 
 int sr_nat_handle_internal_conn(struct sr_nat *nat,
@@ -490,146 +2036,68 @@ int sr_nat_handle_internal_conn(struct sr_nat *nat,
   assert(ipHeader->ip_p == ip_protocol_tcp);
   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 
-  pthread_mutex_lock(&(nat->lock));
-
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *mapping = nat->mappings;
-  for(;mapping != NULL; mapping = mapping->next){
-    if (mapping->ip_int == copy->ip_int
-      && mapping->aux_int == copy->aux_int)
-      break;
+  struct sr_nat_shard *shard = &(nat->shards[copy->shard]);
+  int ret = 0;
+
+  /* the lookups take no lock, only the state update below does */
+  sr_nat_read_lock(nat);
+  struct sr_nat_mapping *mapping = sr_nat_find_ext(shard, copy->ip_ext,
+    copy->aux_ext, nat_mapping_tcp, 0);
+  if (mapping == NULL) {
+    /* expired since the caller looked it up */
+    sr_nat_read_unlock(nat);
+    return 1;
   }
-  assert(mapping);
 
-  uint32_t ip_dst = ntohs(ipHeader->ip_dst);
+  uint32_t ip_dst = ipHeader->ip_dst;
   uint16_t port_dst = ntohs(tcpHeader->destination);
 
   Debug("Connection lookup\n");
-  struct sr_nat_connection *conn = mapping->conns;
-  struct sr_nat_connection *prev_conn = NULL;
-  for(;conn != NULL; conn = conn->next){
-    if (conn->ip_dst == ip_dst && conn->port_dst == port_dst)
-      break;
-    prev_conn = conn;
+  struct sr_nat_connection *conn = sr_nat_find_conn(mapping, ip_dst, port_dst);
+  if (sr_nat_tcp_express(mapping, conn, tcpHeader->flags)) {
+    sr_nat_read_unlock(nat);
+    return 0;
   }
+
+  pthread_mutex_lock(&(shard->lock));
+  if (mapping->retired) {
+    ret = 1;
+    goto done;
+  }
+  if (conn == NULL || conn->retired)  /* may have changed since */
+    conn = sr_nat_find_conn(mapping, ip_dst, port_dst);
   /*Connection doesn't exist*/
   if (conn == NULL){
     if(tcpHeader->flags != tcp_flag_syn){
       Debug("New connection, but this isn't a syn packet\n");
-      pthread_mutex_unlock(&(nat->lock));
-      return 1;
+      ret = 1;
+      goto done;
     }
     Debug("No current connection, making new one\n");
-    conn = malloc(sizeof(struct sr_nat_connection));
+    if (sr_nat_make_room(nat, shard, mapping->host, mapping, true) != 0) {
+      ret = 1;
+      goto done;
+    }
+    /* simultaneous open: the held inbound SYN is dropped (RFC 5382) */
+    sr_nat_syn_release(shard, ipHeader->ip_dst, tcpHeader->destination,
+      mapping->ip_ext, mapping->aux_ext);
+    conn = calloc(1, sizeof(struct sr_nat_connection));
     conn->ip_dst=ip_dst;
     conn->port_dst=port_dst;
     conn->state=nat_conn_syn;
     conn->last_state = true;
-    conn->packet = NULL;
-    conn->next = NULL;
 
     /*Adds to connections*/
-    struct sr_nat_connection *conn_list = mapping->conns;
-    if (conn_list != NULL){
-      while(conn_list->next != NULL)
-        conn_list = conn_list->next;
-
-      conn_list->next = conn;
-    }
-    else{
-      mapping->conns = conn;
-    }
+    sr_nat_link_connection(shard, mapping, conn);
+    if (nat->log)
+      sr_natlog_conn(nat->log, sr_natlog_conn_create, mapping, ip_dst, port_dst);
   }
 
-  /*Do state operations on the connection*/
-  switch (conn->state)
-  {
-    /*For waiting unsolicited syns*/
-    case nat_conn_unest:
-      if (tcpHeader->flags == tcp_flag_syn
-        && !conn->last_state){
-        Debug("Dropping unsolicited syn\n");
-        conn->state=nat_conn_syn;
-        conn->last_state=true;
-        free(conn->packet);
-      }
-      break;
-
-    /*Look for syn+ack*/  
-    case nat_conn_syn:
-      if (tcpHeader->flags == tcp_flag_syn+tcp_flag_ack
-        && !conn->last_state){
-        Debug("Syn Ack recieved\n");
-        conn->state=nat_conn_synack;
-        conn->last_state = true;
-      }else if (tcpHeader->flags == tcp_flag_syn+tcp_flag_ack
-        && !conn->last_state){
-        Debug("Second syn, drop it\n");
-        conn->last_state = true;
-        pthread_mutex_unlock(&(nat->lock));
-        return 1;
-      }
-      break;
-
-    /*Look for ack to establish connection*/
-    case nat_conn_synack:
-      if (tcpHeader->flags == tcp_flag_ack
-        && !conn->last_state){
-        Debug("Connection established\n");
-        conn->state=nat_conn_est;
-        conn->last_state = true;
-      }
-      break;
-
-    /*Look for fin*/
-    case nat_conn_est:
-      if (tcpHeader->flags == tcp_flag_fin){
-        Debug("Fin1 recieved\n");
-        conn->state=nat_conn_fin1;
-        conn->last_state = true;
-      }
-      break;
-
-    /*Look for ack or fin+ack*/
-    case nat_conn_fin1:
-      if (tcpHeader->flags == tcp_flag_fin
-        && !conn->last_state){
-        Debug("Ack recieved\n");
-        conn->state=nat_conn_fin1ack;
-        conn->last_state = true;
-      }
-      else if (tcpHeader->flags == tcp_flag_fin+tcp_flag_ack
-        && !conn->last_state){
-        Debug("Fin Ack recieved\n");
-        conn->state=nat_conn_fin2;
-        conn->last_state = true;
-      }
-      break;
-
-    /*Look for fin again*/
-    case nat_conn_fin1ack:
-      if (tcpHeader->flags == tcp_flag_fin
-        && !conn->last_state){
-        Debug("Fin2 recieved\n");
-        conn->state=nat_conn_fin1ack;
-        conn->last_state = true;
-      }
-      break;
-
-    /*Look for ack to fully close connection*/
-    case nat_conn_fin2:
-      if (tcpHeader->flags == tcp_flag_ack
-        && !conn->last_state){
-        Debug("Closing connection\n");
-        sr_nat_delete_connection(mapping,conn,prev_conn);
-        pthread_mutex_unlock(&(nat->lock));
-        return 0;
-      }
-      break;
-  }
-  conn->time_wait=time(NULL);
-  pthread_mutex_unlock(&(nat->lock));
-  return 0;
+  ret = sr_nat_tcp_step(nat, shard, mapping, conn, 1, tcpHeader->flags);
+done:
+  pthread_mutex_unlock(&(shard->lock));
+  sr_nat_read_unlock(nat);
+  return ret;
 }
 
 static void shuffle(unsigned *x, size_t n) {
@@ -25,12 +25,55 @@
 #define NS 256
 #define MAX_PACKET_VOL 1024
 
+/* NAT state is split into SR_NAT_SHARDS independent shards, each with its
+   own lock, its own slice of the external port / icmp id space and its own
+   expiry sweep.  A mapping lives in the shard picked by its internal host
+   address; the external aux value it is given falls inside that shard's
+   slice, so inbound packets find the same shard from the port alone. */
+#define SR_NAT_SHARDS 8      /* power of two */
+#define SR_NAT_TICK_USEC (1000000 / SR_NAT_SHARDS)  /* one shard swept per tick */
+#define SR_NAT_HASH_SZ 16384 /* hash buckets per shard, power of two */
+#define SR_NAT_HOST_HASH_SZ 256 /* port block owners per shard, power of two */
+
+/* External addresses.  Every internal host is paired with one address of
+   the pool (RFC 4787 "paired" pooling) and all its mappings use it; each
+   shard has its port slice on every address, so capacity grows with the
+   pool.  Inbound packets are looked up by (address, port). */
+#define SR_NAT_POOL_MAX 256
+
+/* Echo replies are matched on (address, id, remote end), so an icmp id only
+   has to be unique per destination.  With reuse enabled, an address whose
+   ids are all taken shares one that is not in use towards the new
+   destination, trying at most SR_NAT_REUSE_TRIES ids. */
+#define SR_NAT_REUSE_TRIES 64
+
+/* Mapping and connection lookups take no lock.  Hash chains and
+   connection lists are only changed under the shard lock and entries that
+   are unlinked are freed once every thread that might still be reading
+   them has left its read section (epoch based reclamation).  Each thread
+   that looks mappings up takes one of SR_NAT_READERS slots. */
+#define SR_NAT_READERS 64
+
+/* Unsolicited inbound SYNs are held for SR_NAT_SYN_HOLD seconds (RFC 5382)
+   in a fixed ring per shard, then answered with an ICMP port unreachable
+   unless an outbound SYN for the same connection came first.  A source may
+   add SR_NAT_SYN_RATE entries a second, in bursts of SR_NAT_SYN_BURST. */
+#define SR_NAT_SYN_SLOTS 256    /* held SYNs per shard, power of two */
+#define SR_NAT_SYN_HOLD 6
+#define SR_NAT_SYN_RATE 4
+#define SR_NAT_SYN_BURST 16
+#define SR_NAT_SYN_SOURCES 256  /* rate limited sources per shard, power of two */
+/* what sr_sendICMP quotes: ethernet + ip header + 8 bytes of tcp */
+#define SR_NAT_SYN_HDRS (14 + 20 + 8)
+
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp
 } sr_nat_mapping_type;
 
+#define SR_NAT_MAPPING_TYPES 3
+
 typedef enum {
   nat_conn_unest,
   nat_conn_syn,
@@ -44,17 +87,21 @@ typedef enum {
 
 struct sr_nat_connection {
   /* add TCP connection state data members here */
-  uint32_t ip_dst;
-  uint16_t port_dst;
+  uint32_t ip_dst;    /* remote end: address in network byte order, */
+  uint16_t port_dst;  /* port in host byte order */
   uint32_t ip_src;
   uint16_t port_src;
 
-  sr_nat_conn_states state; /*session status*/
+  sr_nat_conn_states state; /*session status; read without the lock by the
+                               established express path*/
   bool last_state;
 
-  uint8_t* packet;  /* unsolicited packet */
-  int time_wait;
+  int time_wait;  /* stored without the lock by the flow cache and the
+                     express path */
   struct sr_nat_connection *next;
+
+  unsigned long retired;  /* epoch it was unlinked in, 0 while linked */
+  struct sr_nat_connection *next_retired;
 };
 
 struct sr_nat_mapping {
@@ -63,62 +110,353 @@ struct sr_nat_mapping {
   uint32_t ip_ext; /* external ip addr */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
-  time_t time_wait; /* use to timeout mappings */
+  uint32_t ip_remote; /* with icmp id reuse, the one remote end it serves;
+                         0 otherwise */
+  time_t time_wait; /* use to timeout mappings; stored without the lock */
+  time_t queued;    /* time_wait when last moved to the lists' tail */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  unsigned int nconns; /* length of conns */
+  unsigned int shard; /* index of the owning shard */
+  unsigned int addr;  /* index of ip_ext in the pool */
+  struct sr_nat_host *host; /* owning host, if hosts are tracked */
+  struct sr_nat_mapping *next_int; /* internal (ip, aux) hash chain */
+  struct sr_nat_mapping *next_ext; /* external (ip, aux) hash chain */
+  /* shard list, least recently used first; once retired, next chains the
+     shard's retired mappings */
+  struct sr_nat_mapping *prev;
   struct sr_nat_mapping *next;
+  unsigned long retired;  /* epoch it was unlinked in, 0 while linked */
+  /* changes when the mapping goes away or one of its connections changes
+     state or goes away; never repeats within the shard */
+  unsigned long gen;
+  /* the owning host's list, least recently used first */
+  struct sr_nat_mapping *host_prev;
+  struct sr_nat_mapping *host_next;
+};
+
+/* Per mapping type counters, kept per shard and summed by sr_nat_get_stats */
+struct sr_nat_stats {
+  unsigned long created;   /* mappings created */
+  unsigned long expired;   /* mappings removed by the idle timeout */
+  unsigned long xlate_out; /* packets translated internal -> external */
+  unsigned long xlate_in;  /* packets translated external -> internal */
+  unsigned long no_port;   /* inserts that failed for lack of a free port */
+  unsigned long exhausted; /* inserts that found every port / id taken */
+  unsigned long reused;    /* of those, icmp ids shared per destination */
+  unsigned long evicted;   /* mappings evicted to stay within the limits */
+};
+
+/* Occupancy and limit counters over all shards, see sr_nat_get_usage */
+struct sr_nat_usage {
+  unsigned long mappings;  /* live mappings */
+  unsigned long conns;     /* live tcp connections */
+  unsigned long hosts;     /* tracked internal hosts */
+  unsigned long evicted;   /* mappings evicted by a limit */
+  unsigned long refused;   /* mappings / connections refused by a limit */
+  unsigned long syn_held;     /* ring slots in use by unsolicited SYNs */
+  unsigned long syn_unreach;  /* answered with port unreachable */
+  unsigned long syn_dropped;  /* not held: ring full or source over its rate */
+};
+
+/* An unsolicited SYN waiting in the shard's ring */
+struct sr_nat_syn {
+  uint32_t ip_src;    /* remote address, network order */
+  uint16_t port_src;  /* remote port, network order */
+  uint32_t ip_ext;    /* address it was sent to */
+  uint16_t port_ext;  /* port it was sent to */
+  time_t expire;      /* 0 once answered by an outbound SYN */
+  int next;           /* hash chain, -1 terminated */
+  uint8_t hdrs[SR_NAT_SYN_HDRS];
+};
+
+/* Token bucket of the remote sources hashing to it */
+struct sr_nat_syn_source {
+  unsigned int tokens;
+  time_t last;
 };
 
+/* An internal host, tracked in port block mode and when per host limits
+   are set.  In port block mode (CGNAT) the host is given a contiguous block
+   of external ports/ids the first time it is seen and all its mappings are
+   picked from a bitmap over that block. */
+struct sr_nat_host {
+  uint32_t ip_int;        /* internal ip addr */
+  unsigned int mappings;  /* live mappings */
+  unsigned int conns;     /* live connections over all its mappings */
+  struct sr_nat_mapping *lru;      /* its mappings, least recently used first */
+  struct sr_nat_mapping *lru_tail;
+
+  /* port block mode only */
+  unsigned int block;     /* index of the block within the shard */
+  unsigned int addr;      /* pool address the block is on */
+  uint16_t block_lo;      /* first external port / icmp id of the block */
+  uint16_t next_bit[SR_NAT_MAPPING_TYPES];
+  uint32_t *used[SR_NAT_MAPPING_TYPES]; /* one bit per port, per type */
+  struct sr_nat_host *next;
+};
+
+/* Which ports of a shard's slice are taken on one pool address, for one
+   mapping type.  nonfull has a bit for every word of used that still has a
+   free port, so a free port is found in a few word scans however full the
+   slice is. */
+struct sr_nat_portmap {
+  uint32_t *used;      /* one bit per port of the slice */
+  uint32_t *nonfull;   /* one bit per word of used */
+  unsigned int next;   /* word the next search starts from */
+  unsigned int free;
+  /* icmp id reuse only: mappings sharing each id, and where the next
+     search for one to share starts */
+  uint16_t *refs;
+  unsigned int reuse;
+};
+
+/* A thread's read section: the epoch it entered, 0 when outside one.
+   Padded so that readers do not share cache lines. */
+struct sr_nat_reader {
+  unsigned long epoch;
+  unsigned int depth;
+  char pad[64 - sizeof(unsigned long) - sizeof(unsigned int)];
+};
+
+struct sr_nat_shard {
+  struct sr_nat_mapping *mappings; /* least recently used first */
+  struct sr_nat_mapping *mappings_tail;
+  unsigned int nmappings;
+  unsigned int nconns;
+  struct sr_nat_mapping **int_hash; /* SR_NAT_HASH_SZ buckets */
+  struct sr_nat_mapping **ext_hash; /* SR_NAT_HASH_SZ buckets */
+
+  /* slice of the external port / icmp id space owned by this shard */
+  uint16_t aux_lo;
+  uint16_t aux_hi;
+  unsigned int nwords;   /* words of a portmap's used bitmap */
+  struct sr_nat_portmap *ports; /* [pool address][mapping type] */
+
+  struct sr_nat_stats stats[SR_NAT_MAPPING_TYPES];
+  unsigned long refused;  /* new entries refused by a limit */
+
+  struct sr_nat_host *host_hash[SR_NAT_HOST_HASH_SZ];
+  unsigned int nhosts;
+
+  /* port block mode only */
+  struct sr_nat_host **block_owner; /* nat->blocks entries per pool address */
+  unsigned int next_block;
+
+  time_t last_sweep; /* when the expiry sweep last ran on this shard */
+
+  unsigned long gen;  /* source of the mappings' gens */
+
+  /* unlinked but possibly still read, newest first; freed by the sweep */
+  struct sr_nat_mapping *retired;
+  struct sr_nat_connection *retired_conns;
+
+  /* held unsolicited SYNs: a FIFO ring (all expire after the same time, so
+     the oldest is always at syn_head) indexed by a hash of the flow */
+  struct sr_nat_syn syn[SR_NAT_SYN_SLOTS];
+  unsigned int syn_head;
+  unsigned int syn_count;
+  int syn_hash[SR_NAT_SYN_SLOTS];
+  struct sr_nat_syn_source syn_src[SR_NAT_SYN_SOURCES];
+  unsigned long syn_unreach;
+  unsigned long syn_dropped;
+
+  pthread_mutex_t lock;
+  pthread_mutexattr_t attr;
+};
+
+/* A translation cached outside the nat (see sr_flowcache.h).  conn is only
+   followed by sr_nat_use_ref, after finding mapping still linked with the
+   same gen. */
+struct sr_nat_ref {
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;  /* established tcp connection, or NULL */
+  unsigned long gen;
+  uint32_t ip_ext;
+  uint16_t aux_ext;
+  uint32_t ip_remote;  /* the mapping's, see sr_nat_mapping */
+  sr_nat_mapping_type type;
+  bool inbound;
+};
+
+struct sr_natlog;
+
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  struct sr_instance *sr; /* for the port unreachables of held SYNs */
+  struct sr_natlog *log;  /* event log (sr_natlog.h), NULL when off */
 
-  uint32_t ip_ext; /* external ip addr */
-  uint16_t next_ext_port;
+  uint32_t ip_ext; /* external ip addr, eth2's */
+  uint32_t pool[SR_NAT_POOL_MAX];  /* addresses mappings are given */
+  unsigned int npool;
 
   /* timeout values */
   uint16_t icmp_to;
   uint16_t tcp_establish_to;
   uint16_t tcp_transitory_to;
+  uint16_t udp_to;
+
+  /* port block mode; block_size is 0 when every mapping gets its own port */
+  uint16_t block_size;
+  unsigned int blocks;       /* blocks per shard and pool address */
+  bool block_deterministic;  /* block derived from the internal address */
+  /* asked for before the pool was known (VNS: eth2's address comes with
+     the hardware info); sr_nat_ext_ip sets them up */
+  uint16_t pending_block_size;
+  bool pending_block_deterministic;
+
+  /* icmp ids only unique per destination once an address runs out */
+  bool icmp_reuse;
+
+  /* limits, 0 = unlimited.  The global limits are split evenly over the
+     shards so that each shard enforces its part under its own lock. */
+  unsigned int shard_max_mappings;
+  unsigned int shard_max_conns;
+  unsigned int host_max_mappings;
+  unsigned int host_max_conns;
+
+  /* checkpointing; snap_file is NULL when disabled */
+  const char *snap_file;
+  unsigned int snap_interval;  /* seconds between snapshots, 0 = on exit only */
+  pthread_mutex_t snap_lock;   /* one sr_nat_save at a time */
+  const char *restore_file;  /* warm restart waiting for the pool */
 
   bool last_state;  /* true if last state was internal; false otherwise */
 
-  /* threading */
-  pthread_mutex_t lock;
-  pthread_mutexattr_t attr;
+  /* epoch based reclamation, see SR_NAT_READERS */
+  unsigned long epoch;
+  unsigned int nreaders;
+  struct sr_nat_reader readers[SR_NAT_READERS];
+
+  /* threading; no thread when the io_uring loop (sr_uring.h) or the epoll
+     loop (sr_epoll.h) runs the ticks */
   pthread_attr_t thread_attr;
   pthread_t thread;
+  unsigned int sweep_next;  /* shard the next tick sweeps */
 };
 
 
-int sr_nat_init(struct sr_instance *, uint32_t, uint32_t, uint32_t);  /* Initializes the nat */
+int sr_nat_init(struct sr_instance *, uint32_t, uint32_t, uint32_t, uint32_t);  /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
+/* One step of the timeout handling: sweeps the next shard.  Runs every
+   SR_NAT_TICK_USEC.  Returns 1 once SIGTERM/SIGINT came: the timeout thread
+   then calls sr_nat_shutdown and exits, the -a and -e loops return to main,
+   which calls it. */
+int   sr_nat_tick(struct sr_nat *nat);
+/* Writes the final checkpoint and flushes and closes the event log. */
+void  sr_nat_shutdown(struct sr_nat *nat);
+void  sr_nat_sweep(struct sr_nat *nat, struct sr_nat_shard *shard, time_t now);
 
-/* Get the mapping associated with given external port.
+/* Sets the pool of external addresses (network order).  Must be called
+   before sr_nat_set_port_blocks and before any packet is translated;
+   without it the pool is eth2's address.  Returns 0 on success. */
+int sr_nat_set_pool(struct sr_nat *nat, const uint32_t *addrs, unsigned int n);
+
+/* True if ip (network order) is a pool address, answered for by proxy ARP */
+bool sr_nat_pool_has(struct sr_nat *nat, uint32_t ip);
+
+/* Switches the nat to port block allocation. Must be called before any
+   packet is translated; without a pool yet it takes effect once
+   sr_nat_ext_ip has set one. Returns 0 on success. */
+int sr_nat_set_port_blocks(struct sr_nat *nat, uint16_t block_size,
+  bool deterministic);
+
+/* Lets an icmp id that is in use be handed out again for echoes to another
+   destination once every id of the address is taken.  Echo mappings are
+   then kept per destination.  Not for port block mode.  Must be called
+   before any packet is translated.  Returns 0 on success. */
+int sr_nat_set_icmp_reuse(struct sr_nat *nat);
+
+/* Caps the number of mappings and tcp connections, overall and per
+   internal host (0 = no limit).  When a limit is reached the least
+   recently used entry that has been idle for at least a second is
+   evicted; if there is none the new entry is refused.  Must be called
+   before any packet is translated. */
+void sr_nat_set_limits(struct sr_nat *nat, unsigned int max_mappings,
+  unsigned int max_conns, unsigned int host_max_mappings,
+  unsigned int host_max_conns);
+
+/* Checkpoint / warm restart. sr_nat_save writes every mapping, its
+   connections and their remaining idle time to file; sr_nat_restore loads
+   such a file into an initialized nat that has not seen any packet yet.
+   Both return the number of mappings handled, or -1 on error.  Without a
+   pool yet the restore waits for sr_nat_ext_ip (and returns 0); no
+   snapshot is written until then. */
+long sr_nat_save(struct sr_nat *nat, const char *file);
+long sr_nat_restore(struct sr_nat *nat, const char *file);
+
+/* Snapshots to file every interval seconds, from a thread of its own (0:
+   only on SIGTERM/SIGINT, after which the router stops). */
+void sr_nat_set_checkpoint(struct sr_nat *nat, const char *file,
+  unsigned int interval);
+
+/* Sends mapping, connection and port block events to log (sr_natlog.h),
+   which is closed, after a last flush, on SIGTERM/SIGINT. */
+void sr_nat_set_log(struct sr_nat *nat, struct sr_natlog *log);
+
+/* Sums the per shard counters of one mapping type into stats. */
+void sr_nat_get_stats(struct sr_nat *nat, sr_nat_mapping_type type,
+  struct sr_nat_stats *stats);
+
+/* Sums the occupancy and limit counters of all shards into usage. */
+void sr_nat_get_usage(struct sr_nat *nat, struct sr_nat_usage *usage);
+
+/* Read sections.  Mappings and connections found with the shard lock not
+   held stay valid (though maybe unlinked) until sr_nat_read_unlock.
+   Sections nest; they do not block writers. */
+void sr_nat_read_lock(struct sr_nat *nat);
+void sr_nat_read_unlock(struct sr_nat *nat);
+
+/* Takes a reference to the mapping with external address ip_ext and aux
+   value aux_ext and, for tcp, to its connection with the remote end, which
+   must be established.  Returns 0 on success. */
+int sr_nat_get_ref(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_ext, uint16_t aux_ext, uint32_t ip_remote, uint16_t port_remote,
+  bool inbound, struct sr_nat_ref *ref);
+
+/* Marks the referenced mapping (and connection) as used, like a lookup
+   would.  Returns false if the reference is out of date. */
+bool sr_nat_use_ref(struct sr_nat *nat, const struct sr_nat_ref *ref);
+
+/* Shard owning an internal host / an external port or icmp id. */
+struct sr_nat_shard *sr_nat_shard_int(struct sr_nat *nat, uint32_t ip_int);
+struct sr_nat_shard *sr_nat_shard_ext(struct sr_nat *nat, uint16_t aux_ext);
+
+/* Get the mapping associated with given external (ip, port) pair.
+   ip_remote is the packet's other end, only looked at for icmp id reuse.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+    uint32_t ip_remote);
 
 /* Get the mapping associated with given internal (ip, port) pair.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t ip_remote);
 
 /* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+   You must free the returned structure if it is not NULL.  NULL means no
+   port was free or a limit refused the mapping. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type);
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t ip_remote);
 
-struct sr_nat_mapping *sr_nat_insert_mapping_unsol(struct sr_nat *nat,
-  uint16_t aux_ext, sr_nat_mapping_type type);
+/* Holds an unsolicited inbound SYN (frame as received, untranslated) until
+   it times out or an outbound SYN for the same connection is seen.
+   Returns 0 if held, -1 if it was dropped. */
+int sr_nat_hold_syn(struct sr_nat *nat, uint8_t *packet /* borrowed */,
+  unsigned int len);
 
-void sr_nat_delete_mapping(struct sr_nat *nat, struct sr_nat_mapping *del_map,
-  struct sr_nat_mapping *prev);
+void sr_nat_delete_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *del_map);
 
 void sr_nat_ext_ip(struct sr_nat*,struct sr_instance*);
 
-void sr_nat_delete_connection(struct sr_nat_mapping *map, 
-  struct sr_nat_connection *del_conn, struct sr_nat_connection *prev);
+void sr_nat_delete_connection(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *map, struct sr_nat_connection *del_conn,
+  struct sr_nat_connection *prev);
 
 int sr_nat_handle_external_conn(struct sr_nat *nat, struct sr_nat_mapping *copy,
   uint8_t* packet /* borrowed */, unsigned int len);
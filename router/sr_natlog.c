@@ -0,0 +1,336 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_natlog.c
+ *
+ * Description:
+ *
+ * NAT event log, see sr_natlog.h.
+ *
+ * Logging an event is a thread local load, a load of the ring's tail, a
+ * coarse clock read and a 32 byte copy.  A thread's first event takes a
+ * ring slot and allocates its ring.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "sr_natlog.h"
+
+#ifdef CLOCK_REALTIME_COARSE
+#define SR_NATLOG_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define SR_NATLOG_CLOCK CLOCK_REALTIME
+#endif
+
+/* This thread's ring, and the log it belongs to */
+static __thread struct sr_natlog_ring *sr_natlog_self = NULL;
+static __thread struct sr_natlog *sr_natlog_owner = NULL;
+
+/* Takes a ring for the calling thread; NULL once every slot is taken. */
+static struct sr_natlog_ring *sr_natlog_join(struct sr_natlog *log)
+{
+  unsigned int slot = __atomic_fetch_add(&(log->nrings), 1, __ATOMIC_SEQ_CST);
+  struct sr_natlog_ring *ring = NULL;
+
+  if (slot < SR_NATLOG_THREADS) {
+    ring = calloc(1, sizeof(struct sr_natlog_ring));
+    __atomic_store_n(&(log->rings[slot]), ring, __ATOMIC_RELEASE);
+  }
+  else {
+    fprintf(stderr, "NAT log: more than %d threads logging\n", SR_NATLOG_THREADS);
+  }
+  sr_natlog_owner = log;
+  sr_natlog_self = ring;
+  return ring;
+}
+
+static void sr_natlog_add(struct sr_natlog *log, struct sr_natlog_rec *rec)
+{
+  struct sr_natlog_ring *ring = sr_natlog_self;
+  struct timespec now;
+  unsigned long head;
+
+  if (sr_natlog_owner != log)
+    ring = sr_natlog_join(log);
+  if (ring == NULL) {
+    __atomic_fetch_add(&(log->lost), 1, __ATOMIC_RELAXED);
+    return;
+  }
+  head = ring->head;
+  if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) >= SR_NATLOG_RING) {
+    __atomic_store_n(&(ring->dropped), ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  clock_gettime(SR_NATLOG_CLOCK, &now);
+  rec->msec = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  ring->recs[head & (SR_NATLOG_RING - 1)] = *rec;
+  __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+static uint8_t sr_natlog_proto(sr_nat_mapping_type type)
+{
+  switch (type) {
+    case nat_mapping_icmp: return 1;
+    case nat_mapping_tcp:  return 6;
+    case nat_mapping_udp:  return 17;
+  }
+  return 0;
+}
+
+void sr_natlog_mapping(struct sr_natlog *log, sr_natlog_event event,
+  const struct sr_nat_mapping *mapping)
+{
+  struct sr_natlog_rec rec;
+  rec.ip_int = mapping->ip_int;
+  rec.ip_ext = mapping->ip_ext;
+  rec.ip_remote = mapping->ip_remote;
+  rec.aux_int = mapping->aux_int;
+  rec.aux_ext = mapping->aux_ext;
+  rec.port_remote = 0;
+  rec.event = event;
+  rec.proto = sr_natlog_proto(mapping->type);
+  sr_natlog_add(log, &rec);
+}
+
+void sr_natlog_conn(struct sr_natlog *log, sr_natlog_event event,
+  const struct sr_nat_mapping *mapping, uint32_t ip_remote,
+  uint16_t port_remote)
+{
+  struct sr_natlog_rec rec;
+  rec.ip_int = mapping->ip_int;
+  rec.ip_ext = mapping->ip_ext;
+  rec.ip_remote = ip_remote;
+  rec.aux_int = mapping->aux_int;
+  rec.aux_ext = mapping->aux_ext;
+  rec.port_remote = port_remote;
+  rec.event = event;
+  rec.proto = sr_natlog_proto(mapping->type);
+  sr_natlog_add(log, &rec);
+}
+
+void sr_natlog_block(struct sr_natlog *log, sr_natlog_event event,
+  uint32_t ip_int, uint32_t ip_ext, uint16_t port_lo, uint16_t port_hi)
+{
+  struct sr_natlog_rec rec;
+  rec.ip_int = ip_int;
+  rec.ip_ext = ip_ext;
+  rec.ip_remote = 0;
+  rec.aux_int = 0;
+  rec.aux_ext = port_lo;
+  rec.port_remote = port_hi;
+  rec.event = event;
+  rec.proto = 0;
+  sr_natlog_add(log, &rec);
+}
+
+static void sr_natlog_put16(uint8_t *p, uint16_t v)
+{
+  v = htons(v);
+  memcpy(p, &v, 2);
+}
+
+static void sr_natlog_put32(uint8_t *p, uint32_t v)
+{
+  v = htonl(v);
+  memcpy(p, &v, 4);
+}
+
+static void sr_natlog_put_rec(uint8_t *p, const struct sr_natlog_rec *rec)
+{
+  sr_natlog_put32(p, (uint32_t)(rec->msec >> 32));
+  sr_natlog_put32(p + 4, (uint32_t)rec->msec);
+  memcpy(p + 8, &(rec->ip_int), 4);
+  memcpy(p + 12, &(rec->ip_ext), 4);
+  memcpy(p + 16, &(rec->ip_remote), 4);
+  sr_natlog_put16(p + 20, rec->aux_int);
+  sr_natlog_put16(p + 22, rec->aux_ext);
+  sr_natlog_put16(p + 24, rec->port_remote);
+  p[26] = rec->event;
+  p[27] = rec->proto;
+}
+
+static unsigned long sr_natlog_dropped(struct sr_natlog *log)
+{
+  unsigned long dropped = __atomic_load_n(&(log->lost), __ATOMIC_RELAXED);
+  unsigned int i;
+  for (i = 0; i < SR_NATLOG_THREADS; i++) {
+    struct sr_natlog_ring *ring = __atomic_load_n(&(log->rings[i]), __ATOMIC_ACQUIRE);
+    if (ring)
+      dropped += __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+  }
+  return dropped;
+}
+
+/* Writes the n records in batch behind a header. */
+static void sr_natlog_emit(struct sr_natlog *log, uint8_t *batch, unsigned int n)
+{
+  size_t len = SR_NATLOG_HDR_LEN + n * SR_NATLOG_REC_LEN;
+  int ok;
+
+  sr_natlog_put16(batch, SR_NATLOG_VERSION);
+  sr_natlog_put16(batch + 2, n);
+  sr_natlog_put32(batch + 4, (uint32_t)time(NULL));
+  sr_natlog_put32(batch + 8, (uint32_t)log->written);
+  sr_natlog_put32(batch + 12, (uint32_t)sr_natlog_dropped(log));
+  if (log->fp)
+    ok = fwrite(batch, len, 1, log->fp) == 1;
+  else
+    /* a collector that does not keep up loses batches, it never holds
+       the writer up */
+    ok = send(log->fd, batch, len, MSG_DONTWAIT) == (ssize_t)len;
+  if (ok)
+    __atomic_store_n(&(log->written), log->written + n, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&(log->lost), n, __ATOMIC_RELAXED);
+}
+
+/* Moves everything queued so far out, in full batches but the last.
+   Returns the number of records moved. */
+static unsigned long sr_natlog_drain(struct sr_natlog *log, uint8_t *batch)
+{
+  unsigned int i, n = 0;
+  unsigned long moved = 0;
+
+  for (i = 0; i < SR_NATLOG_THREADS; i++) {
+    struct sr_natlog_ring *ring = __atomic_load_n(&(log->rings[i]), __ATOMIC_ACQUIRE);
+    unsigned long tail, head;
+    if (ring == NULL)
+      continue;
+    head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    for (tail = ring->tail; tail != head; tail++) {
+      sr_natlog_put_rec(batch + SR_NATLOG_HDR_LEN + n * SR_NATLOG_REC_LEN,
+        &(ring->recs[tail & (SR_NATLOG_RING - 1)]));
+      if (++n == SR_NATLOG_BATCH) {
+        sr_natlog_emit(log, batch, n);
+        n = 0;
+      }
+    }
+    moved += tail - ring->tail;
+    __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+  }
+  if (n)
+    sr_natlog_emit(log, batch, n);
+  if (log->fp)
+    fflush(log->fp);
+  return moved;
+}
+
+static void *sr_natlog_writer(void *arg)
+{
+  struct sr_natlog *log = arg;
+  uint8_t batch[SR_NATLOG_HDR_LEN + SR_NATLOG_BATCH * SR_NATLOG_REC_LEN];
+  struct timespec interval;
+
+  interval.tv_sec = 0;
+  interval.tv_nsec = SR_NATLOG_FLUSH_MS * 1000000L;
+  while (!log->stop) {
+    /* a ring that filled up to a quarter since the last pass is drained
+       again straight away */
+    if (sr_natlog_drain(log, batch) < SR_NATLOG_RING / 4)
+      nanosleep(&interval, NULL);
+  }
+  sr_natlog_drain(log, batch);
+  return NULL;
+}
+
+/* Connected datagram socket to "host:port", -1 on error. */
+static int sr_natlog_udp(const char *dest)
+{
+  struct addrinfo hints, *res, *ai;
+  char host[256];
+  const char *port = strrchr(dest, ':');
+  int fd = -1;
+
+  if (port == NULL || (size_t)(port - dest) >= sizeof(host))
+    return -1;
+  memcpy(host, dest, port - dest);
+  host[port - dest] = '\0';
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port + 1, &hints, &res) != 0)
+    return -1;
+  for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+/* Connected UNIX datagram socket to path, -1 on error. */
+static int sr_natlog_unix(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+struct sr_natlog *sr_natlog_open(const char *target)
+{
+  struct sr_natlog *log = calloc(1, sizeof(struct sr_natlog));
+
+  log->fd = -1;
+  if (strncmp(target, "udp:", 4) == 0)
+    log->fd = sr_natlog_udp(target + 4);
+  else if (strncmp(target, "unix:", 5) == 0)
+    log->fd = sr_natlog_unix(target + 5);
+  else if ((log->fp = fopen(target, "ab")) != NULL)
+    setvbuf(log->fp, NULL, _IOFBF, 1 << 16);
+
+  if ((log->fp == NULL && log->fd < 0)
+    || pthread_create(&(log->thread), NULL, sr_natlog_writer, log) != 0) {
+    fprintf(stderr, "NAT log: cannot open %s\n", target);
+    if (log->fp)
+      fclose(log->fp);
+    if (log->fd >= 0)
+      close(log->fd);
+    free(log);
+    return NULL;
+  }
+  printf("NAT event log to %s\n", target);
+  return log;
+}
+
+void sr_natlog_close(struct sr_natlog *log)
+{
+  unsigned int i;
+
+  log->stop = 1;
+  pthread_join(log->thread, NULL);
+  if (log->fp)
+    fclose(log->fp);
+  if (log->fd >= 0)
+    close(log->fd);
+  for (i = 0; i < SR_NATLOG_THREADS; i++)
+    free(log->rings[i]);
+  free(log);
+}
+
+void sr_natlog_counts(struct sr_natlog *log, unsigned long *written,
+  unsigned long *dropped)
+{
+  *written = __atomic_load_n(&(log->written), __ATOMIC_RELAXED);
+  *dropped = sr_natlog_dropped(log);
+}
@@ -0,0 +1,113 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_natlog.h
+ *
+ * Description:
+ *
+ * NAT event log, for keeping a record of every translation: mappings and
+ * tcp connections created and removed, port blocks assigned and released.
+ *
+ * The forwarding path never waits on it.  Every thread that logs appends
+ * to a ring of its own (single producer, single consumer, no lock); a
+ * writer thread drains the rings every SR_NATLOG_FLUSH_MS and writes the
+ * events out in batches, to a file or as datagrams to a UDP or UNIX socket
+ * collector.  An event that finds its ring full is dropped and counted.
+ *
+ * Batches are IPFIX-like, everything in network byte order:
+ *
+ *   header  uint16 version (SR_NATLOG_VERSION), uint16 records,
+ *           uint32 export time (s), uint32 sequence (records sent before
+ *           this batch), uint32 events dropped so far
+ *   record  uint64 time (ms since the epoch), uint32 internal address,
+ *           uint32 external address, uint32 remote address, uint16
+ *           internal port / id, uint16 external port / id, uint16 remote
+ *           port, uint8 event (sr_natlog_event), uint8 ip protocol
+ *
+ * Block events carry the block's first and last port in the external and
+ * remote port fields and protocol 0.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_NATLOG_H
+#define SR_NATLOG_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sr_nat.h"
+
+#define SR_NATLOG_VERSION 1
+#define SR_NATLOG_THREADS 64   /* threads that may log */
+#define SR_NATLOG_RING 16384   /* events per thread, power of two */
+#define SR_NATLOG_FLUSH_MS 50
+#define SR_NATLOG_HDR_LEN 16
+#define SR_NATLOG_REC_LEN 28
+/* a batch fits a 1500 byte MTU datagram */
+#define SR_NATLOG_BATCH 52
+
+typedef enum {
+  sr_natlog_map_create = 1,
+  sr_natlog_map_delete,
+  sr_natlog_conn_create,
+  sr_natlog_conn_delete,
+  sr_natlog_block_assign,
+  sr_natlog_block_release
+} sr_natlog_event;
+
+/* An event as queued, addresses in network and ports in host byte order */
+struct sr_natlog_rec {
+  uint64_t msec;
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint32_t ip_remote;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint16_t port_remote;
+  uint8_t event;
+  uint8_t proto;
+};
+
+/* One thread's events.  head and dropped are only written by the thread,
+   tail only by the writer; they are kept on separate cache lines. */
+struct sr_natlog_ring {
+  unsigned long head;
+  unsigned long dropped;
+  char pad[64 - 2 * sizeof(unsigned long)];
+  unsigned long tail;
+  char pad2[64 - sizeof(unsigned long)];
+  struct sr_natlog_rec recs[SR_NATLOG_RING];
+};
+
+struct sr_natlog {
+  FILE *fp;   /* file output, or NULL */
+  int fd;     /* collector socket, or -1 */
+  struct sr_natlog_ring *rings[SR_NATLOG_THREADS];  /* taken on first use */
+  unsigned int nrings;
+  unsigned long lost;     /* events of threads beyond SR_NATLOG_THREADS,
+                             and of batches the collector did not take */
+  unsigned long written;  /* records handed to the file / collector */
+  volatile int stop;
+  pthread_t thread;
+};
+
+/* Opens the log and starts its writer.  target is a file name (appended
+   to), "udp:host:port" or "unix:path" (a datagram socket).  Returns NULL
+   on error. */
+struct sr_natlog *sr_natlog_open(const char *target);
+
+/* Writes out what is queued, stops the writer and frees the log. */
+void sr_natlog_close(struct sr_natlog *log);
+
+/* Queues an event; never blocks. */
+void sr_natlog_mapping(struct sr_natlog *log, sr_natlog_event event,
+  const struct sr_nat_mapping *mapping);
+void sr_natlog_conn(struct sr_natlog *log, sr_natlog_event event,
+  const struct sr_nat_mapping *mapping, uint32_t ip_remote,
+  uint16_t port_remote);
+void sr_natlog_block(struct sr_natlog *log, sr_natlog_event event,
+  uint32_t ip_int, uint32_t ip_ext, uint16_t port_lo, uint16_t port_hi);
+
+/* Events written so far, and dropped (ring full, no ring, not taken). */
+void sr_natlog_counts(struct sr_natlog *log, unsigned long *written,
+  unsigned long *dropped);
+
+#endif
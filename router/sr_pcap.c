@@ -0,0 +1,377 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcap.c
+ *
+ * Description:
+ *
+ * pcap replay backend for local packet i/o (sr_io.h), for measuring the
+ * router without a network, a VNS server or Mininet.  An interface line
+ * names a capture file instead of a device:
+ *
+ *   eth1 client.pcap 10.0.1.1
+ *   backend pcap fast neighbors
+ *
+ * - receive: the captures (sr_dump_read) are loaded into memory up front,
+ *   then their frames are handed to sr_handlepacket in time stamp order,
+ *   as fast as possible ("fast", the default) or at the pace they were
+ *   captured at ("paced").  "-" is an interface that receives nothing.
+ * - transmit: every frame sent out of an interface is written to its own
+ *   capture, <file>.out.pcap (<interface>.out.pcap for "-"), stamped with
+ *   the time of the frame being handled, so a fast replay writes the same
+ *   files every time.
+ * - arp: requests for an address in the neighbor file ("<ip> <ethernet
+ *   address>" lines) are answered, the reply being handled after the frame
+ *   that caused the request.  Other requests go unanswered.
+ *
+ * When the captures are used up the run prints the frames handled per
+ * second to stderr and returns.  With worker threads (sr_workers.h) that
+ * includes waiting for them; the output captures are then in the order the
+ * workers sent in, and stamped with whichever frame was replayed last.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sr_dumper.h"
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_workers.h"
+
+#define SR_PCAP_FRAME 65536
+#define SR_PCAP_NEIGHBORS 256
+#define SR_PCAP_REPLIES 64  /* arp replies waiting to be handled */
+#define SR_PCAP_ARP_LEN (sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))
+
+/* A frame in a port's capture, followed by its bytes */
+struct sr_pcap_rec {
+  uint64_t usec;
+  uint32_t len;
+  uint32_t next;  /* bytes from here to the next one */
+};
+
+struct sr_pcap_port {
+  char name[sr_IFACE_NAMELEN];
+  uint8_t *recs;        /* the capture, as sr_pcap_recs */
+  size_t size;
+  size_t at;            /* next to replay */
+  FILE *out;
+  unsigned long rx, tx;
+};
+
+struct sr_pcap_reply {
+  unsigned int port;
+  uint8_t frame[SR_PCAP_ARP_LEN];
+};
+
+struct sr_pcap {
+  struct sr_io io;  /* first: passed around as its sr_io */
+  pthread_mutex_t lock;  /* outputs and replies */
+  int paced;
+  struct timeval now;    /* time stamp of the frame being handled */
+  unsigned int nports;
+  struct sr_pcap_port ports[SR_IO_PORTS];
+  unsigned int nneighbors;
+  struct {
+    uint32_t ip;
+    unsigned char addr[ETHER_ADDR_LEN];
+  } neighbors[SR_PCAP_NEIGHBORS];
+  unsigned int nreplies;
+  struct sr_pcap_reply replies[SR_PCAP_REPLIES];
+  uint8_t buf[SR_PCAP_FRAME];  /* the frame being handled */
+};
+
+/* Queues the answer to an arp request sent out of port i, if the neighbor
+   file knows the address.  Called with the lock held. */
+static void sr_pcap_arp(struct sr_pcap *pcap, unsigned int i,
+  const uint8_t *buf, unsigned int len)
+{
+  const sr_ethernet_hdr_t *eth = (const sr_ethernet_hdr_t *)buf;
+  const sr_arp_hdr_t *req = (const sr_arp_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+  struct sr_pcap_reply *reply;
+  sr_ethernet_hdr_t *reth;
+  sr_arp_hdr_t *rep;
+  unsigned int n;
+
+  if (len < SR_PCAP_ARP_LEN || eth->ether_type != htons(ethertype_arp)
+    || req->ar_op != htons(arp_op_request)
+    || pcap->nreplies == SR_PCAP_REPLIES)
+    return;
+  for (n = 0; n < pcap->nneighbors; n++)
+    if (pcap->neighbors[n].ip == req->ar_tip)
+      break;
+  if (n == pcap->nneighbors)
+    return;
+
+  reply = &(pcap->replies[pcap->nreplies++]);
+  reply->port = i;
+  reth = (sr_ethernet_hdr_t *)reply->frame;
+  rep = (sr_arp_hdr_t *)(reply->frame + sizeof(sr_ethernet_hdr_t));
+  memcpy(reth->ether_dhost, eth->ether_shost, ETHER_ADDR_LEN);
+  memcpy(reth->ether_shost, pcap->neighbors[n].addr, ETHER_ADDR_LEN);
+  reth->ether_type = htons(ethertype_arp);
+  *rep = *req;
+  rep->ar_op = htons(arp_op_reply);
+  memcpy(rep->ar_sha, pcap->neighbors[n].addr, ETHER_ADDR_LEN);
+  rep->ar_sip = req->ar_tip;
+  memcpy(rep->ar_tha, req->ar_sha, ETHER_ADDR_LEN);
+  rep->ar_tip = req->ar_sip;
+}
+
+static int sr_pcap_send(struct sr_io *io, uint8_t *buf, unsigned int len,
+  const char *iface)
+{
+  struct sr_pcap *pcap = (struct sr_pcap *)io;
+  struct pcap_pkthdr h;
+  unsigned int i;
+
+  for (i = 0; i < pcap->nports; i++)
+    if (strcmp(pcap->ports[i].name, iface) == 0)
+      break;
+  if (i == pcap->nports)
+    return -1;
+
+  pthread_mutex_lock(&(pcap->lock));
+  h.ts = pcap->now;
+  h.caplen = h.len = len;
+  sr_dump(pcap->ports[i].out, &h, buf);
+  pcap->ports[i].tx++;
+  sr_pcap_arp(pcap, i, buf, len);
+  pthread_mutex_unlock(&(pcap->lock));
+  return 0;
+}
+
+/* Handles the arp replies the last frame caused (and those they cause). */
+static void sr_pcap_replies(struct sr_pcap *pcap, struct sr_instance *sr)
+{
+  struct sr_pcap_reply reply;
+
+  pthread_mutex_lock(&(pcap->lock));
+  while (pcap->nreplies) {
+    reply = pcap->replies[--pcap->nreplies];
+    pthread_mutex_unlock(&(pcap->lock));
+    memcpy(pcap->buf, reply.frame, SR_PCAP_ARP_LEN);
+    sr_log_packet(sr, pcap->buf, SR_PCAP_ARP_LEN);
+    sr_handlepacket(sr, pcap->buf, SR_PCAP_ARP_LEN,
+      pcap->ports[reply.port].name);
+    pthread_mutex_lock(&(pcap->lock));
+  }
+  pthread_mutex_unlock(&(pcap->lock));
+}
+
+static int sr_pcap_run(struct sr_io *io, struct sr_instance *sr)
+{
+  struct sr_pcap *pcap = (struct sr_pcap *)io;
+  struct sr_pcap_port *port;
+  struct sr_pcap_rec *rec, *first = NULL;
+  struct timespec start, end, until;
+  unsigned long frames = 0;
+  uint64_t usec0 = 0, wait;
+  unsigned int i;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1) {
+    /* the earliest frame of all the captures */
+    port = NULL;
+    rec = NULL;
+    for (i = 0; i < pcap->nports; i++) {
+      struct sr_pcap_port *p = &(pcap->ports[i]);
+      struct sr_pcap_rec *r = (struct sr_pcap_rec *)(p->recs + p->at);
+      if (p->at < p->size && (rec == NULL || r->usec < rec->usec)) {
+        port = p;
+        rec = r;
+      }
+    }
+    if (rec == NULL)
+      break;
+    port->at += rec->next;
+    if (first == NULL) {
+      first = rec;
+      usec0 = rec->usec;
+    }
+
+    if (pcap->paced) {
+      wait = rec->usec - usec0;
+      until.tv_sec = start.tv_sec + wait / 1000000;
+      until.tv_nsec = start.tv_nsec + (wait % 1000000) * 1000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+    }
+
+    pthread_mutex_lock(&(pcap->lock));
+    pcap->now.tv_sec = rec->usec / 1000000;
+    pcap->now.tv_usec = rec->usec % 1000000;
+    pthread_mutex_unlock(&(pcap->lock));
+
+    /* a copy: the router changes the frame where it lies */
+    memcpy(pcap->buf, (uint8_t *)rec + sizeof(*rec), rec->len);
+    port->rx++;
+    frames++;
+    sr_log_packet(sr, pcap->buf, rec->len);
+    sr_handlepacket(sr, pcap->buf, rec->len, port->name);
+    sr_pcap_replies(pcap, sr);
+  }
+  /* what the workers (-j) still have, and the replies to it */
+  while (1) {
+    sr_workers_drain(sr);
+    pthread_mutex_lock(&(pcap->lock));
+    i = pcap->nreplies;
+    pthread_mutex_unlock(&(pcap->lock));
+    if (i == 0)
+      break;
+    sr_pcap_replies(pcap, sr);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "pcap replay: %lu frames in %.3f s, %.3f Mpps\n", frames,
+    secs, secs > 0 ? frames / secs / 1e6 : 0.0);
+  pthread_mutex_lock(&(pcap->lock));
+  for (i = 0; i < pcap->nports; i++) {
+    fprintf(stderr, "  %s: %lu in, %lu out\n", pcap->ports[i].name,
+      pcap->ports[i].rx, pcap->ports[i].tx);
+    fflush(pcap->ports[i].out);
+  }
+  pthread_mutex_unlock(&(pcap->lock));
+  return 0;
+}
+
+/* Loads capture file into port. */
+static int sr_pcap_load(struct sr_pcap_port *port, const char *file)
+{
+  static unsigned char frame[SR_PCAP_FRAME];
+  struct pcap_pkthdr h;
+  struct sr_pcap_rec *rec;
+  size_t cap = 0, need;
+  uint8_t *recs;
+  int flags, ret;
+  FILE *fp = sr_dump_read_open(file, &flags);
+
+  if (fp == NULL)
+    return -1;
+  while ((ret = sr_dump_read(fp, flags, &h, frame, sizeof(frame))) == 1) {
+    need = sizeof(struct sr_pcap_rec) + ((h.caplen + 7) & ~7u);
+    if (port->size + need > cap) {
+      cap = cap ? 2 * cap : (1 << 20);
+      if ((recs = realloc(port->recs, cap)) == NULL) {
+        ret = -1;
+        break;
+      }
+      port->recs = recs;
+    }
+    rec = (struct sr_pcap_rec *)(port->recs + port->size);
+    rec->usec = (uint64_t)h.ts.tv_sec * 1000000 + h.ts.tv_usec;
+    rec->len = h.caplen;
+    rec->next = need;
+    memcpy((uint8_t *)rec + sizeof(*rec), frame, h.caplen);
+    port->size += need;
+  }
+  fclose(fp);
+  if (ret != 0)
+    fprintf(stderr, "pcap: %s: cut short\n", file);
+  return ret;
+}
+
+static int sr_pcap_neighbors(struct sr_pcap *pcap, const char *file)
+{
+  char line[256], ip[32], mac[32];
+  struct in_addr in;
+  unsigned int lineno = 0;
+  FILE *fp = fopen(file, "r");
+
+  if (fp == NULL) {
+    perror(file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *hash = strchr(line, '#');
+    int n;
+
+    lineno++;
+    if (hash)
+      *hash = '\0';
+    if ((n = sscanf(line, "%31s %31s", ip, mac)) <= 0)
+      continue;
+    if (n != 2 || inet_aton(ip, &in) == 0 || pcap->nneighbors
+      == SR_PCAP_NEIGHBORS || sr_io_parse_mac(mac,
+        pcap->neighbors[pcap->nneighbors].addr) != 0) {
+      fprintf(stderr, "%s:%u: bad neighbor\n", file, lineno);
+      fclose(fp);
+      return -1;
+    }
+    pcap->neighbors[pcap->nneighbors++].ip = in.s_addr;
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int sr_pcap_open_port(struct sr_pcap_port *port,
+  const struct sr_io_port *cfg)
+{
+  char out[SR_IO_PATH + 16];
+  size_t n = strlen(cfg->dev);
+
+  strncpy(port->name, cfg->name, sr_IFACE_NAMELEN - 1);
+  if (strcmp(cfg->dev, "-") == 0)
+    snprintf(out, sizeof(out), "%s.out.pcap", cfg->name);
+  else {
+    if (sr_pcap_load(port, cfg->dev) != 0)
+      return -1;
+    if (n > 5 && strcmp(cfg->dev + n - 5, ".pcap") == 0)
+      n -= 5;
+    snprintf(out, sizeof(out), "%.*s.out.pcap", (int)n, cfg->dev);
+  }
+  if ((port->out = sr_dump_open(out, 0, SR_PCAP_FRAME)) == NULL) {
+    free(port->recs);
+    return -1;
+  }
+  return 0;
+}
+
+struct sr_io *sr_pcap_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports, const char *mode,
+  const char *neighbors)
+{
+  struct sr_pcap *pcap = calloc(1, sizeof(struct sr_pcap));
+  unsigned int i;
+
+  if (pcap == NULL)
+    return NULL;
+  if (strcmp(mode, "paced") == 0) {
+    pcap->paced = 1;
+    pcap->io.name = "pcap replay (paced)";
+  } else if (mode[0] == '\0' || strcmp(mode, "fast") == 0) {
+    pcap->io.name = "pcap replay";
+  } else {
+    fprintf(stderr, "pcap: unknown mode %s (fast or paced)\n", mode);
+    free(pcap);
+    return NULL;
+  }
+  pcap->io.send = sr_pcap_send;
+  pcap->io.run = sr_pcap_run;
+  pthread_mutex_init(&(pcap->lock), NULL);
+  if (neighbors[0] && sr_pcap_neighbors(pcap, neighbors) != 0) {
+    free(pcap);
+    return NULL;
+  }
+  for (i = 0; i < nports; i++) {
+    if (sr_pcap_open_port(&(pcap->ports[i]), &(ports[i])) != 0) {
+      while (i-- > 0) {
+        sr_dump_close(pcap->ports[i].out);
+        free(pcap->ports[i].recs);
+      }
+      free(pcap);
+      return NULL;
+    }
+  }
+  pcap->nports = nports;
+  return &(pcap->io);
+}
@@ -156,6 +156,14 @@ struct sr_tcp_hdr{
 };
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
+struct sr_udp_hdr{
+  uint16_t source; /*source port*/
+  uint16_t destination; /*destination port*/
+  uint16_t length; /*header plus data*/
+  uint16_t checksum; /*0 if the sender did not compute one*/
+};
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
 struct sr_tcp_pshdr
   {
     uint32_t  ip_src, ip_dst;
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "sr_if.h"
 #include "sr_rt.h"
@@ -23,6 +24,7 @@
 #include "sr_arpcache.h"
 #include "sr_nat.h"
 #include "sr_utils.h"
+#include "sr_workers.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -46,9 +48,13 @@ void sr_init(struct sr_instance* sr)
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_t thread;
 
-    pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+    /* -- the io_uring and epoll loops run sr_arpcache_tick themselves -- */
+    if (sr->uring == 0 && sr->epoll == 0)
+        pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
     
     /* Add initialization code here! */
+    if (sr_flowcache_init(&(sr->flows)) != 0)
+        fprintf(stderr, "Flow cache disabled: out of memory\n");
 
 } /* -- sr_init -- */
 
@@ -64,7 +70,8 @@ void sr_init(struct sr_instance* sr)
  * Note: Both the packet buffer and the character's memory are handled
  * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
  * packet instead if you intend to keep it around beyond the scope of
- * the method call.
+ * the method call.  The packet may be changed in place, but not once it
+ * has been passed to sr_send_packet(..): it may still be queued there.
  *
  *---------------------------------------------------------------------*/
 
@@ -73,6 +80,10 @@ void sr_handlepacket(struct sr_instance* sr,
         unsigned int len,
         char* interface/* lent */)
 {
+  /* -- with -j a worker thread handles it, see sr_workers.h -- */
+  if (sr->workers && sr_workers_dispatch(sr, packet, len, interface) == 0)
+    return;
+
   printf("Router Accessed\n");
   /* REQUIRES */
   assert(sr);
@@ -83,8 +94,9 @@ void sr_handlepacket(struct sr_instance* sr,
 
   /* Ethernet Protocol */
   if(len>=34){
-    uint8_t* ether_packet = malloc(len+28);
-    memcpy(ether_packet,packet,len);
+    /* handled where it lies: the backends lend a frame that may be changed,
+       and the places that keep a packet (arp queue, held syns) copy it */
+    uint8_t* ether_packet = packet;
 
     uint16_t package_type = ethertype(ether_packet);
     
@@ -103,7 +115,6 @@ void sr_handlepacket(struct sr_instance* sr,
       /* drop package */
        printf("bad protocol! BOO! \n");
     }
-    free(ether_packet);
   }
 }/* end sr_ForwardPacket */
 
@@ -176,8 +187,10 @@ void sr_handleARPpacket(struct sr_instance *sr, uint8_t* packet, unsigned int le
 
     /* handle an arp request.*/
     if (ntohs(arpHeader->ar_op) == arp_op_request) {
-      /* found an ip->mac mapping. send a reply to the requester's MAC addr */
-      if (req_iface){
+      /* found an ip->mac mapping. send a reply to the requester's MAC addr.
+         The NAT's pool addresses are answered for on eth2 (proxy ARP). */
+      if (req_iface || (sr->nat && strcmp(iface->name, "eth2") == 0
+          && sr_nat_pool_has(sr->nat, arpHeader->ar_tip))){
         arpHeader->ar_op = ntohs(arp_op_reply);
         uint32_t temp = arpHeader->ar_sip;
         arpHeader->ar_sip = arpHeader->ar_tip;
@@ -215,13 +228,25 @@ void sr_handleARPpacket(struct sr_instance *sr, uint8_t* packet, unsigned int le
 void sr_sendIP(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_rt *rt, const char *interface) {
   struct sr_if* iface = sr_get_interface(sr, rt->interface);
   
-  pthread_mutex_lock(&(sr->cache.lock));
+  /* no lock for a hit: forwarding threads only read the cache */
   struct sr_arpentry *entry = sr_arpcache_lookup(&sr->cache, (uint32_t)(rt->gw.s_addr));
   sr_ethernet_hdr_t *ethHeader = (sr_ethernet_hdr_t*) packet;
   sr_ip_hdr_t* ipHeader = (sr_ip_hdr_t*) (packet + sizeof(sr_ethernet_hdr_t));
     
+  if (entry == NULL) {
+    /* look again with the lock held: a reply handled in between has
+       already taken the request this packet would wait on */
+    pthread_mutex_lock(&(sr->cache.lock));
+    entry = sr_arpcache_lookup(&sr->cache, (uint32_t)(rt->gw.s_addr));
+    if (entry == NULL) {
+      memcpy(ethHeader->ether_shost, iface->addr, 6);
+      struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), (uint32_t)(rt->gw.s_addr), packet, 
+                                                 len, rt->interface); 
+      handle_arpreq(sr,req);
+    }
+    pthread_mutex_unlock(&(sr->cache.lock));
+  }
   if (entry) {
-    iface = sr_get_interface(sr, rt->interface);
     set_eth_addr(ethHeader, iface->addr, entry->mac);
     ipHeader->ip_ttl = ipHeader->ip_ttl - 1;
     ipHeader->ip_sum = 0;
@@ -229,13 +254,6 @@ void sr_sendIP(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct
     sr_send_packet(sr, packet, len, rt->interface);
     free(entry);
   } 
-  else {
-    memcpy(ethHeader->ether_shost, iface->addr, 6);
-    struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), (uint32_t)(rt->gw.s_addr), packet, 
-                                               len, rt->interface); 
-    handle_arpreq(sr,req);
-    }
-  pthread_mutex_unlock(&(sr->cache.lock));
 }
 
 void sr_sendICMP(struct sr_instance *sr, uint8_t *packet, const char* iface, uint8_t type, uint8_t code) {
@@ -299,6 +317,137 @@ void sr_sendICMP(struct sr_instance *sr, uint8_t *packet, const char* iface, uin
 
     print_hdrs(newPacket, len);
     sr_send_packet(sr, newPacket, len, iface);
+    free(newPacket);
+}
+
+/* NAT header rewrites. The IP checksum, and the transport checksum at each
+   call site, are patched with an RFC 1624 adjustment instead of summing the
+   packet again, so a translation costs the same whatever the payload size. */
+static void nat_set_ip_src(sr_ip_hdr_t *ip_header, uint32_t addr)
+{
+    ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_src, addr);
+    ip_header->ip_src = addr;
+}
+
+static void nat_set_ip_dst(sr_ip_hdr_t *ip_header, uint32_t addr)
+{
+    ip_header->ip_sum = cksum_adjust32(ip_header->ip_sum, ip_header->ip_dst, addr);
+    ip_header->ip_dst = addr;
+}
+
+#ifdef _NAT_CKSUM_VERIFY_
+/* Verification mode: recompute the checksums of a translated packet from
+   scratch and complain if the incremental updates got them wrong. */
+static void nat_verify_cksums(struct sr_instance* sr, uint8_t* packet, unsigned int len)
+{
+    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t));
+    uint16_t incm_cksum = ip_header->ip_sum;
+    ip_header->ip_sum = 0;
+    if (cksum((uint8_t*)ip_header,sizeof(sr_ip_hdr_t)) != incm_cksum)
+      fprintf(stderr,"** NAT: IP checksum mismatch after rewrite\n");
+    ip_header->ip_sum = incm_cksum;
+
+    if (ip_header->ip_p == ip_protocol_tcp) {
+      if (tcp_cksum(sr,packet,len) == 1)
+        fprintf(stderr,"** NAT: TCP checksum mismatch after rewrite\n");
+    }
+    else if (ip_header->ip_p == ip_protocol_udp) {
+      sr_udp_hdr_t *udpHeader = (sr_udp_hdr_t*)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
+      uint16_t udp_length = len-sizeof(sr_ethernet_hdr_t)-sizeof(sr_ip_hdr_t);
+      if (udpHeader->checksum != 0) {
+        uint8_t *total_udp = calloc(1, sizeof(sr_tcp_pshdr_t)+udp_length);
+        sr_tcp_pshdr_t *udp_pshdr = (sr_tcp_pshdr_t *)total_udp;
+        udp_pshdr->ip_src = ip_header->ip_src;
+        udp_pshdr->ip_dst = ip_header->ip_dst;
+        udp_pshdr->ip_p = ip_header->ip_p;
+        udp_pshdr->len = htons(udp_length);
+        memcpy(total_udp+sizeof(sr_tcp_pshdr_t), udpHeader, udp_length);
+        ((sr_udp_hdr_t *)(total_udp+sizeof(sr_tcp_pshdr_t)))->checksum = 0;
+        if (cksum(total_udp, sizeof(sr_tcp_pshdr_t)+udp_length) != udpHeader->checksum)
+          fprintf(stderr,"** NAT: UDP checksum mismatch after rewrite\n");
+        free(total_udp);
+      }
+    }
+    else if (ip_header->ip_p == ip_protocol_icmp) {
+      sr_icmp_hdr_t *icmpHeader = (sr_icmp_hdr_t*)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
+      incm_cksum = icmpHeader->icmp_sum;
+      icmpHeader->icmp_sum = 0;
+      if (cksum((uint8_t*)icmpHeader,len-sizeof(sr_ethernet_hdr_t)-sizeof(sr_ip_hdr_t)) != incm_cksum)
+        fprintf(stderr,"** NAT: ICMP checksum mismatch after rewrite\n");
+      icmpHeader->icmp_sum = incm_cksum;
+    }
+}
+#else
+#define nat_verify_cksums(sr, packet, len) do{}while(0)
+#endif
+
+/* Sends a packet of a flow the flow cache knows, without touching the NAT
+   tables, the routing table or the ARP cache.  Returns -1, leaving the
+   packet alone, if the flow has to take the slow path. */
+static int sr_natFastPath(struct sr_instance* sr, uint8_t* packet,
+        unsigned int len, const struct sr_flow_key *key)
+{
+    sr_ethernet_hdr_t *eth_header = (sr_ethernet_hdr_t *)packet;
+    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t));
+    uint8_t *l4 = packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t);
+    struct sr_flow_entry flow;
+    uint8_t *port, *l4_sum = NULL;
+    uint16_t sum, ttl_old, ttl_new;
+
+    if (sr_flowcache_lookup(sr, key, &flow) != 0)
+      return -1;
+
+    /* tcp and udp ports are at the same offsets; the echo id is where the
+       source port would be */
+    if (key->proto == ip_protocol_icmp) {
+      port = l4 + offsetof(sr_icmp_echo_hdr_t, icmp_id);
+      l4_sum = l4 + offsetof(sr_icmp_echo_hdr_t, icmp_sum);
+    }
+    else {
+      port = l4 + (flow.rewrite_src ? offsetof(sr_udp_hdr_t, source)
+        : offsetof(sr_udp_hdr_t, destination));
+      if (key->proto == ip_protocol_tcp)
+        l4_sum = l4 + offsetof(sr_tcp_hdr_t, checksum);
+      else if (((sr_udp_hdr_t *)l4)->checksum != 0)  /* zero means none */
+        l4_sum = l4 + offsetof(sr_udp_hdr_t, checksum);
+    }
+    if (l4_sum) {
+      memcpy(&sum, l4_sum, sizeof(sum));
+      sum = cksum_apply(sum, flow.l4_delta);
+      memcpy(l4_sum, &sum, sizeof(sum));
+    }
+    memcpy(port, &(flow.port_new), sizeof(flow.port_new));
+
+    if (flow.rewrite_src)
+      ip_header->ip_src = flow.ip_new;
+    else
+      ip_header->ip_dst = flow.ip_new;
+    /* ttl and protocol share a checksum word */
+    ttl_old = htons((uint16_t)((ip_header->ip_ttl << 8) | ip_header->ip_p));
+    ip_header->ip_ttl--;
+    ttl_new = htons((uint16_t)((ip_header->ip_ttl << 8) | ip_header->ip_p));
+    ip_header->ip_sum = cksum_apply(cksum_adjust16(ip_header->ip_sum, ttl_old, ttl_new),
+      flow.ip_delta);
+
+    set_eth_addr(eth_header, flow.out_if->addr, flow.dst_mac);
+    nat_verify_cksums(sr, packet, len);
+    sr_send_packet(sr, packet, len, flow.out_if->name);
+    return 0;
+}
+
+/* Remembers how the packet of flow key was translated, once it has been
+   sent; packet is the translated frame. */
+static void sr_natCacheFlow(struct sr_instance* sr, const struct sr_flow_key *key,
+        uint8_t* packet, sr_nat_mapping_type type, struct sr_nat_mapping *map,
+        bool inbound)
+{
+    struct sr_nat_ref ref;
+    uint32_t ip_remote = inbound ? key->ip_src : key->ip_dst;
+    uint16_t port_remote = inbound ? key->port_src : key->port_dst;
+
+    if (sr_nat_get_ref(sr->nat, type, map->ip_ext, map->aux_ext, ip_remote,
+        port_remote, inbound, &ref) == 0)
+      sr_flowcache_fill(sr, key, packet, &ref);
 }
 
 void sr_natHandle(struct sr_instance* sr, 
@@ -314,17 +463,23 @@ void sr_natHandle(struct sr_instance* sr,
     uint16_t aux_ext;
     sr_icmp_echo_hdr_t *icmpHeader;
     sr_tcp_hdr_t *tcpHeader;
-
-    struct sr_if *ext_if = sr_get_interface(sr,"eth2");
+    sr_udp_hdr_t *udpHeader;
+    struct sr_flow_key key;
+    bool cacheable;
 
     uint16_t incm_cksum = ip_header->ip_sum;
     ip_header->ip_sum = 0;
     uint16_t calc_cksum = cksum((uint8_t*)ip_header,sizeof(sr_ip_hdr_t));
     ip_header->ip_sum = incm_cksum;
     
+    cacheable = sr_flow_key(packet, len, rec_iface, &key) == 0;
+    
     if (calc_cksum != incm_cksum){
       fprintf(stderr,"Bad checksum\n");
     } 
+    else if (cacheable && sr_natFastPath(sr, packet, len, &key) == 0){
+      /* sent */
+    }
     else if (strcmp(rec_iface->name, "eth1") == 0){ /*INTERNAL*/
       sr_nat_mapping_type type;
       rt = (struct sr_rt*)sr_find_routing_entry_int(sr, ip_header->ip_dst);
@@ -338,54 +493,74 @@ void sr_natHandle(struct sr_instance* sr,
         type = nat_mapping_tcp;
         tcpHeader = (sr_tcp_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
         aux_int = ntohs(tcpHeader->source);
-        map = sr_nat_lookup_internal(sr->nat,ip_header->ip_src,aux_int,type);
+        map = sr_nat_lookup_internal(sr->nat,ip_header->ip_src,aux_int,type,ip_header->ip_dst);
         if (map == NULL) {
-          map = sr_nat_insert_mapping(sr->nat,ip_header->ip_src,aux_int,type);
+          map = sr_nat_insert_mapping(sr->nat,ip_header->ip_src,aux_int,type,ip_header->ip_dst);
+          if (map == NULL) {
+            Debug("No NAT mapping available, dropping packet\n");
+            return;
+          }
         }
-        ip_header->ip_src = map->ip_ext;
-        tcpHeader->source= map->aux_ext;
-        tcp_cksum(sr,packet,len);
+        tcpHeader->checksum = cksum_adjust32(tcpHeader->checksum, ip_header->ip_src, map->ip_ext);
+        tcpHeader->checksum = cksum_adjust16(tcpHeader->checksum, tcpHeader->source, htons(map->aux_ext));
+        tcpHeader->source = htons(map->aux_ext);
+        nat_set_ip_src(ip_header, map->ip_ext);
+        nat_verify_cksums(sr, packet, len);
         if (sr_nat_handle_internal_conn(sr->nat,map,packet,len) ==1){
           Debug("Something went wrong, dropping packet\n");
           free(map);
           return;
         }
+        sr_sendIP(sr, packet, len, rt, iface);
+        if (cacheable)
+          sr_natCacheFlow(sr, &key, packet, type, map, false);
       } 
+      else if(ip_header->ip_p==17) { /*UDP*/
+        type = nat_mapping_udp;
+        udpHeader = (sr_udp_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
+        aux_int = ntohs(udpHeader->source);
+        map = sr_nat_lookup_internal(sr->nat,ip_header->ip_src,aux_int,type,ip_header->ip_dst);
+        if (map == NULL) {
+          map = sr_nat_insert_mapping(sr->nat,ip_header->ip_src,aux_int,type,ip_header->ip_dst);
+          if (map == NULL) {
+            Debug("No NAT mapping available, dropping packet\n");
+            return;
+          }
+        }
+        if (udpHeader->checksum != 0) {  /* zero means no checksum */
+          udpHeader->checksum = cksum_adjust32(udpHeader->checksum, ip_header->ip_src, map->ip_ext);
+          udpHeader->checksum = cksum_adjust16(udpHeader->checksum, udpHeader->source, htons(map->aux_ext));
+        }
+        udpHeader->source = htons(map->aux_ext);
+        nat_set_ip_src(ip_header, map->ip_ext);
+        nat_verify_cksums(sr, packet, len);
+        sr_sendIP(sr, packet, len, rt, iface);
+        if (cacheable)
+          sr_natCacheFlow(sr, &key, packet, type, map, false);
+      }
       else if(ip_header->ip_p==1 ) { /*ICMP*/
         icmpHeader = (sr_icmp_echo_hdr_t*)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
-        incm_cksum = icmpHeader->icmp_sum;
-        icmpHeader->icmp_sum = 0;
-        calc_cksum = cksum((uint8_t*)icmpHeader,len-sizeof(sr_ethernet_hdr_t)-sizeof(sr_ip_hdr_t));
-        icmpHeader->icmp_sum = incm_cksum;
-        if (incm_cksum != calc_cksum){
-          fprintf(stderr,"Bad cksum %d != %d\n", incm_cksum, calc_cksum);
-        }
-        else if (icmpHeader->icmp_type == 8 && icmpHeader->icmp_code == 0){
+        if (icmpHeader->icmp_type == 8 && icmpHeader->icmp_code == 0){
           type = nat_mapping_icmp;
           
-          icmpHeader = (sr_icmp_echo_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
           aux_int = ntohs(icmpHeader->icmp_id);
-          map = sr_nat_lookup_internal(sr->nat,ntohl(ip_header->ip_src),aux_int,type);
+          map = sr_nat_lookup_internal(sr->nat,ip_header->ip_src,aux_int,type,ip_header->ip_dst);
           if (map == NULL){
             Debug("No mapping available, making new one\n");
-            map = sr_nat_insert_mapping(sr->nat,ip_header->ip_src,aux_int,type);
+            map = sr_nat_insert_mapping(sr->nat,ip_header->ip_src,aux_int,type,ip_header->ip_dst);
+            if (map == NULL) {
+              Debug("Out of NAT icmp ids, dropping packet\n");
+              return;
+            }
           }
           Debug("Applying map\n");
-          print_addr_ip_int(map->ip_ext);
-          print_addr_ip_int(map->ip_int);
-          ip_header->ip_src = map->ip_ext;
-
-          rt = (struct sr_rt*)sr_find_routing_entry_int(sr, ip_header->ip_dst);
-          if (ip_header->ip_p == ip_protocol_icmp){
-            icmpHeader->icmp_id=htons(map->aux_ext);
-            icmpHeader->icmp_sum=0;
-            icmpHeader->icmp_sum = cksum(icmpHeader,sizeof(sr_icmp_echo_hdr_t));
-          }
-          
-          ip_header->ip_src = ext_if->ip;
-          ip_header->ip_sum = 0;
-          ip_header->ip_sum = cksum((uint8_t*)ip_header,sizeof(sr_ip_hdr_t));
+          icmpHeader->icmp_sum = cksum_adjust16(icmpHeader->icmp_sum, icmpHeader->icmp_id, htons(map->aux_ext));
+          icmpHeader->icmp_id = htons(map->aux_ext);
+          nat_set_ip_src(ip_header, map->ip_ext);
+          nat_verify_cksums(sr, packet, len);
           sr_sendIP(sr, packet, len, rt, iface);
+          if (cacheable)
+            sr_natCacheFlow(sr, &key, packet, type, map, false);
         }
       }
     } 
@@ -397,58 +572,78 @@ void sr_natHandle(struct sr_instance* sr,
       else if(ip_header->ip_p==6) { /* TCP */
         type = nat_mapping_tcp;
         tcpHeader = (sr_tcp_hdr_t *) (packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
-        map = sr_nat_lookup_external(sr->nat,ntohs(tcpHeader->destination),type);
+        map = sr_nat_lookup_external(sr->nat,ip_header->ip_dst,ntohs(tcpHeader->destination),type,ip_header->ip_src);
 
         if (map == NULL) {
-          map = sr_nat_insert_mapping_unsol(sr->nat,ntohs(tcpHeader->destination),type);
-          if (sr_nat_handle_external_conn(sr->nat,map,packet,len) ==1){
-            Debug("Unsolicited syn, don't send\n");
-            return;
+          if (tcpHeader->flags == tcp_flag_syn){
+            Debug("Unsolicited syn, holding it\n");
+            sr_nat_hold_syn(sr->nat,packet,len);
           }
         }
         else {
-          tcpHeader->destination= map->aux_int;
-          tcp_cksum(sr,packet,len);
+          tcpHeader->checksum = cksum_adjust32(tcpHeader->checksum, ip_header->ip_dst, map->ip_int);
+          tcpHeader->checksum = cksum_adjust16(tcpHeader->checksum, tcpHeader->destination, htons(map->aux_int));
+          tcpHeader->destination = htons(map->aux_int);
+          nat_set_ip_dst(ip_header, map->ip_int);
+          nat_verify_cksums(sr, packet, len);
           if (sr_nat_handle_external_conn(sr->nat,map,packet,len) ==1){
             Debug("Unsolicited syn, don't send\n");
-            return;
+          }
+          else if ((rt = sr_find_routing_entry_int(sr, map->ip_int))){
+            sr_sendIP(sr, packet, len, rt, iface);
+            if (cacheable)
+              sr_natCacheFlow(sr, &key, packet, type, map, true);
           }
         }
       } 
+      else if(ip_header->ip_p==17) { /* UDP */
+        type = nat_mapping_udp;
+        udpHeader = (sr_udp_hdr_t *) (packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
+        map = sr_nat_lookup_external(sr->nat,ip_header->ip_dst,ntohs(udpHeader->destination),type,ip_header->ip_src);
+
+        if (map == NULL) {  /* nobody inside asked for this */
+          sr_sendICMP(sr, packet, iface, 3, 3);
+        }
+        else if ((rt = sr_find_routing_entry_int(sr, map->ip_int))){
+          if (udpHeader->checksum != 0) {
+            udpHeader->checksum = cksum_adjust32(udpHeader->checksum, ip_header->ip_dst, map->ip_int);
+            udpHeader->checksum = cksum_adjust16(udpHeader->checksum, udpHeader->destination, htons(map->aux_int));
+          }
+          udpHeader->destination = htons(map->aux_int);
+          nat_set_ip_dst(ip_header, map->ip_int);
+          nat_verify_cksums(sr, packet, len);
+          sr_sendIP(sr, packet, len, rt, iface);
+          if (cacheable)
+            sr_natCacheFlow(sr, &key, packet, type, map, true);
+        }
+      }
       else if(ip_header->ip_p==1 ) { /*ICMP*/
         type = nat_mapping_icmp;
         icmpHeader = (sr_icmp_echo_hdr_t*)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
         aux_ext = ntohs(icmpHeader->icmp_id);
         
-        incm_cksum = icmpHeader->icmp_sum;
-        icmpHeader->icmp_sum = 0;
-        calc_cksum = cksum((uint8_t*)icmpHeader,len-sizeof(sr_ethernet_hdr_t)-sizeof(sr_ip_hdr_t));
-        icmpHeader->icmp_sum = incm_cksum;
-
-        if (incm_cksum != calc_cksum){
-          fprintf(stderr,"Bad cksum %d != %d\n", incm_cksum, calc_cksum);
-        }
-        else if (icmpHeader->icmp_type == 0 && icmpHeader->icmp_code == 0){
-          map = sr_nat_lookup_external(sr->nat, aux_ext, type);
+        if (icmpHeader->icmp_type == 0 && icmpHeader->icmp_code == 0){
+          map = sr_nat_lookup_external(sr->nat, ip_header->ip_dst, aux_ext, type,
+            ip_header->ip_src);
           /* found mapping */
           if (map){
             rt = (struct sr_rt*)sr_find_routing_entry_int(sr, map->ip_int);
-            ip_header->ip_dst=map->ip_int;
-            icmpHeader->icmp_id=ntohs(map->aux_int);
-            icmpHeader->icmp_sum=0;
-            icmpHeader->icmp_sum = cksum(icmpHeader,sizeof(sr_icmp_echo_hdr_t));
 
             /* found route to fwd to */
             if (rt){              
-              ip_header->ip_dst = map->ip_int;
-              ip_header->ip_sum = 0;
-              ip_header->ip_sum = cksum((uint8_t*)ip_header,sizeof(sr_ip_hdr_t));
+              icmpHeader->icmp_sum = cksum_adjust16(icmpHeader->icmp_sum, icmpHeader->icmp_id, htons(map->aux_int));
+              icmpHeader->icmp_id = htons(map->aux_int);
+              nat_set_ip_dst(ip_header, map->ip_int);
+              nat_verify_cksums(sr, packet, len);
               sr_sendIP(sr, packet, len, rt, iface);
+              if (cacheable)
+                sr_natCacheFlow(sr, &key, packet, type, map, true);
             }
           }
         }
       } 
     }
+    free(map);
 }/* end natHandleIPPacket */
 
 int tcp_cksum(struct sr_instance* sr, uint8_t* packet, unsigned int len){
@@ -15,6 +15,7 @@
 
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_flowcache.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -41,9 +42,26 @@ struct sr_rt;
  *
  * -------------------------------------------------------------------------- */
 
+struct sr_txq;
+struct sr_io;
+struct sr_uring;
+struct sr_workers;
+struct sr_epoll;
+
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    uint8_t* rbuf; /* messages read from the server, see sr_vns_comm.c */
+    unsigned int rbuf_start; /* first unparsed byte */
+    unsigned int rbuf_end;   /* end of what was read */
+    struct sr_txq* txq;      /* frames waiting to be written, see sr_vns_comm.c */
+    int vns_batch;           /* the server takes VNS_BATCH (vnscommand.h) */
+    pthread_mutex_t send_lock; /* one writer on sockfd at a time */
+    struct sr_io* io;          /* local packet i/o (sr_io.h), 0 for VNS */
+    struct sr_uring* uring;    /* io_uring loop (sr_uring.h), 0 when off */
+    struct sr_workers* workers; /* forwarding threads (sr_workers.h), 0 when off */
+    struct sr_epoll* epoll;    /* event loop (sr_epoll.h), 0 when off */
+    int stopping;              /* the -a/-e loop is to return to main */
     char user[32]; /* user name */
     char host[32]; /* host name */
     char template[30]; /* template name if any */
@@ -51,7 +69,9 @@ struct sr_instance
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table */
+    unsigned long rt_gen;       /* bumped on every routing table change */
     struct sr_arpcache cache;   /* ARP cache */
+    struct sr_flowcache flows;  /* per flow fast path for NAT'd traffic */
     pthread_attr_t attr;
     FILE* logfile;
 
@@ -66,6 +86,9 @@ int sr_verify_routing_table(struct sr_instance* sr);
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_read_pending(struct sr_instance* );
+int sr_handle_message(struct sr_instance* , uint8_t* , unsigned int , int );
+void sr_log_packet(struct sr_instance* , uint8_t* , int );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance*);
@@ -112,6 +112,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        __atomic_fetch_add(&(sr->rt_gen), 1, __ATOMIC_RELEASE);
 
         return;
     }
@@ -131,6 +132,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    __atomic_fetch_add(&(sr->rt_gen), 1, __ATOMIC_RELEASE);
 
 } /* -- sr_add_entry -- */
 
@@ -0,0 +1,323 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tap.c
+ *
+ * Description:
+ *
+ * TAP backend for local packet i/o (sr_io.h).  The router creates a
+ * multi-queue tap device per interface, so it runs without Mininet, POX or
+ * any other device: move each device into a network namespace (or a
+ * bridge) and give that side its addresses.
+ *
+ * - queues: each device gets "backend tap <n>" queues (default 1), a file
+ *   descriptor each; the kernel spreads the flows it sends over them, and a
+ *   frame forwarded from one leaves on the same queue number.  The receive
+ *   loop reads up to SR_TAP_BATCH frames from every ready queue per pass.
+ * - offloads: every frame is preceded by a virtio_net_hdr (IFF_VNET_HDR),
+ *   and the devices take checksum offload and TSO, so the kernel hands over
+ *   tcp segments of up to 64KB with their checksum left to be filled in.  A
+ *   segment the router forwards as it was received keeps the hints and goes
+ *   out as one frame; the kernel on the far side splits it up and fills in
+ *   the checksums.  A frame that is not a segment has its checksum filled in
+ *   here before it is handled.  With worker threads (sr_workers.h) there is
+ *   no TSO: the kernel splits the segments up before they get here.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+#define SR_TAP_QUEUES 8     /* per device */
+#define SR_TAP_BATCH 64     /* frames read from a queue per pass */
+#define SR_TAP_FRAME (65536 + 64)  /* a tso segment and its ethernet header */
+#define SR_TAP_MTU 1500     /* for segments that lost their hints */
+
+struct sr_tap_port {
+  char name[sr_IFACE_NAMELEN];
+  char dev[IF_NAMESIZE];
+  int fd[SR_TAP_QUEUES];
+  unsigned long tx_dropped;  /* queue full */
+};
+
+struct sr_tap {
+  struct sr_io io;  /* first: passed around as its sr_io */
+  unsigned int nports;
+  unsigned int nqueues;
+  unsigned int offloads;  /* TUNSETOFFLOAD */
+  struct sr_tap_port ports[SR_IO_PORTS];
+  /* receive buffer: the virtio_net_hdr, then the frame */
+  uint8_t buf[sizeof(struct virtio_net_hdr) + SR_TAP_FRAME];
+};
+
+/* the frame being handled by the receive loop, its hints and its queue */
+static __thread uint8_t *sr_tap_rx_frame = NULL;
+static __thread struct virtio_net_hdr sr_tap_rx_hdr;
+static __thread unsigned int sr_tap_rx_queue = 0;
+
+/* Puts the sum of the ip pseudo header in the checksum at
+   vh->csum_start + vh->csum_offset, which is what the kernel expects of a
+   frame whose checksum it is to complete.  The router may have changed the
+   addresses (and adjusted the checksum as if it were complete), so it is
+   made again from the frame as it is now.  Returns -1 if it can't be. */
+static int sr_tap_pseudo(uint8_t *frame, unsigned int len,
+  const struct virtio_net_hdr *vh)
+{
+  sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)frame;
+  sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+  unsigned int hl;
+  sr_tcp_pshdr_t ps;
+  uint16_t sum;
+
+  if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)
+    || eth->ether_type != htons(ethertype_ip))
+    return -1;
+  hl = ip->ip_hl * 4;
+  if (vh->csum_start != sizeof(sr_ethernet_hdr_t) + hl
+    || vh->csum_start + vh->csum_offset + 2u > len
+    || ntohs(ip->ip_len) < hl)
+    return -1;
+
+  memset(&ps, 0, sizeof(ps));
+  ps.ip_src = ip->ip_src;
+  ps.ip_dst = ip->ip_dst;
+  ps.ip_p = ip->ip_p;
+  ps.len = htons(ntohs(ip->ip_len) - hl);
+  sum = ~cksum(&ps, sizeof(ps));
+  memcpy(frame + vh->csum_start + vh->csum_offset, &sum, sizeof(sum));
+  return 0;
+}
+
+/* Hints for a tcp segment longer than an ethernet frame that is sent
+   without its own (it was copied, e.g. while waiting for arp). */
+static int sr_tap_gso(uint8_t *frame, unsigned int len,
+  struct virtio_net_hdr *vh)
+{
+  sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+  sr_tcp_hdr_t *tcp;
+  unsigned int hl, thl;
+
+  if (ip->ip_p != ip_protocol_tcp)
+    return -1;
+  hl = ip->ip_hl * 4;
+  tcp = (sr_tcp_hdr_t *)((uint8_t *)ip + hl);
+  thl = (((uint8_t *)tcp)[12] >> 4) * 4;
+  if (sizeof(sr_ethernet_hdr_t) + hl + thl > len)
+    return -1;
+  vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+  vh->hdr_len = sizeof(sr_ethernet_hdr_t) + hl + thl;
+  vh->gso_size = SR_TAP_MTU - hl - thl;
+  vh->csum_start = sizeof(sr_ethernet_hdr_t) + hl;
+  vh->csum_offset = offsetof(sr_tcp_hdr_t, checksum);
+  return sr_tap_pseudo(frame, len, vh);
+}
+
+static int sr_tap_send(struct sr_io *io, uint8_t *buf, unsigned int len,
+  const char *iface)
+{
+  struct sr_tap *tap = (struct sr_tap *)io;
+  struct sr_tap_port *port = NULL;
+  struct virtio_net_hdr vh;
+  struct iovec iov[2];
+  unsigned int i, q = 0;
+
+  for (i = 0; i < tap->nports; i++) {
+    if (strcmp(tap->ports[i].name, iface) == 0) {
+      port = &(tap->ports[i]);
+      break;
+    }
+  }
+  if (port == NULL || len > SR_TAP_FRAME)
+    return -1;
+
+  memset(&vh, 0, sizeof(vh));
+  if (buf == sr_tap_rx_frame) {
+    /* forwarded as received: same hints, same queue */
+    q = sr_tap_rx_queue % tap->nqueues;
+    if ((sr_tap_rx_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+      && sr_tap_pseudo(buf, len, &sr_tap_rx_hdr) == 0)
+      vh = sr_tap_rx_hdr;
+  }
+  if (vh.gso_type == VIRTIO_NET_HDR_GSO_NONE
+    && len > sizeof(sr_ethernet_hdr_t) + SR_TAP_MTU
+    && sr_tap_gso(buf, len, &vh) != 0)
+    memset(&vh, 0, sizeof(vh));
+
+  iov[0].iov_base = &vh;
+  iov[0].iov_len = sizeof(vh);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = len;
+  if (writev(port->fd[q], iov, 2) < 0) {
+    port->tx_dropped++;
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads and handles up to SR_TAP_BATCH frames from queue q of port.
+   Returns 1 if there may be more. */
+static int sr_tap_rx(struct sr_instance *sr, struct sr_tap *tap,
+  struct sr_tap_port *port, unsigned int q)
+{
+  struct virtio_net_hdr *vh = (struct virtio_net_hdr *)tap->buf;
+  uint8_t *frame = tap->buf + sizeof(struct virtio_net_hdr);
+  unsigned int n, len, at;
+  ssize_t ret;
+  uint16_t sum;
+
+  for (n = 0; n < SR_TAP_BATCH; n++) {
+    if ((ret = read(port->fd[q], tap->buf, sizeof(tap->buf))) < 0)
+      return 0;  /* EAGAIN, or gone */
+    if ((size_t)ret < sizeof(struct virtio_net_hdr) + sizeof(sr_ethernet_hdr_t))
+      continue;
+    len = ret - sizeof(struct virtio_net_hdr);
+
+    /* a single frame is completed here; a segment keeps the hints until
+       it goes out again */
+    if ((vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+      && vh->gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+      at = vh->csum_start + vh->csum_offset;
+      if (vh->csum_start < len && at + 2 <= len) {
+        sum = cksum(frame + vh->csum_start, len - vh->csum_start);
+        memcpy(frame + at, &sum, sizeof(sum));
+      }
+      vh->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+
+    sr_tap_rx_frame = frame;
+    sr_tap_rx_hdr = *vh;
+    sr_tap_rx_queue = q;
+    sr_log_packet(sr, frame, len);
+    sr_handlepacket(sr, frame, len, port->name);
+    sr_tap_rx_frame = NULL;
+  }
+  return 1;
+}
+
+static int sr_tap_run(struct sr_io *io, struct sr_instance *sr)
+{
+  struct sr_tap *tap = (struct sr_tap *)io;
+  struct pollfd fds[SR_IO_PORTS * SR_TAP_QUEUES];
+  unsigned int i, q, nfds = 0;
+  int busy;
+
+  for (i = 0; i < tap->nports; i++) {
+    for (q = 0; q < tap->nqueues; q++) {
+      fds[nfds].fd = tap->ports[i].fd[q];
+      fds[nfds].events = POLLIN;
+      nfds++;
+    }
+  }
+  while (!sr->stopping) {
+    /* a batch per queue and pass, so none starves the others */
+    busy = 0;
+    for (i = 0; i < tap->nports; i++)
+      for (q = 0; q < tap->nqueues; q++)
+        busy |= sr_tap_rx(sr, tap, &(tap->ports[i]), q);
+
+    if (!busy && sr_io_wait(sr, fds, nfds, -1) < 0 && errno != EINTR) {
+      perror("poll(..):sr_tap.c::sr_tap_run");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int sr_tap_open_port(struct sr_tap *tap, struct sr_tap_port *port,
+  const struct sr_io_port *cfg)
+{
+  struct ifreq ifr;
+  int hdr_len = sizeof(struct virtio_net_hdr), sock;
+  unsigned int q;
+
+  strncpy(port->name, cfg->name, sr_IFACE_NAMELEN - 1);
+  strncpy(port->dev, cfg->dev, IF_NAMESIZE - 1);
+  for (q = 0; q < tap->nqueues; q++)
+    port->fd[q] = -1;
+
+  for (q = 0; q < tap->nqueues; q++) {
+    if ((port->fd[q] = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0)
+      goto fail;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, cfg->dev, IF_NAMESIZE - 1);
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+    if (ioctl(port->fd[q], TUNSETIFF, &ifr) != 0
+      || ioctl(port->fd[q], TUNSETVNETHDRSZ, &hdr_len) != 0)
+      goto fail;
+  }
+  /* the kernel may leave checksums and segmentation to us */
+  if (ioctl(port->fd[0], TUNSETOFFLOAD, tap->offloads) != 0)
+    goto fail;
+
+  /* up */
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    goto fail;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, cfg->dev, IF_NAMESIZE - 1);
+  if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0) {
+    close(sock);
+    goto fail;
+  }
+  ifr.ifr_flags |= IFF_UP;
+  if (ioctl(sock, SIOCSIFFLAGS, &ifr) != 0) {
+    close(sock);
+    goto fail;
+  }
+  close(sock);
+  return 0;
+
+fail:
+  fprintf(stderr, "TAP %s: %s\n", cfg->dev, strerror(errno));
+  for (q = 0; q < tap->nqueues; q++)
+    if (port->fd[q] >= 0)
+      close(port->fd[q]);
+  return -1;
+}
+
+struct sr_io *sr_tap_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports, const char *mode)
+{
+  struct sr_tap *tap = calloc(1, sizeof(struct sr_tap));
+  unsigned int i, q;
+
+  if (tap == NULL)
+    return NULL;
+  tap->nqueues = mode[0] ? (unsigned int)atoi(mode) : 1;
+  if (tap->nqueues < 1 || tap->nqueues > SR_TAP_QUEUES) {
+    fprintf(stderr, "TAP: %s queues, 1 to %d\n", mode, SR_TAP_QUEUES);
+    free(tap);
+    return NULL;
+  }
+  /* a segment reaches a worker (-j) as a copy, without its hints */
+  tap->offloads = sr->workers ? TUN_F_CSUM : TUN_F_CSUM | TUN_F_TSO4;
+  tap->io.name = "TAP (multi-queue, virtio-net offloads)";
+  tap->io.send = sr_tap_send;
+  tap->io.run = sr_tap_run;
+  for (i = 0; i < nports; i++) {
+    if (sr_tap_open_port(tap, &(tap->ports[i]), &(ports[i])) != 0) {
+      while (i-- > 0)
+        for (q = 0; q < tap->nqueues; q++)
+          close(tap->ports[i].fd[q]);
+      free(tap);
+      return NULL;
+    }
+  }
+  tap->nports = nports;
+  return &(tap->io);
+}
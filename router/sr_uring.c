@@ -0,0 +1,649 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_uring.c
+ *
+ * Description:
+ *
+ * io_uring execution mode, see sr_uring.h.  The ring is driven through the
+ * raw system calls; nothing but the kernel headers is needed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "sr_dumper.h"
+#include "sr_router.h"
+#include "sr_nat.h"
+#include "sr_uring.h"
+
+#ifndef IORING_TIMEOUT_MULTISHOT
+#define IORING_TIMEOUT_MULTISHOT (1U << 6)  /* Linux 6.4 */
+#endif
+
+#define SR_URING_ENTRIES 256       /* submission queue; 4 times that for completions */
+#define SR_URING_BUFS 64           /* provided receive buffers, a power of two */
+#define SR_URING_BUF_SIZE (16 * 1024)
+#define SR_URING_BGID 1
+#define SR_URING_SEND_FRAMES 128   /* frames per sendmsg */
+#define SR_URING_SEND_ARENA (32 * 1024)
+#define SR_URING_CAP_SIZE (64 * 1024)
+#define SR_URING_MSG_MAX VNS_BATCH_MAX  /* as sr_read_from_server */
+
+/* What a completion is for, in the low bits of its user_data; the rest
+   points at the send or capture buffer. */
+#define SR_URING_RECV 1
+#define SR_URING_SEND 2
+#define SR_URING_WRITE 3
+#define SR_URING_ARP_TICK 4
+#define SR_URING_NAT_TICK 5
+#define SR_URING_TAG 7
+
+/* Frames for one sendmsg, each as its c_packet_header and the frame, which
+   lies in a receive buffer or was copied into the arena. */
+struct sr_uring_send {
+  struct sr_uring_send *next;
+  unsigned int n;
+  unsigned int arena_len;
+  size_t bytes;
+  unsigned int nbufs;
+  uint16_t bufs[SR_URING_SEND_FRAMES];  /* receive buffers it holds */
+  struct msghdr msg;
+  c_packet_header hdrs[SR_URING_SEND_FRAMES];
+  struct iovec iov[2 * SR_URING_SEND_FRAMES];
+  uint8_t arena[SR_URING_SEND_ARENA];
+};
+
+/* Capture records for one write */
+struct sr_uring_cap {
+  struct sr_uring_cap *next;
+  unsigned int len;
+  uint8_t data[SR_URING_CAP_SIZE];
+};
+
+struct sr_uring {
+  int fd;
+  /* submission queue; the kernel only reads it in io_uring_enter(..) */
+  unsigned int *sq_head, *sq_tail, *sq_array;
+  unsigned int sq_mask, sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned int to_submit;
+  /* completion queue */
+  unsigned int *cq_head, *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* provided receive buffers */
+  struct io_uring_buf_ring *br;
+  uint8_t *bufs;
+  uint16_t br_tail;
+  unsigned int refs[SR_URING_BUFS];  /* the parse and the sends holding it */
+  unsigned int held;                 /* out of the ring */
+  int recv_armed;
+
+  /* sends: one chain of linked sendmsgs in flight at a time */
+  struct sr_uring_send *send;              /* being filled */
+  struct sr_uring_send *ready, **ready_tail;  /* waiting for the chain */
+  unsigned int sending;                    /* of the chain, not completed */
+  struct sr_uring_send *free_sends;
+
+  /* capture file, cap_fd -1 when not written here */
+  int cap_fd;
+  off_t cap_off;
+  struct sr_uring_cap *cap;                /* being filled */
+  struct sr_uring_cap *free_caps;
+  unsigned int writing;
+
+  unsigned int tick_flags;
+  struct __kernel_timespec arp_ts, nat_ts;
+};
+
+/* for the capture still in memory at exit(..) */
+static struct sr_uring *sr_uring_exiting = NULL;
+
+static int sr_uring_enter(struct sr_uring *u, unsigned int wait)
+{
+  int ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait,
+    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+  if (ret > 0)
+    u->to_submit -= ret;
+  return ret;
+}
+
+/* The next submission queue entry, cleared; submits what is queued first
+   if the queue is full. */
+static struct io_uring_sqe *sr_uring_sqe(struct sr_uring *u)
+{
+  unsigned int tail = *(u->sq_tail);
+  struct io_uring_sqe *sqe;
+
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries
+    && sr_uring_enter(u, 0) < 0) {
+    perror("io_uring_enter(..):sr_uring.c::sr_uring_sqe");
+    return NULL;
+  }
+  sqe = &(u->sqes[tail & u->sq_mask]);
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+  return sqe;
+}
+
+static void sr_uring_recycle(struct sr_uring *u, unsigned int bid)
+{
+  struct io_uring_buf *buf = &(u->br->bufs[u->br_tail & (SR_URING_BUFS - 1)]);
+
+  buf->addr = (uintptr_t)(u->bufs + bid * SR_URING_BUF_SIZE);
+  buf->len = SR_URING_BUF_SIZE;
+  buf->bid = bid;
+  u->br_tail++;
+  __atomic_store_n(&(u->br->tail), u->br_tail, __ATOMIC_RELEASE);
+  u->held--;
+}
+
+static void sr_uring_unref(struct sr_uring *u, unsigned int bid)
+{
+  if (--u->refs[bid] == 0)
+    sr_uring_recycle(u, bid);
+}
+
+static int sr_uring_arm_recv(struct sr_instance *sr, struct sr_uring *u)
+{
+  struct io_uring_sqe *sqe = sr_uring_sqe(u);
+
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sr->sockfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = SR_URING_BGID;
+  sqe->user_data = SR_URING_RECV;
+  u->recv_armed = 1;
+  return 0;
+}
+
+static int sr_uring_arm_tick(struct sr_uring *u, struct __kernel_timespec *ts,
+  uint64_t tag)
+{
+  struct io_uring_sqe *sqe = sr_uring_sqe(u);
+
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)ts;
+  sqe->len = 1;
+  sqe->timeout_flags = u->tick_flags;
+  sqe->user_data = tag;
+  return 0;
+}
+
+/* Moves the send being filled to those waiting for the chain. */
+static void sr_uring_close_send(struct sr_uring *u)
+{
+  u->send->next = NULL;
+  *(u->ready_tail) = u->send;
+  u->ready_tail = &(u->send->next);
+  u->send = NULL;
+}
+
+int sr_uring_send(struct sr_instance *sr, const c_packet_header *hdr,
+  uint8_t *buf, unsigned int len)
+{
+  struct sr_uring *u = sr->uring;
+  struct sr_uring_send *s = u->send;
+  int inplace = buf >= u->bufs
+    && buf + len <= u->bufs + SR_URING_BUFS * SR_URING_BUF_SIZE;
+
+  if (!inplace && len > SR_URING_SEND_ARENA)
+    return -1;
+  if (s && (s->n == SR_URING_SEND_FRAMES
+      || (!inplace && s->arena_len + len > SR_URING_SEND_ARENA))) {
+    sr_uring_close_send(u);
+    s = NULL;
+  }
+  if (s == NULL) {
+    if ((s = u->free_sends) != NULL)
+      u->free_sends = s->next;
+    else if ((s = malloc(sizeof(struct sr_uring_send))) == NULL)
+      return -1;
+    s->n = s->arena_len = s->nbufs = 0;
+    s->bytes = 0;
+    u->send = s;
+  }
+
+  if (inplace) {
+    /* the receive buffer stays out of the ring until the send completes */
+    unsigned int bid = (buf - u->bufs) / SR_URING_BUF_SIZE;
+    if (s->nbufs == 0 || s->bufs[s->nbufs - 1] != bid) {
+      s->bufs[s->nbufs++] = bid;
+      u->refs[bid]++;
+    }
+  } else {
+    memcpy(s->arena + s->arena_len, buf, len);
+    buf = s->arena + s->arena_len;
+    s->arena_len += len;
+  }
+  s->hdrs[s->n] = *hdr;
+  s->iov[2 * s->n].iov_base = &(s->hdrs[s->n]);
+  s->iov[2 * s->n].iov_len = sizeof(c_packet_header);
+  s->iov[2 * s->n + 1].iov_base = buf;
+  s->iov[2 * s->n + 1].iov_len = len;
+  s->bytes += sizeof(c_packet_header) + len;
+  s->n++;
+  return 0;
+}
+
+/* Submits the waiting sends as one chain of linked sendmsgs, unless a chain
+   is still in flight: a send that is cut short fails the rest of its chain
+   instead of interleaving with them. */
+static int sr_uring_submit_sends(struct sr_instance *sr, struct sr_uring *u)
+{
+  struct sr_uring_send *s;
+  struct io_uring_sqe *sqe;
+  unsigned int room;
+
+  if (u->send && u->send->n)
+    sr_uring_close_send(u);
+  if (u->sending || u->ready == NULL)
+    return 0;
+
+  /* a chain must go in one submission */
+  room = u->sq_entries - (*(u->sq_tail)
+    - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+  if (room < 2 && sr_uring_enter(u, 0) < 0)
+    return -1;
+  room = u->sq_entries - (*(u->sq_tail)
+    - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+
+  while ((s = u->ready) != NULL && room-- > 0) {
+    u->ready = s->next;
+    if ((sqe = sr_uring_sqe(u)) == NULL)
+      return -1;
+    memset(&(s->msg), 0, sizeof(s->msg));
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = 2 * s->n;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sr->sockfd;
+    sqe->addr = (uintptr_t)&(s->msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = (u->ready && room > 0) ? IOSQE_IO_LINK : 0;
+    sqe->user_data = (uintptr_t)s | SR_URING_SEND;
+    u->sending++;
+  }
+  if (u->ready == NULL)
+    u->ready_tail = &(u->ready);
+  return 0;
+}
+
+static int sr_uring_write_cap(struct sr_uring *u)
+{
+  struct sr_uring_cap *cap = u->cap;
+  struct io_uring_sqe *sqe = sr_uring_sqe(u);
+
+  u->cap = NULL;
+  if (sqe == NULL) {
+    free(cap);
+    return -1;
+  }
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = u->cap_fd;
+  sqe->addr = (uintptr_t)cap->data;
+  sqe->len = cap->len;
+  sqe->off = u->cap_off;
+  sqe->user_data = (uintptr_t)cap | SR_URING_WRITE;
+  u->cap_off += cap->len;
+  u->writing++;
+  return 0;
+}
+
+int sr_uring_log(struct sr_instance *sr, const struct pcap_pkthdr *h,
+  const uint8_t *buf)
+{
+  struct sr_uring *u = sr->uring;
+
+  if (u->cap_fd < 0)
+    return -1;
+  if (u->cap && u->cap->len + sizeof(struct pcap_sf_pkthdr) + h->caplen
+    > SR_URING_CAP_SIZE && sr_uring_write_cap(u) != 0)
+    return -1;
+  if (u->cap == NULL) {
+    if ((u->cap = u->free_caps) != NULL)
+      u->free_caps = u->cap->next;
+    else if ((u->cap = malloc(sizeof(struct sr_uring_cap))) == NULL)
+      return -1;
+    u->cap->len = 0;
+  }
+  u->cap->len += sr_dump_rec(u->cap->data + u->cap->len, h, buf);
+  return 0;
+}
+
+/* Hands the complete messages at the start of data to sr_handle_message
+   and sets *used to the bytes they took.  Returns as sr_handle_message. */
+static int sr_uring_messages(struct sr_instance *sr, uint8_t *data,
+  unsigned int n, unsigned int *used)
+{
+  uint32_t len;
+  int ret;
+
+  *used = 0;
+  while (n - *used >= 4) {
+    memcpy(&len, data + *used, 4);
+    len = ntohl(len);
+    if (len > SR_URING_MSG_MAX || len < 8) {
+      fprintf(stderr, "Error: command length to large %u\n", len);
+      return -1;
+    }
+    if (n - *used < len)
+      break;
+    ret = sr_handle_message(sr, data + *used, len, 0);
+    *used += len;
+    if (ret != 1)
+      return ret;
+  }
+  return 1;
+}
+
+/* Handles n bytes of the stream, received into a buffer. */
+static int sr_uring_input(struct sr_instance *sr, uint8_t *data,
+  unsigned int n)
+{
+  unsigned int have, need, take, used;
+  uint32_t len;
+  int ret;
+
+  /* a message begun in an earlier buffer is put together in sr->rbuf */
+  while (sr->rbuf_end > 0 && n > 0) {
+    have = sr->rbuf_end;
+    need = 4;
+    if (have >= 4) {
+      memcpy(&len, sr->rbuf, 4);
+      need = ntohl(len);
+      if (need > SR_URING_MSG_MAX || need < 8) {
+        fprintf(stderr, "Error: command length to large %u\n", need);
+        return -1;
+      }
+    }
+    take = need - have < n ? need - have : n;
+    memcpy(sr->rbuf + have, data, take);
+    sr->rbuf_end += take;
+    data += take;
+    n -= take;
+    if (need >= 8 && sr->rbuf_end == need) {
+      /* frames in sr->rbuf are copied when sent, so it can be reused */
+      sr->rbuf_end = 0;
+      if ((ret = sr_handle_message(sr, sr->rbuf, need, 0)) != 1)
+        return ret;
+    }
+  }
+  if (n == 0)
+    return 1;
+
+  if ((ret = sr_uring_messages(sr, data, n, &used)) != 1)
+    return ret;
+  memcpy(sr->rbuf, data + used, n - used);
+  sr->rbuf_end = n - used;
+  return 1;
+}
+
+/* Acts on one completion; returns 1 to carry on, else as sr_uring_run. */
+static int sr_uring_complete(struct sr_instance *sr, struct sr_uring *u,
+  const struct io_uring_cqe *cqe)
+{
+  void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)SR_URING_TAG);
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  struct sr_uring_send *s;
+  struct sr_uring_cap *cap;
+  unsigned int bid, i;
+  int ret = 1;
+
+  switch (cqe->user_data & SR_URING_TAG) {
+  case SR_URING_RECV:
+    if (!more)
+      u->recv_armed = 0;
+    if (cqe->res == -ENOBUFS)
+      break;  /* armed again once a buffer is back */
+    if (cqe->res == 0) {
+      fprintf(stderr, "Error: server closed the connection\n");
+      return -1;
+    }
+    if (cqe->res < 0) {
+      fprintf(stderr, "recv(..):sr_uring.c::sr_uring_run: %s\n",
+        strerror(-cqe->res));
+      return -1;
+    }
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    u->held++;
+    u->refs[bid] = 1;
+    ret = sr_uring_input(sr, u->bufs + bid * SR_URING_BUF_SIZE, cqe->res);
+    sr_uring_unref(u, bid);
+    break;
+
+  case SR_URING_SEND:
+    s = ptr;
+    u->sending--;
+    if (cqe->res < 0 || (size_t)cqe->res != s->bytes) {
+      fprintf(stderr, "Error writing packet: %s\n",
+        cqe->res < 0 ? strerror(-cqe->res) : "short write");
+      ret = -1;
+    }
+    for (i = 0; i < s->nbufs; i++)
+      sr_uring_unref(u, s->bufs[i]);
+    s->next = u->free_sends;
+    u->free_sends = s;
+    break;
+
+  case SR_URING_WRITE:
+    cap = ptr;
+    u->writing--;
+    if (cqe->res < 0 || (unsigned int)cqe->res != cap->len)
+      fprintf(stderr, "Error writing capture: %s\n",
+        cqe->res < 0 ? strerror(-cqe->res) : "short write");
+    cap->next = u->free_caps;
+    u->free_caps = cap;
+    break;
+
+  case SR_URING_ARP_TICK:
+  case SR_URING_NAT_TICK:
+    if (cqe->res == -EINVAL && u->tick_flags) {
+      /* no multishot timeouts before Linux 6.4: arm each one again */
+      u->tick_flags = 0;
+      more = 0;
+    } else if ((cqe->user_data & SR_URING_TAG) == SR_URING_ARP_TICK) {
+      sr_arpcache_tick(sr);
+    } else if (sr_nat_tick(sr->nat)) {
+      sr->stopping = 1;
+    }
+    if (!more && sr_uring_arm_tick(u, (cqe->user_data & SR_URING_TAG)
+        == SR_URING_ARP_TICK ? &(u->arp_ts) : &(u->nat_ts),
+        cqe->user_data) != 0)
+      ret = -1;
+    break;
+  }
+  return ret;
+}
+
+/* Submits what the last completions queued. */
+static int sr_uring_flush(struct sr_instance *sr, struct sr_uring *u)
+{
+  if (sr_uring_submit_sends(sr, u) != 0)
+    return -1;
+  if (u->cap && u->cap->len && sr_uring_write_cap(u) != 0)
+    return -1;
+  if (!u->recv_armed && u->held < SR_URING_BUFS
+    && sr_uring_arm_recv(sr, u) != 0)
+    return -1;
+  return 0;
+}
+
+/* Writes out the capture on exit(..), e.g. once a stop returned to main. */
+static void sr_uring_atexit(void)
+{
+  struct sr_uring *u = sr_uring_exiting;
+  unsigned int head;
+
+  if (u->cap && u->cap->len
+    && pwrite(u->cap_fd, u->cap->data, u->cap->len, u->cap_off) < 0)
+    perror("pwrite(..):sr_uring.c::sr_uring_atexit");
+  sr_uring_enter(u, 0);
+  while (u->writing) {
+    if (sr_uring_enter(u, 1) < 0 && errno != EINTR)
+      return;
+    head = *(u->cq_head);
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+      if ((u->cqes[head & u->cq_mask].user_data & SR_URING_TAG)
+        == SR_URING_WRITE)
+        u->writing--;
+      head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+int sr_uring_run(struct sr_instance *sr)
+{
+  struct sr_uring *u = sr->uring;
+  unsigned int head, used;
+  int ret;
+
+  /* messages that came in with the last ones of the handshake */
+  if (sr->rbuf == 0 && (sr->rbuf = malloc(SR_URING_MSG_MAX)) == 0)
+    return -1;
+  ret = sr_uring_messages(sr, sr->rbuf + sr->rbuf_start,
+    sr->rbuf_end - sr->rbuf_start, &used);
+  if (ret != 1)
+    return ret;
+  memmove(sr->rbuf, sr->rbuf + sr->rbuf_start + used,
+    sr->rbuf_end - sr->rbuf_start - used);
+  sr->rbuf_end -= sr->rbuf_start + used;
+  sr->rbuf_start = 0;
+
+  if (sr_uring_arm_tick(u, &(u->arp_ts), SR_URING_ARP_TICK) != 0
+    || (sr->nat && sr_uring_arm_tick(u, &(u->nat_ts), SR_URING_NAT_TICK) != 0))
+    return -1;
+
+  while (!sr->stopping) {
+    if (sr_uring_flush(sr, u) != 0)
+      return -1;
+    if (sr_uring_enter(u, 1) < 0 && errno != EINTR) {
+      perror("io_uring_enter(..):sr_uring.c::sr_uring_run");
+      return -1;
+    }
+    head = *(u->cq_head);
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+      /* released first: handling it may exit(..) */
+      __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+      if ((ret = sr_uring_complete(sr, u, &cqe)) != 1)
+        return ret;
+    }
+  }
+  return 0;
+}
+
+int sr_uring_open(struct sr_instance *sr)
+{
+  struct sr_uring *u = calloc(1, sizeof(struct sr_uring));
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t sq_len, cq_len;
+  uint8_t *sq, *cq;
+  unsigned int i;
+
+  if (u == NULL)
+    return -1;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+    | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = 4 * SR_URING_ENTRIES;
+  u->fd = syscall(__NR_io_uring_setup, SR_URING_ENTRIES, &p);
+  if (u->fd < 0 && errno == EINVAL) {
+    /* before Linux 6.1: completions are posted as they happen */
+    p.flags = IORING_SETUP_CQSIZE;
+    u->fd = syscall(__NR_io_uring_setup, SR_URING_ENTRIES, &p);
+  }
+  if (u->fd < 0) {
+    perror("io_uring_setup(..):sr_uring.c::sr_uring_open");
+    free(u);
+    return -1;
+  }
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    u->fd, IORING_OFF_SQ_RING);
+  cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq : mmap(NULL, cq_len,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+    IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  u->bufs = mmap(NULL, SR_URING_BUFS * SR_URING_BUF_SIZE,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u->br = mmap(NULL, SR_URING_BUFS * sizeof(struct io_uring_buf),
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED
+    || u->bufs == MAP_FAILED || u->br == MAP_FAILED) {
+    perror("mmap(..):sr_uring.c::sr_uring_open");
+    goto fail;
+  }
+  u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  u->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)u->br;
+  reg.ring_entries = SR_URING_BUFS;
+  reg.bgid = SR_URING_BGID;
+  if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg,
+      1) != 0) {
+    perror("io_uring_register(..):sr_uring.c::sr_uring_open");
+    goto fail;
+  }
+  u->held = SR_URING_BUFS;
+  for (i = 0; i < SR_URING_BUFS; i++)
+    sr_uring_recycle(u, i);
+
+  u->ready_tail = &(u->ready);
+  u->tick_flags = IORING_TIMEOUT_MULTISHOT;
+  u->arp_ts.tv_sec = 1;
+  u->nat_ts.tv_nsec = SR_NAT_TICK_USEC * 1000L;
+
+  /* the capture goes through the ring if the file has offsets */
+  u->cap_fd = -1;
+  if (sr->logfile) {
+    fflush(sr->logfile);
+    if ((u->cap_off = lseek(fileno(sr->logfile), 0, SEEK_CUR)) >= 0) {
+      u->cap_fd = fileno(sr->logfile);
+      sr_uring_exiting = u;
+      atexit(sr_uring_atexit);
+    }
+  }
+
+  sr->uring = u;
+  return 0;
+
+fail:
+  close(u->fd);
+  free(u);
+  return -1;
+}
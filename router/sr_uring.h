@@ -0,0 +1,54 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_uring.h
+ *
+ * Description:
+ *
+ * io_uring execution mode (-a): one thread drives the VNS connection, the
+ * packet capture and the timers through a single io_uring, in place of the
+ * blocking read loop and the ARP and NAT timeout threads.
+ *
+ * - receive: one multishot recv fills buffers from a provided buffer ring;
+ *   messages are parsed where they lie, only one that spans two buffers is
+ *   put together in sr->rbuf.
+ * - send: frames sent while the completions of a wait are handled are
+ *   batched into sendmsgs, linked so the stream stays in order, and
+ *   submitted with the next wait.  A forwarded frame is sent from its receive
+ *   buffer, which goes back to the ring once the send completes.
+ * - capture (-l): records are collected and written at explicit offsets
+ *   with async writes.
+ * - timers: timeouts run sr_arpcache_tick every second and sr_nat_tick every
+ *   SR_NAT_TICK_USEC.
+ *
+ * A burst of packets costs one io_uring_enter(..).  Everything that sends
+ * must run on the loop's thread.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_URING_H
+#define SR_URING_H
+
+#include <inttypes.h>
+#include "vnscommand.h"
+
+struct sr_instance;
+struct pcap_pkthdr;
+
+/* Sets up the ring for the connected sr as sr->uring; before sr_init and
+   sr_nat_init, which then start no timeout threads.  Returns 0 on success. */
+int sr_uring_open(struct sr_instance *sr);
+
+/* Runs the loop in place of sr_read_from_server.  Returns 0 when the server
+   closed the session or a tick saw SIGTERM/SIGINT (sr->stopping), -1 on
+   error. */
+int sr_uring_run(struct sr_instance *sr);
+
+/* Queues a frame behind its header (for sr_send_packet). */
+int sr_uring_send(struct sr_instance *sr, const c_packet_header *hdr,
+  uint8_t *buf, unsigned int len);
+
+/* Queues a capture record (for sr_log_packet); -1 if it has to be written
+   the usual way, e.g. to a pipe. */
+int sr_uring_log(struct sr_instance *sr, const struct pcap_pkthdr *h,
+  const uint8_t *buf);
+
+#endif
@@ -19,6 +19,49 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* HC' = ~(~HC + ~m + m'), RFC 1624 eqn. 3. One's complement addition is
+   byte order independent, so the words are used as they sit in the packet. */
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t acc = (uint16_t)~sum;
+  acc += (uint16_t)~old;
+  acc += new;
+  acc = (acc & 0xffff) + (acc >> 16);
+  acc = (acc & 0xffff) + (acc >> 16);
+  acc = (uint16_t)~acc;
+  return acc ? acc : 0xffff;  /* same convention as cksum() */
+}
+
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_adjust16(sum, (uint16_t)(old >> 16), (uint16_t)(new >> 16));
+  return cksum_adjust16(sum, (uint16_t)(old & 0xffff), (uint16_t)(new & 0xffff));
+}
+
+static uint16_t cksum_fold(uint32_t acc) {
+  acc = (acc & 0xffff) + (acc >> 16);
+  return (acc & 0xffff) + (acc >> 16);
+}
+
+/* The ~m + m' term of eqn. 3 on its own, so that the same rewrite can be
+   applied to many packets: cksum_apply(sum, cksum_delta16(old, new)) ==
+   cksum_adjust16(sum, old, new). */
+uint16_t cksum_delta16(uint16_t old, uint16_t new) {
+  return cksum_fold((uint32_t)(uint16_t)~old + new);
+}
+
+uint16_t cksum_delta32(uint32_t old, uint32_t new) {
+  return cksum_delta_add(cksum_delta16((uint16_t)(old >> 16), (uint16_t)(new >> 16)),
+    cksum_delta16((uint16_t)(old & 0xffff), (uint16_t)(new & 0xffff)));
+}
+
+uint16_t cksum_delta_add(uint16_t a, uint16_t b) {
+  return cksum_fold((uint32_t)a + b);
+}
+
+uint16_t cksum_apply(uint16_t sum, uint16_t delta) {
+  uint16_t acc = ~cksum_fold((uint32_t)(uint16_t)~sum + delta);
+  return acc ? acc : 0xffff;
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
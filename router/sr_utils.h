@@ -30,6 +30,18 @@
 
 uint16_t cksum(const void *_data, int len);
 
+/* RFC 1624 incremental update of checksum `sum` for a 16/32 bit field that
+   changes from old to new. All values are in network byte order. */
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old, uint16_t new);
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new);
+
+/* The same update split in two: the delta of a rewrite, which can be
+   summed over several fields and kept, and its application to a checksum. */
+uint16_t cksum_delta16(uint16_t old, uint16_t new);
+uint16_t cksum_delta32(uint32_t old, uint32_t new);
+uint16_t cksum_delta_add(uint16_t a, uint16_t b);
+uint16_t cksum_apply(uint16_t sum, uint16_t delta);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
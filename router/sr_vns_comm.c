@@ -35,17 +35,55 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
 #include "sr_nat.h"
+#include "sr_io.h"
+#include "sr_uring.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
-static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+/* receive buffer; holds several messages of at most VNS_BATCH_MAX bytes */
+#define SR_RBUF_SIZE (64 * 1024)
+
+/* Frames sent while the reader works through the messages of one recv(..)
+   are queued and written together with one writev(..): before the next
+   recv(..), when the queue is full, or once the oldest has waited
+   SR_TXQ_MAX_USEC.  Frames that sit in the receive buffer (forwarded in
+   place) are written from there; others are copied into the arena, since
+   their owners free them on return.  When the server takes VNS_BATCH the
+   frames go out as batches of up to VNS_BATCH_MAX bytes. */
+#define SR_TXQ_FRAMES 256          /* up to three iovecs each, within IOV_MAX */
+#define SR_TXQ_ARENA (64 * 1024)
+#define SR_TXQ_MAX_USEC 1000
+
+struct sr_txq
+{
+    unsigned int n;          /* frames queued */
+    unsigned int niov;       /* iovecs in use */
+    unsigned int nbatches;   /* batch headers in use */
+    c_batch* batch;          /* the one frames join, 0 for none */
+    unsigned int arena_len;  /* bytes of the arena in use */
+    struct timespec first;   /* when the oldest was queued */
+    c_packet_header hdrs[SR_TXQ_FRAMES];
+    c_batch batches[SR_TXQ_FRAMES];
+    struct iovec iov[3 * SR_TXQ_FRAMES];
+    uint8_t arena[SR_TXQ_ARENA];
+};
+
+/* set while the reading thread hands a packet to the router */
+static __thread int sr_tx_batching = 0;
+
+static int sr_txq_flush(struct sr_instance* sr);
+static int sr_handle_batch(struct sr_instance* sr, uint8_t* buf,
+                           unsigned int len);
+
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
@@ -143,6 +181,8 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         command.mLen   = htonl(sizeof(c_open));
         command.mType  = htonl(VNSOPEN);
         command.topoID = htons(sr->topo_id);
+        /* -- old servers do not look at the flags -- */
+        command.mFlags = htons(VNSOPEN_BATCH);
         strncpy( command.mVirtualHostID, sr->host,  IDSIZE);
         strncpy( command.mUID, sr->user, IDSIZE);
 
@@ -334,84 +374,120 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
     return sr_read_from_server_expect(sr, 0);
 }
 
-int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
-{
-    int command, len;
-    unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
-
-    /* REQUIRES */
-    assert(sr);
-
-    /*---------------------------------------------------------------------------
-      Read a command from the server
-      -------------------------------------------------------------------------*/
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_pending(..)
+ * Scope: Global
+ *
+ * For an event loop (sr_epoll.c): tells whether sr_read_from_server(..)
+ * can go on without waiting for the socket.
+ *
+ * RETURN VALUES:
+ *
+ *  1 if the receive buffer holds another whole message
+ *  0 if not, once the transmit queue is written out
+ *  -1 on error
+ *
+ *---------------------------------------------------------------------------*/
 
-    bytes_read = 0;
+int sr_read_pending(struct sr_instance* sr /* borrowed */)
+{
+    uint32_t len;
 
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
+    if (sr->rbuf_end - sr->rbuf_start >= 4)
     {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
-
+        memcpy(&len, sr->rbuf + sr->rbuf_start, 4);
+        if (sr->rbuf_end - sr->rbuf_start >= ntohl(len))
+        { return 1; }
     }
+    return sr_txq_flush(sr) == 0 ? 0 : -1;
+} /* -- sr_read_pending -- */
 
-    len = ntohl(len);
+/*-----------------------------------------------------------------------------
+ * Method: sr_fill_rbuf(..)
+ * Scope: local
+ *
+ * Makes sure the receive buffer holds at least need unparsed bytes,
+ * reading whatever the socket has on each recv(..).  A partial message is
+ * moved to the front when it would not fit behind what was parsed.  The
+ * transmit queue is flushed first.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success, -1 on error or when the server closed the connection
+ *
+ *---------------------------------------------------------------------------*/
 
-    if ( len > 10000 || len < 0 )
-    {
-        fprintf(stderr,"Error: command length to large %d\n",len);
-        close(sr->sockfd);
-        return -1;
-    }
+static int sr_fill_rbuf(struct sr_instance* sr /* borrowed */, unsigned int need)
+{
+    int ret;
 
-    if((buf = malloc(len)) == 0)
+    if (sr->rbuf == 0 && (sr->rbuf = malloc(SR_RBUF_SIZE)) == 0)
     {
         fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
         return -1;
     }
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
+    while (sr->rbuf_end - sr->rbuf_start < need)
+    {
+        /* -- queued frames may point into the buffer -- */
+        if (sr_txq_flush(sr) != 0)
+        { return -1; }
 
-    bytes_read = 0;
+        if (sr->rbuf_start == sr->rbuf_end)
+        { sr->rbuf_start = sr->rbuf_end = 0; }
+        else if (sr->rbuf_start + need > SR_RBUF_SIZE)
+        {
+            memmove(sr->rbuf, sr->rbuf + sr->rbuf_start,
+                    sr->rbuf_end - sr->rbuf_start);
+            sr->rbuf_end -= sr->rbuf_start;
+            sr->rbuf_start = 0;
+        }
 
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
-    {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
-            }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
+        /* -- just in case SIGALRM breaks recv -- */
+        if ((ret = recv(sr->sockfd, sr->rbuf + sr->rbuf_end,
+                        SR_RBUF_SIZE - sr->rbuf_end, 0)) == -1)
+        {
+            if ( errno == EINTR )
+            { continue; }
+
+            perror("recv(..):sr_client.c::sr_read_from_server");
+            return -1;
+        }
+        if (ret == 0)
+        {
+            fprintf(stderr,"Error: server closed the connection\n");
+            return -1;
+        }
+        sr->rbuf_end += ret;
     }
+    return 0;
+} /* -- sr_fill_rbuf -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_message(..)
+ * Scope: global
+ *
+ * Acts on one message from the server, len bytes at buf, which may be
+ * changed in place.  Called by sr_read_from_server_expect(..) and by the
+ * io_uring loop (sr_uring.c).
+ *
+ * RETURN VALUES:
+ *
+ *  1 to carry on, 0 when the server closed the session, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_handle_message(struct sr_instance* sr /* borrowed */, uint8_t* buf,
+                      unsigned int len, int expected_cmd)
+{
+    int command;
+    c_packet_ethernet_header* sr_pkt = 0;
+    int ret;
 
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
-    command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
+    command = ntohl(((c_base *)buf)->mType);
+    ((c_base *)buf)->mType = command;
 
     /* make sure the command is what we expected if we were expecting something */
     if(expected_cmd && command!=expected_cmd) {
@@ -442,12 +518,22 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                     ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
 
             /* -- pass to router, student's code should take over here -- */
+            sr_tx_batching = 1;
             sr_handlepacket(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
                     (char*)(buf + sizeof(c_base)));
+            sr_tx_batching = 0;
+
+            break;
 
+            /* -------------        VNS_BATCH     -------------------- */
+
+        case VNS_BATCH:
+            /* -- the first one answers our VNSOPEN_BATCH -- */
+            sr->vns_batch = 1;
+            ret = sr_handle_batch(sr, buf, len);
             break;
 
             /* -------------        VNSCLOSE      -------------------- */
@@ -457,8 +543,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
 
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -504,8 +588,104 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
+    return ret;
+} /* -- sr_handle_message -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_batch(..)
+ * Scope: Local
+ *
+ * Hands the VNSPACKET messages of a batch, len bytes at buf, to
+ * sr_handle_message(..) one after the other, where they lie.
+ *
+ * RETURN VALUES:
+ *
+ *  as sr_handle_message(..)
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_handle_batch(struct sr_instance* sr, uint8_t* buf,
+                           unsigned int len)
+{
+    unsigned int off;
+    uint32_t part_len, part_type;
+    int ret;
+
+    for (off = sizeof(c_batch); off < len; off += part_len)
+    {
+        if (len - off < sizeof(c_packet_ethernet_header))
+        { part_len = 0; }
+        else
+        {
+            memcpy(&part_len, buf + off, 4);
+            memcpy(&part_type, buf + off + 4, 4);
+            part_len = ntohl(part_len);
+        }
+        if (part_len < sizeof(c_packet_ethernet_header) ||
+            part_len > len - off || ntohl(part_type) != VNSPACKET)
+        {
+            fprintf(stderr,"Error: malformed batch from the server\n");
+            return -1;
+        }
+
+        if ((ret = sr_handle_message(sr, buf + off, part_len, 0)) != 1)
+        { return ret; }
+    }
+    return 1;
+} /* -- sr_handle_batch -- */
+
+int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
+{
+    int len;
+    unsigned char *buf = 0;
+    int ret = 0;
+
+    /* REQUIRES */
+    assert(sr);
+
+    /*---------------------------------------------------------------------------
+      Read a command from the server.  Messages are parsed in place from the
+      receive buffer; a recv(..) is only made once it holds no complete one.
+      -------------------------------------------------------------------------*/
+
+    /* the size of the incoming packet */
+    if (sr_fill_rbuf(sr, 4) != 0)
+    { return -1; }
+    memcpy(&len, sr->rbuf + sr->rbuf_start, 4);
+    len = ntohl(len);
+
+    if ( len > VNS_BATCH_MAX || len < 8 )
+    {
+        fprintf(stderr,"Error: command length to large %d\n",len);
+        close(sr->sockfd);
+        return -1;
+    }
+
+    /* the rest of the command */
+    if (sr_fill_rbuf(sr, len) != 0)
+    {
+        fprintf(stderr,"Error: failed reading command body\n");
+        close(sr->sockfd);
+        return -1;
+    }
+    buf = sr->rbuf + sr->rbuf_start;
+    sr->rbuf_start += len;
+
+    ret = sr_handle_message(sr, buf, len, expected_cmd);
+    if (ret == 0)
+    { return 0; }
+
+    /* -- bound how long a busy input stream can hold frames back -- */
+    if (sr->txq && sr->txq->n)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - sr->txq->first.tv_sec) * 1000000L +
+            (now.tv_nsec - sr->txq->first.tv_nsec) / 1000 >= SR_TXQ_MAX_USEC
+            && sr_txq_flush(sr) != 0)
+        { ret = -1; }
+    }
+
     return ret;
 }/* -- sr_read_from_server -- */
 
@@ -553,6 +733,128 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 
 } /* -- sr_ether_addrs_match_interface -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_writev_all(..)
+ * Scope: Local
+ *
+ * writev(..) under the send lock, carrying on after partial writes and
+ * signals.  Returns 0 once everything is written, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_writev_all(struct sr_instance* sr, struct iovec* iov, int cnt)
+{
+    ssize_t ret;
+    int err = 0;
+
+    pthread_mutex_lock(&(sr->send_lock));
+    while (cnt > 0)
+    {
+        if ((ret = writev(sr->sockfd, iov, cnt)) == -1)
+        {
+            if ( errno == EINTR )
+            { continue; }
+            err = -1;
+            break;
+        }
+        while (cnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    pthread_mutex_unlock(&(sr->send_lock));
+    return err;
+} /* -- sr_writev_all -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_txq_flush(..)
+ * Scope: Local
+ *
+ * Writes out the queued frames with one writev(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_txq_flush(struct sr_instance* sr)
+{
+    struct sr_txq* txq = sr->txq;
+    int ret;
+
+    if (txq == 0 || txq->n == 0)
+    { return 0; }
+
+    ret = sr_writev_all(sr, txq->iov, txq->niov);
+    txq->n = txq->niov = txq->nbatches = 0;
+    txq->batch = 0;
+    txq->arena_len = 0;
+    if (ret != 0)
+    { fprintf(stderr, "Error writing packet\n"); }
+    return ret;
+} /* -- sr_txq_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_txq_add(..)
+ * Scope: Local
+ *
+ * Queues a frame behind its header, flushing first if it does not fit.
+ * With VNS_BATCH the frame joins the open batch, or starts a new one.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_txq_add(struct sr_instance* sr, c_packet_header* hdr,
+                      uint8_t* buf, unsigned int len)
+{
+    struct sr_txq* txq = sr->txq;
+    int inplace = buf >= sr->rbuf && buf < sr->rbuf + SR_RBUF_SIZE;
+
+    if (txq->n == SR_TXQ_FRAMES ||
+        (!inplace && txq->arena_len + len > SR_TXQ_ARENA))
+    {
+        if (sr_txq_flush(sr) != 0)
+        { return -1; }
+    }
+    if (!inplace)
+    {
+        memcpy(txq->arena + txq->arena_len, buf, len);
+        buf = txq->arena + txq->arena_len;
+        txq->arena_len += len;
+    }
+    if (txq->n == 0)
+    { clock_gettime(CLOCK_MONOTONIC, &(txq->first)); }
+
+    /* -- a frame too long for any batch goes on its own, and ends the
+       open one so the order stays -- */
+    if (!sr->vns_batch || sizeof(c_batch) + ntohl(hdr->mLen) > VNS_BATCH_MAX)
+    { txq->batch = 0; }
+    else
+    {
+        if (txq->batch == 0 ||
+            ntohl(txq->batch->mLen) + ntohl(hdr->mLen) > VNS_BATCH_MAX)
+        {
+            txq->batch = &(txq->batches[txq->nbatches++]);
+            txq->batch->mLen = htonl(sizeof(c_batch));
+            txq->batch->mType = htonl(VNS_BATCH);
+            txq->iov[txq->niov].iov_base = txq->batch;
+            txq->iov[txq->niov++].iov_len = sizeof(c_batch);
+        }
+        txq->batch->mLen = htonl(ntohl(txq->batch->mLen) + ntohl(hdr->mLen));
+    }
+
+    txq->hdrs[txq->n] = *hdr;
+    txq->iov[txq->niov].iov_base = &(txq->hdrs[txq->n]);
+    txq->iov[txq->niov++].iov_len = sizeof(c_packet_header);
+    txq->iov[txq->niov].iov_base = buf;
+    txq->iov[txq->niov++].iov_len = len;
+    txq->n++;
+    return 0;
+} /* -- sr_txq_add -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_send_packet(..)
  * Scope: Global
@@ -560,6 +862,11 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
  * Send a packet (ethernet header included!) of length 'len' to the server
  * to be injected onto the wire.
  *
+ * The header and the frame go out together with writev(..); the frame is
+ * not copied.  From within sr_handlepacket(..) the frame is queued (see
+ * struct sr_txq): a frame in the packet being handled must not be changed
+ * once it is sent.
+ *
  *---------------------------------------------------------------------------*/
 
 int sr_send_packet(struct sr_instance* sr /* borrowed */,
@@ -567,7 +874,8 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-    c_packet_header *sr_pkt;
+    c_packet_header hdr;
+    struct iovec iov[2];
     unsigned int total_len =  len + (sizeof(c_packet_header));
 
     /* REQUIRES */
@@ -581,33 +889,52 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
+    /* Create header */
+    hdr.mLen  = htonl(total_len);
+    hdr.mType = htonl(VNSPACKET);
+    strncpy(hdr.mInterfaceName,iface,16);
 
     /* -- log packet -- */
     sr_log_packet(sr,buf,len);
 
     if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
+    /* -- running on local interfaces -- */
+    if ( sr->io )
+    { return sr->io->send(sr->io, buf, len, iface); }
+
+    /* -- the io_uring loop owns the socket -- */
+    if ( sr->uring )
+    { return sr_uring_send(sr, &hdr, buf, len); }
+
+    if ( sr_tx_batching && len <= SR_TXQ_ARENA )
+    {
+        if (sr->txq == 0 && (sr->txq = malloc(sizeof(struct sr_txq))) != 0)
+        {
+            sr->txq->n = sr->txq->niov = sr->txq->nbatches = 0;
+            sr->txq->arena_len = 0;
+            sr->txq->batch = 0;
+        }
+        if (sr->txq)
+        { return sr_txq_add(sr, &hdr, buf, len); }
+    }
+
+    /* -- anything queued goes first -- */
+    if ( sr_tx_batching && sr_txq_flush(sr) != 0 )
+    { return -1; }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(c_packet_header);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+    if( sr_writev_all(sr, iov, 2) != 0 ){
         fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
         return -1;
     }
 
-    free(sr_pkt);
-
     return 0;
 } /* -- sr_send_packet -- */
 
@@ -634,8 +961,15 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
     h.caplen = size;
     h.len = (size < PACKET_DUMP_SIZE) ? size : PACKET_DUMP_SIZE;
 
+    /* -- written asynchronously by the io_uring loop -- */
+    if (sr->uring && sr_uring_log(sr, &h, buf) == 0)
+    { return; }
+
+    /* -- one record at a time from the worker threads (-j) -- */
+    flockfile(sr->logfile);
     sr_dump(sr->logfile, &h, buf);
     fflush(sr->logfile);
+    funlockfile(sr->logfile);
 } /* -- sr_log_packet -- */
 
 /*-----------------------------------------------------------------------------
@@ -663,7 +997,10 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
 
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
+            (a_hdr->ar_tip     != iface->ip ) &&
+            /* -- the NAT answers for its pool addresses on eth2 -- */
+            !(sr->nat && strcmp(interface, "eth2") == 0 &&
+              sr_nat_pool_has(sr->nat, a_hdr->ar_tip)) )
     { return 1; }
 
     return 0;
@@ -0,0 +1,212 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_workers.c
+ *
+ * Description:
+ *
+ * Worker threads for forwarding, see sr_workers.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_workers.h"
+
+#define SR_WORKER_RING 1024  /* frames per worker; a power of two */
+#define SR_WORKER_FRAME 2048 /* slot size to start with; slots grow */
+#define SR_WORKER_SPIN 1024  /* empty polls before a worker sleeps */
+
+struct sr_worker_slot {
+  uint8_t *buf;
+  unsigned int size;
+  unsigned int len;
+  char iface[sr_IFACE_NAMELEN];
+};
+
+struct sr_worker {
+  struct sr_instance *sr;
+  pthread_t thread;
+  pthread_mutex_t lock;  /* for sleeping */
+  pthread_cond_t wake;
+  int sleeping;
+  char pad0[64];         /* the ends of the ring on cache lines of their own */
+  unsigned long head;    /* written by the receive loop */
+  char pad1[64];
+  unsigned long tail;    /* written by the worker */
+  char pad2[64];
+  struct sr_worker_slot slots[SR_WORKER_RING];
+};
+
+struct sr_workers {
+  unsigned int n;
+  struct sr_worker *workers[SR_WORKERS_MAX];
+};
+
+/* set on the worker threads */
+static __thread int sr_worker_self = 0;
+
+/* Picks the worker for a frame: the same for every frame of each direction
+   of a flow (both directions only when the NAT does not rewrite it). */
+static unsigned int sr_workers_hash(const uint8_t *packet, unsigned int len,
+  unsigned int n)
+{
+  const sr_ethernet_hdr_t *eth = (const sr_ethernet_hdr_t *)packet;
+  const sr_ip_hdr_t *ip;
+  const sr_arp_hdr_t *arp;
+  const uint8_t *l4;
+  uint32_t h, ports;
+
+  if (len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)
+    && eth->ether_type == htons(ethertype_ip)) {
+    ip = (const sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+    h = ip->ip_src ^ ip->ip_dst;
+    l4 = (const uint8_t *)ip + ip->ip_hl * 4;
+    if ((ip->ip_p == ip_protocol_tcp || ip->ip_p == ip_protocol_udp)
+      && !(ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK))
+      && l4 + sizeof(ports) <= packet + len) {
+      memcpy(&ports, l4, sizeof(ports));
+      h ^= (ports >> 16) ^ (ports & 0xffff) ^ ip->ip_p;
+    }
+  }
+  else if (len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)
+    && eth->ether_type == htons(ethertype_arp)) {
+    arp = (const sr_arp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+    h = arp->ar_sip ^ arp->ar_tip;
+  }
+  else
+    return 0;
+
+  h *= 0x9e3779b1;  /* mixes the low bits into the high ones */
+  return (unsigned int)(((uint64_t)h * n) >> 32);
+}
+
+static void sr_worker_wake(struct sr_worker *w)
+{
+  pthread_mutex_lock(&(w->lock));
+  pthread_cond_signal(&(w->wake));
+  pthread_mutex_unlock(&(w->lock));
+}
+
+static void *sr_worker_run(void *arg)
+{
+  struct sr_worker *w = arg;
+  struct sr_worker_slot *slot;
+  unsigned long tail;
+  unsigned int spins = 0;
+
+  sr_worker_self = 1;
+  while (1) {
+    tail = w->tail;
+    if (tail == __atomic_load_n(&(w->head), __ATOMIC_ACQUIRE)) {
+      if (++spins < SR_WORKER_SPIN)
+        continue;
+      /* the receive loop looks at sleeping after it moves head */
+      pthread_mutex_lock(&(w->lock));
+      __atomic_store_n(&(w->sleeping), 1, __ATOMIC_SEQ_CST);
+      while (tail == __atomic_load_n(&(w->head), __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&(w->wake), &(w->lock));
+      __atomic_store_n(&(w->sleeping), 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&(w->lock));
+      spins = 0;
+      continue;
+    }
+    spins = 0;
+    slot = &(w->slots[tail & (SR_WORKER_RING - 1)]);
+    sr_handlepacket(w->sr, slot->buf, slot->len, slot->iface);
+    __atomic_store_n(&(w->tail), tail + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+int sr_workers_dispatch(struct sr_instance *sr, const uint8_t *packet,
+  unsigned int len, const char *iface)
+{
+  struct sr_workers *pool = sr->workers;
+  struct sr_worker *w;
+  struct sr_worker_slot *slot;
+  unsigned long head;
+  uint8_t *buf;
+
+  if (pool == NULL || sr_worker_self)
+    return -1;
+
+  w = pool->workers[sr_workers_hash(packet, len, pool->n)];
+  head = w->head;
+  while (head - __atomic_load_n(&(w->tail), __ATOMIC_ACQUIRE) == SR_WORKER_RING) {
+    if (__atomic_load_n(&(w->sleeping), __ATOMIC_SEQ_CST))
+      sr_worker_wake(w);
+    sched_yield();
+  }
+
+  slot = &(w->slots[head & (SR_WORKER_RING - 1)]);
+  if (len > slot->size) {
+    if ((buf = realloc(slot->buf, len)) == NULL)
+      return 0;  /* dropped */
+    slot->buf = buf;
+    slot->size = len;
+  }
+  memcpy(slot->buf, packet, len);
+  slot->len = len;
+  strncpy(slot->iface, iface, sr_IFACE_NAMELEN - 1);
+  __atomic_store_n(&(w->head), head + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&(w->sleeping), __ATOMIC_SEQ_CST))
+    sr_worker_wake(w);
+  return 0;
+}
+
+void sr_workers_drain(struct sr_instance *sr)
+{
+  struct sr_workers *pool = sr->workers;
+  unsigned int i;
+
+  if (pool == NULL || sr_worker_self)
+    return;
+  for (i = 0; i < pool->n; i++)
+    while (__atomic_load_n(&(pool->workers[i]->tail), __ATOMIC_ACQUIRE)
+      != pool->workers[i]->head)
+      sched_yield();
+}
+
+int sr_workers_open(struct sr_instance *sr, unsigned int n)
+{
+  struct sr_workers *pool;
+  struct sr_worker *w;
+  unsigned int i, j;
+
+  if (n == 0 || n > SR_WORKERS_MAX) {
+    fprintf(stderr, "workers: between 1 and %d\n", SR_WORKERS_MAX);
+    return -1;
+  }
+  if ((pool = calloc(1, sizeof(struct sr_workers))) == NULL)
+    return -1;
+
+  for (i = 0; i < n; i++) {
+    /* each in an allocation of its own, away from the others' lines */
+    if ((w = calloc(1, sizeof(struct sr_worker))) == NULL)
+      return -1;
+    w->sr = sr;
+    pthread_mutex_init(&(w->lock), NULL);
+    pthread_cond_init(&(w->wake), NULL);
+    for (j = 0; j < SR_WORKER_RING; j++) {
+      if ((w->slots[j].buf = malloc(SR_WORKER_FRAME)) == NULL)
+        return -1;
+      w->slots[j].size = SR_WORKER_FRAME;
+    }
+    if (pthread_create(&(w->thread), NULL, sr_worker_run, w) != 0) {
+      perror("workers: pthread_create");
+      return -1;
+    }
+    pthread_detach(w->thread);
+    pool->workers[i] = w;
+    pool->n++;
+  }
+  sr->workers = pool;
+  return 0;
+}
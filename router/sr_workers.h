@@ -0,0 +1,54 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_workers.h
+ *
+ * Description:
+ *
+ * Forwarding on worker threads (-j <n>).  The receive loop, whichever it is
+ * (VNS, or a backend of sr_io.h), no longer handles a frame itself: it
+ * hashes the frame's addresses and ports and copies it into that worker's
+ * ring, and the worker runs sr_handlepacket on it.
+ *
+ * - every frame of one direction of a flow goes to the same worker and
+ *   stays in order.  The hash is symmetric in the addresses and ports, but
+ *   the NAT rewrites them, so the two directions of a translated flow (the
+ *   internal host's frames and the replies to the external address) can
+ *   land on different workers; the NAT tables are shared and locked for
+ *   that.  ARP goes by the two protocol addresses, anything else to the
+ *   first worker.
+ * - each worker has a single producer, single consumer ring of frames; the
+ *   receive loop waits when one is full, a worker sleeps when its ring has
+ *   stayed empty for a while.
+ * - what the workers share is safe for concurrent readers: the ARP cache
+ *   lookup (sequence count), the NAT tables (epochs) and the flow cache
+ *   (per slot sequence counts).  The routing table and the interfaces do
+ *   not change once the router runs.
+ *
+ * Not with -a, whose loop has to do all the sending itself.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_WORKERS_H
+#define SR_WORKERS_H
+
+#include <inttypes.h>
+
+#define SR_WORKERS_MAX 64
+
+struct sr_instance;
+
+/* Starts n worker threads as sr->workers.  Before the interfaces are
+   opened: a backend may set them up differently (see sr_tap.c).  Returns 0
+   on success. */
+int sr_workers_open(struct sr_instance *sr, unsigned int n);
+
+/* Hands a received frame to its worker (for sr_handlepacket).  Returns -1,
+   leaving the frame alone, when it is to be handled by the caller: there are
+   no workers, or the caller is one.  Called from the receive loop only. */
+int sr_workers_dispatch(struct sr_instance *sr, const uint8_t *packet,
+  unsigned int len, const char *iface);
+
+/* Waits until the workers have handled all that was dispatched.  Called
+   from the receive loop only. */
+void sr_workers_drain(struct sr_instance *sr);
+
+#endif
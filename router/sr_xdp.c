@@ -0,0 +1,508 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_xdp.c
+ *
+ * Description:
+ *
+ * AF_XDP backend for local packet i/o (sr_io.h).  All interfaces share one
+ * UMEM, an area of SR_XDP_FRAME sized frames the kernel receives into and
+ * transmits from, so a frame the router forwards is never copied:
+ *
+ * - receive: an XDP program on each device redirects queue 0 to the
+ *   interface's socket (other queues go on to the kernel).  The kernel takes
+ *   free frames from the interface's fill ring and hands them back filled on
+ *   its rx ring; the receive loop passes them to sr_handlepacket where they
+ *   lie.
+ * - transmit: a frame sent from within sr_handlepacket that lies in the
+ *   frame being handled goes on the tx ring as it is, and returns to the free
+ *   frames once the kernel reports it on the completion ring.  Other frames
+ *   (arp requests, icmp errors, other threads) are copied into a free frame.
+ *   The receive loop tells the kernel about new tx descriptors once per pass
+ *   over the interfaces; other threads do so straight away.
+ *
+ * The XDP program is attached through a bpf link in native (driver) or
+ * generic mode, or whichever the kernel picks, and goes away with the
+ * process.  veth pairs take both modes, so no special NIC is needed; turn
+ * off tx checksum offload on their peers (ethtool -K <peer> tx off), since
+ * an AF_XDP frame does not say whether its checksum is still to be filled
+ * in (see sr_afp_csum).
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define SR_XDP_FRAME 2048   /* UMEM frame */
+#define SR_XDP_RING 2048    /* descriptors per ring, a power of two */
+#define SR_XDP_BATCH 64     /* rx descriptors per interface and pass */
+
+/* One of the four rings of a socket, shared with the kernel */
+struct sr_xdp_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *descs;          /* struct xdp_desc (rx, tx) or __u64 (fill, completion) */
+  uint32_t cached;      /* our producer (fill, tx) or consumer (rx, completion) */
+};
+
+struct sr_xdp_port {
+  char name[sr_IFACE_NAMELEN];
+  int fd;
+  int link_fd;          /* the XDP program stays attached while it is open */
+  int promisc_fd;
+  struct sr_xdp_ring rx, tx, fill, comp;
+  unsigned long tx_dropped;  /* tx ring or free frames ran out */
+};
+
+struct sr_xdp {
+  struct sr_io io;  /* first: passed around as its sr_io */
+  pthread_mutex_t lock;  /* free frames, tx and completion rings */
+  uint8_t *umem;
+  uint64_t *free;        /* offsets of the free frames */
+  unsigned int nfree;
+  unsigned int inflight; /* on a tx ring, not yet completed */
+  unsigned int nports;
+  struct sr_xdp_port ports[SR_IO_PORTS];
+};
+
+/* set in the receive loop, which tells the kernel once per pass */
+static __thread int sr_xdp_receiving = 0;
+/* the frame being handled, and whether it went out as it is */
+static __thread uint8_t *sr_xdp_rx_frame = NULL;
+static __thread int sr_xdp_rx_sent = 0;
+
+#define SR_XDP_DESC(ring, i) \
+  (&((struct xdp_desc *)(ring)->descs)[(i) & (SR_XDP_RING - 1)])
+#define SR_XDP_ADDR(ring, i) \
+  (&((uint64_t *)(ring)->descs)[(i) & (SR_XDP_RING - 1)])
+
+static long sr_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Publishes the port's new tx descriptors and has the kernel send them; in
+   copy mode it only sends a few dozen per call.  Called with the lock held. */
+static void sr_xdp_kick(struct sr_xdp_port *port)
+{
+  __atomic_store_n(port->tx.producer, port->tx.cached, __ATOMIC_RELEASE);
+  /* EAGAIN and the like: the kernel picks them up on the next one */
+  if (__atomic_load_n(port->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+    sendto(port->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+/* Returns the frames the kernel has sent to the free frames.  Called with
+   the lock held. */
+static void sr_xdp_complete(struct sr_xdp *xdp, struct sr_xdp_port *port)
+{
+  uint32_t end = __atomic_load_n(port->comp.producer, __ATOMIC_ACQUIRE);
+
+  while (port->comp.cached != end) {
+    xdp->free[xdp->nfree++] = *SR_XDP_ADDR(&(port->comp), port->comp.cached)
+      & ~(uint64_t)(SR_XDP_FRAME - 1);
+    port->comp.cached++;
+    xdp->inflight--;
+  }
+  __atomic_store_n(port->comp.consumer, end, __ATOMIC_RELEASE);
+}
+
+static int sr_xdp_send(struct sr_io *io, uint8_t *buf, unsigned int len,
+  const char *iface)
+{
+  struct sr_xdp *xdp = (struct sr_xdp *)io;
+  struct sr_xdp_port *port = NULL;
+  struct xdp_desc *desc;
+  uint64_t addr;
+  unsigned int i;
+
+  for (i = 0; i < xdp->nports; i++) {
+    if (strcmp(xdp->ports[i].name, iface) == 0) {
+      port = &(xdp->ports[i]);
+      break;
+    }
+  }
+  if (port == NULL || len > SR_XDP_FRAME)
+    return -1;
+
+  pthread_mutex_lock(&(xdp->lock));
+  if (port->tx.cached - __atomic_load_n(port->tx.consumer, __ATOMIC_ACQUIRE)
+    == SR_XDP_RING) {
+    sr_xdp_kick(port);
+    sr_xdp_complete(xdp, port);
+    if (port->tx.cached - __atomic_load_n(port->tx.consumer, __ATOMIC_ACQUIRE)
+      == SR_XDP_RING)
+      goto drop;
+  }
+  if (sr_xdp_rx_frame != NULL && !sr_xdp_rx_sent && buf >= sr_xdp_rx_frame
+    && buf + len <= sr_xdp_rx_frame + SR_XDP_FRAME) {
+    /* the frame being handled: it stays out of the free frames until the
+       kernel completes it */
+    addr = buf - xdp->umem;
+    sr_xdp_rx_sent = 1;
+  } else {
+    if (xdp->nfree == 0)
+      goto drop;
+    addr = xdp->free[--xdp->nfree];
+    memcpy(xdp->umem + addr, buf, len);
+  }
+  desc = SR_XDP_DESC(&(port->tx), port->tx.cached);
+  desc->addr = addr;
+  desc->len = len;
+  desc->options = 0;
+  port->tx.cached++;
+  xdp->inflight++;
+  if (!sr_xdp_receiving)
+    sr_xdp_kick(port);
+  pthread_mutex_unlock(&(xdp->lock));
+  return 0;
+
+drop:
+  port->tx_dropped++;
+  pthread_mutex_unlock(&(xdp->lock));
+  return -1;
+}
+
+/* Tops up the port's fill ring from the free frames.  Called with the lock
+   held. */
+static void sr_xdp_refill(struct sr_xdp *xdp, struct sr_xdp_port *port)
+{
+  uint32_t room = SR_XDP_RING - (port->fill.cached
+    - __atomic_load_n(port->fill.consumer, __ATOMIC_ACQUIRE));
+
+  if (room == 0 || xdp->nfree == 0)
+    return;
+  while (room-- > 0 && xdp->nfree > 0)
+    *SR_XDP_ADDR(&(port->fill), port->fill.cached++) = xdp->free[--xdp->nfree];
+  __atomic_store_n(port->fill.producer, port->fill.cached, __ATOMIC_RELEASE);
+  if (__atomic_load_n(port->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+    recvfrom(port->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* Handles up to SR_XDP_BATCH received frames.  Returns the number. */
+static unsigned int sr_xdp_rx(struct sr_instance *sr, struct sr_xdp *xdp,
+  struct sr_xdp_port *port)
+{
+  uint64_t done[SR_XDP_BATCH];
+  uint32_t avail = __atomic_load_n(port->rx.producer, __ATOMIC_ACQUIRE)
+    - port->rx.cached;
+  unsigned int n, ndone = 0, i;
+
+  n = avail < SR_XDP_BATCH ? avail : SR_XDP_BATCH;
+  for (i = 0; i < n; i++) {
+    struct xdp_desc *desc = SR_XDP_DESC(&(port->rx), port->rx.cached + i);
+    uint64_t frame = desc->addr & ~(uint64_t)(SR_XDP_FRAME - 1);
+    uint8_t *pkt = xdp->umem + desc->addr;
+
+    sr_xdp_rx_frame = xdp->umem + frame;
+    sr_xdp_rx_sent = 0;
+    sr_log_packet(sr, pkt, desc->len);
+    sr_handlepacket(sr, pkt, desc->len, port->name);
+    if (!sr_xdp_rx_sent)
+      done[ndone++] = frame;
+  }
+  sr_xdp_rx_frame = NULL;
+  port->rx.cached += n;
+  __atomic_store_n(port->rx.consumer, port->rx.cached, __ATOMIC_RELEASE);
+
+  if (ndone > 0) {
+    pthread_mutex_lock(&(xdp->lock));
+    memcpy(xdp->free + xdp->nfree, done, ndone * sizeof(uint64_t));
+    xdp->nfree += ndone;
+    pthread_mutex_unlock(&(xdp->lock));
+  }
+  return n;
+}
+
+static int sr_xdp_run(struct sr_io *io, struct sr_instance *sr)
+{
+  struct sr_xdp *xdp = (struct sr_xdp *)io;
+  struct pollfd fds[SR_IO_PORTS];
+  unsigned int i, busy;
+
+  for (i = 0; i < xdp->nports; i++) {
+    fds[i].fd = xdp->ports[i].fd;
+    fds[i].events = POLLIN;
+  }
+  sr_xdp_receiving = 1;
+  while (!sr->stopping) {
+    pthread_mutex_lock(&(xdp->lock));
+    for (i = 0; i < xdp->nports; i++) {
+      sr_xdp_complete(xdp, &(xdp->ports[i]));
+      sr_xdp_refill(xdp, &(xdp->ports[i]));
+    }
+    pthread_mutex_unlock(&(xdp->lock));
+
+    /* a batch per interface and pass, so none starves the others */
+    busy = 0;
+    for (i = 0; i < xdp->nports; i++)
+      busy += sr_xdp_rx(sr, xdp, &(xdp->ports[i]));
+
+    pthread_mutex_lock(&(xdp->lock));
+    for (i = 0; i < xdp->nports; i++)
+      if (xdp->ports[i].tx.cached
+        != __atomic_load_n(xdp->ports[i].tx.consumer, __ATOMIC_ACQUIRE))
+        sr_xdp_kick(&(xdp->ports[i]));
+    pthread_mutex_unlock(&(xdp->lock));
+
+    /* frames still on a tx ring come back without a wakeup */
+    if (!busy && sr_io_wait(sr, fds, xdp->nports, xdp->inflight ? 1 : -1) < 0
+      && errno != EINTR) {
+      perror("poll(..):sr_xdp.c::sr_xdp_run");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Maps one of the socket's rings. */
+static int sr_xdp_map_ring(int fd, struct sr_xdp_ring *ring,
+  const struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+  uint8_t *map = mmap(NULL, off->desc + SR_XDP_RING * desc_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+
+  if (map == MAP_FAILED)
+    return -1;
+  ring->producer = (uint32_t *)(map + off->producer);
+  ring->consumer = (uint32_t *)(map + off->consumer);
+  ring->flags = (uint32_t *)(map + off->flags);
+  ring->descs = map + off->desc;
+  ring->cached = 0;
+  return 0;
+}
+
+/* Attaches an XDP program redirecting queue 0 of ifindex to fd:
+     r2 = ctx->rx_queue_index
+     return bpf_redirect_map(xskmap, r2, XDP_PASS) */
+static int sr_xdp_attach(struct sr_xdp_port *port, unsigned int ifindex,
+  unsigned int flags)
+{
+  struct bpf_insn prog[6];
+  union bpf_attr attr;
+  char license[] = "GPL";
+  int map_fd, prog_fd;
+  uint32_t key = 0;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 1;
+  if ((map_fd = sr_xdp_bpf(BPF_MAP_CREATE, &attr)) < 0)
+    return -1;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)&(port->fd);
+  if (sr_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+    close(map_fd);
+    return -1;
+  }
+
+  memset(prog, 0, sizeof(prog));
+  prog[0].code = BPF_LDX | BPF_MEM | BPF_W;
+  prog[0].dst_reg = BPF_REG_2;
+  prog[0].src_reg = BPF_REG_1;
+  prog[0].off = offsetof(struct xdp_md, rx_queue_index);
+  prog[1].code = BPF_LD | BPF_DW | BPF_IMM;
+  prog[1].dst_reg = BPF_REG_1;
+  prog[1].src_reg = BPF_PSEUDO_MAP_FD;
+  prog[1].imm = map_fd;
+  prog[3].code = BPF_ALU64 | BPF_MOV | BPF_K;
+  prog[3].dst_reg = BPF_REG_3;
+  prog[3].imm = XDP_PASS;
+  prog[4].code = BPF_JMP | BPF_CALL;
+  prog[4].imm = BPF_FUNC_redirect_map;
+  prog[5].code = BPF_JMP | BPF_EXIT;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insns = (uintptr_t)prog;
+  attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+  attr.license = (uintptr_t)license;
+  prog_fd = sr_xdp_bpf(BPF_PROG_LOAD, &attr);
+  close(map_fd);  /* the program holds it */
+  if (prog_fd < 0)
+    return -1;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = flags;
+  port->link_fd = sr_xdp_bpf(BPF_LINK_CREATE, &attr);
+  close(prog_fd);  /* the link holds it */
+  return port->link_fd < 0 ? -1 : 0;
+}
+
+/* Opens the interface's socket; the first one registers the UMEM, the others
+   share it. */
+static int sr_xdp_open_port(struct sr_xdp *xdp, struct sr_xdp_port *port,
+  const struct sr_io_port *cfg, size_t umem_len, unsigned int flags)
+{
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sxdp;
+  socklen_t optlen = sizeof(off);
+  unsigned int ifindex = if_nametoindex(cfg->dev);
+  int size = SR_XDP_RING;
+  int first = port == &(xdp->ports[0]);
+
+  strncpy(port->name, cfg->name, sr_IFACE_NAMELEN - 1);
+  port->link_fd = port->promisc_fd = -1;
+  if (ifindex == 0) {
+    fprintf(stderr, "AF_XDP: no device %s\n", cfg->dev);
+    return -1;
+  }
+  if ((port->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+    perror("socket(..):sr_xdp.c::sr_xdp_open_port");
+    return -1;
+  }
+  if (first) {
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)xdp->umem;
+    reg.len = umem_len;
+    reg.chunk_size = SR_XDP_FRAME;
+    if (setsockopt(port->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0)
+      goto fail;
+  }
+  /* every device needs fill and completion rings of its own */
+  if (setsockopt(port->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) != 0
+    || setsockopt(port->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+      sizeof(size)) != 0
+    || setsockopt(port->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) != 0
+    || setsockopt(port->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) != 0
+    || getsockopt(port->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0)
+    goto fail;
+  if (sr_xdp_map_ring(port->fd, &(port->rx), &(off.rx), sizeof(struct xdp_desc),
+      XDP_PGOFF_RX_RING) != 0
+    || sr_xdp_map_ring(port->fd, &(port->tx), &(off.tx),
+      sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0
+    || sr_xdp_map_ring(port->fd, &(port->fill), &(off.fr), sizeof(uint64_t),
+      XDP_UMEM_PGOFF_FILL_RING) != 0
+    || sr_xdp_map_ring(port->fd, &(port->comp), &(off.cr), sizeof(uint64_t),
+      XDP_UMEM_PGOFF_COMPLETION_RING) != 0)
+    goto fail;
+
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = 0;
+  if (first) {
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+  } else {
+    /* takes copy/zero-copy and need wakeup from the first */
+    sxdp.sxdp_flags = XDP_SHARED_UMEM;
+    sxdp.sxdp_shared_umem_fd = xdp->ports[0].fd;
+  }
+  if (bind(port->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) != 0)
+    goto fail;
+  if (sr_xdp_attach(port, ifindex, flags) != 0)
+    goto fail;
+
+  if (cfg->promisc) {
+    /* a packet socket that receives nothing, for the membership; the device
+       leaves promiscuous mode when it is closed */
+    struct packet_mreq mr;
+    memset(&mr, 0, sizeof(mr));
+    mr.mr_ifindex = ifindex;
+    mr.mr_type = PACKET_MR_PROMISC;
+    if ((port->promisc_fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0
+      || setsockopt(port->promisc_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr,
+        sizeof(mr)) != 0)
+      goto fail;
+  }
+  return 0;
+
+fail:
+  fprintf(stderr, "AF_XDP on %s: %s\n", cfg->dev, strerror(errno));
+  if (port->promisc_fd >= 0)
+    close(port->promisc_fd);
+  if (port->link_fd >= 0)
+    close(port->link_fd);
+  close(port->fd);
+  return -1;
+}
+
+struct sr_io *sr_xdp_open(struct sr_instance *sr,
+  const struct sr_io_port *ports, unsigned int nports, const char *mode)
+{
+  struct sr_xdp *xdp = calloc(1, sizeof(struct sr_xdp));
+  /* a ring's worth for each fill, rx and tx ring */
+  unsigned int nframes = nports * 3 * SR_XDP_RING;
+  size_t umem_len = (size_t)nframes * SR_XDP_FRAME;
+  unsigned int i, flags = 0;
+
+  if (strcmp(mode, "native") == 0) {
+    flags = XDP_FLAGS_DRV_MODE;
+    xdp->io.name = "AF_XDP (native)";
+  } else if (strcmp(mode, "generic") == 0) {
+    flags = XDP_FLAGS_SKB_MODE;
+    xdp->io.name = "AF_XDP (generic)";
+  } else if (mode[0] == '\0') {
+    xdp->io.name = "AF_XDP";
+  } else {
+    fprintf(stderr, "AF_XDP: unknown mode %s (native or generic)\n", mode);
+    free(xdp);
+    return NULL;
+  }
+  xdp->io.send = sr_xdp_send;
+  xdp->io.run = sr_xdp_run;
+  pthread_mutex_init(&(xdp->lock), NULL);
+
+  xdp->umem = mmap(NULL, umem_len, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  xdp->free = malloc(nframes * sizeof(uint64_t));
+  if (xdp->umem == MAP_FAILED || xdp->free == NULL) {
+    perror("mmap(..):sr_xdp.c::sr_xdp_open");
+    free(xdp->free);
+    free(xdp);
+    return NULL;
+  }
+  for (i = 0; i < nframes; i++)
+    xdp->free[xdp->nfree++] = (uint64_t)(nframes - 1 - i) * SR_XDP_FRAME;
+
+  for (i = 0; i < nports; i++) {
+    if (sr_xdp_open_port(xdp, &(xdp->ports[i]), &(ports[i]), umem_len,
+        flags) != 0) {
+      while (i-- > 0) {
+        if (xdp->ports[i].promisc_fd >= 0)
+          close(xdp->ports[i].promisc_fd);
+        close(xdp->ports[i].link_fd);
+        close(xdp->ports[i].fd);
+      }
+      munmap(xdp->umem, umem_len);
+      free(xdp->free);
+      free(xdp);
+      return NULL;
+    }
+    sr_xdp_refill(xdp, &(xdp->ports[i]));
+  }
+  xdp->nports = nports;
+  return &(xdp->io);
+}
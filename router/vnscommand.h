@@ -40,7 +40,7 @@ typedef struct
     uint32_t mLen;
     uint32_t mType;        /* = VNSOPEN */
     uint16_t topoID;       /* Id of the topology we want to run on */
-    uint16_t pad;          /* unused */
+    uint16_t mFlags;       /* VNSOPEN_* (was unused: 0 from old clients) */
     char     mVirtualHostID[IDSIZE]; /* Id of the simulated router (e.g.
                                         'VNS-A'); */
     char     mUID[IDSIZE]; /* User id (e.g. "appenz"), for information only */
@@ -48,6 +48,11 @@ typedef struct
 
 }__attribute__ ((__packed__)) c_open;
 
+/* the client takes VNS_BATCH messages; a server that does too answers with
+   an empty one before VNSHWINFO, and from then on either side may send
+   them (see BATCH) */
+#define VNSOPEN_BATCH 1
+
 /*-----------------------------------------------------------------------------
                                  CLOSE
   ---------------------------------------------------------------------------*/
@@ -196,5 +201,24 @@ typedef struct
 
 }__attribute__ ((__packed__)) c_auth_status;
 
+/*-----------------------------------------------------------------------------
+                                 BATCH
+  ---------------------------------------------------------------------------*/
+
+#define VNS_BATCH       1024
+
+/* longest batch either side sends, header included */
+#define VNS_BATCH_MAX  16384
+
+/* Many frames in one message: a c_batch followed by whole VNSPACKET
+   messages (c_packet_header and frame), back to back.  Only sent to a peer
+   that negotiated it (VNSOPEN_BATCH); VNSPACKET stays valid alongside. */
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;        /* = VNS_BATCH */
+    uint8_t  packets[0];
+}__attribute__ ((__packed__)) c_batch;
+
 
 #endif  /* __VNSCOMMAND_H */